@@ -0,0 +1,119 @@
+/**
+ * Bundles of many small files that can be read all at once. Opening /.isofs/bundle/QUERY (where
+ * QUERY is the same as for the query directory, see query.h, but only ever matches regular files)
+ * gives a table of the files followed by all of their data, so a whole batch of files costs one
+ * open and a few large reads instead of an open, read, and close for each one. Using the `first`
+ * and `count` conditions a directory can be read as a series of bundles in the order of the index.
+ * When the query checks permissions (see Query.permits) the files that can't be read are left out.
+ *
+ * The table is text, starting with the line "isofs-bundle COUNT" followed by COUNT lines of
+ * "OFFSET SIZE PATH". The data of the files follows right after the table with no padding, with
+ * the offsets relative to the start of the data.
+ */
+
+#define BUNDLE_MAGIC "isofs-bundle"
+
+/**
+ * Where each file starts in a bundle.
+ */
+typedef struct _BundleFile {
+    uint64_t offset;    // where the data of the file starts in the bundle
+    const Node* node;   // the file
+} BundleFile;
+
+typedef struct _Bundle {
+    const Index* index;
+    TextBuffer table;   // the table of files at the start of the bundle
+    BundleFile* files;  // the files in the bundle in order
+    size_t nfiles;
+    uint64_t size;      // total size of the bundle
+} Bundle;
+
+/**
+ * Frees a bundle.
+ */
+void bundle_close(Bundle* bundle)
+{
+    free(bundle->table.data);
+    free(bundle->files);
+    free(bundle);
+}
+
+/**
+ * Runs a query and makes a bundle of the files that match and can be read. Returns NULL if out of
+ * memory.
+ */
+Bundle* bundle_open(const Index* index, Query* query)
+{
+    if (!query->type) { query->type = 'f'; }
+    TextBuffer results = { NULL, 0, 0 };
+    Bundle* bundle = (Bundle*)calloc(1, sizeof(Bundle));
+    if (!bundle || !query_run(index, query, &results)) { free(results.data); free(bundle); errno = ENOMEM; return NULL; }
+    bundle->index = index;
+
+    // Find the file of each line of the results
+    size_t count = 0;
+    for (size_t i = 0; i < results.length; i++) { count += results.data[i] == '\n'; }
+    const char** paths = (const char**)malloc((count ? count : 1) * sizeof(char*));
+    bundle->files = (BundleFile*)malloc((count ? count : 1) * sizeof(BundleFile));
+    if (!paths || !bundle->files) { free(paths); free(results.data); bundle_close(bundle); errno = ENOMEM; return NULL; }
+    uint64_t offset = 0;
+    for (char *line = results.data, *end; line && (end = strchr(line, '\n')); line = end + 1) {
+        *end = 0;
+        const Node* node = index_lookup(index, line);
+        if (!node || !S_ISREG(node->mode) || !query_permits(query, node, R_OK)) { continue; }
+        paths[bundle->nfiles] = line;
+        bundle->files[bundle->nfiles].offset = offset;
+        bundle->files[bundle->nfiles++].node = node;
+        offset += node->size;
+    }
+
+    // Make the table
+    bool ok = text_printf(&bundle->table, BUNDLE_MAGIC " %zu\n", bundle->nfiles);
+    for (size_t i = 0; i < bundle->nfiles && ok; i++) {
+        ok = text_printf(&bundle->table, "%" PRIu64 " %" PRIu64 " %s\n", bundle->files[i].offset, bundle->files[i].node->size, paths[i]);
+    }
+    free(paths);
+    free(results.data);
+    if (!ok) { bundle_close(bundle); errno = ENOMEM; return NULL; }
+    bundle->size = bundle->table.length + offset;
+    return bundle;
+}
+
+/**
+ * Reads part of a bundle, copying the data of each file from the image. Returns the number of
+ * bytes read or -1 if there is a problem, with errno set.
+ */
+ssize_t bundle_read(const Bundle* bundle, void* buf, size_t size, uint64_t offset)
+{
+    if (offset >= bundle->size) { return 0; }
+    if (bundle->size - offset < size) { size = bundle->size - offset; }
+    uint8_t* out = (uint8_t*)buf;
+    size_t done = 0;
+
+    // The table
+    if (offset < bundle->table.length) {
+        done = bundle->table.length - offset < size ? bundle->table.length - offset : size;
+        memcpy(out, bundle->table.data + offset, done);
+    }
+    if (done == size) { return size; }
+
+    // Find the file that the rest starts in
+    uint64_t pos = offset + done - bundle->table.length;
+    size_t low = 0, high = bundle->nfiles;
+    while (high - low > 1) {
+        size_t mid = (low + high) / 2;
+        if (bundle->files[mid].offset <= pos) { low = mid; } else { high = mid; }
+    }
+
+    // Copy from each file until done
+    for (size_t i = low; i < bundle->nfiles && done < size; i++) {
+        const BundleFile* file = &bundle->files[i];
+        if (pos >= file->offset + file->node->size) { continue; }
+        size_t n = file->offset + file->node->size - pos < size - done ? file->offset + file->node->size - pos : size - done;
+        if (index_read(bundle->index, file->node, out + done, n, pos - file->offset) < 0) { return -1; }
+        done += n;
+        pos += n;
+    }
+    return done;
+}
@@ -0,0 +1,341 @@
+/**
+ * A persistent local cache for ISO images that live on slow storage (like a network filesystem).
+ *
+ * The cache is a sparse file the same size as the image along with a bitmap of which blocks of it
+ * have been filled in. Both are kept in a cache directory and are named after the identity of the
+ * image (its size and a hash of its volume descriptors) so that they are reused the next time the
+ * same image is mounted, even if it is at a different path. Blocks are copied into the cache the
+ * first time they are needed and the ISO memory is a mapping of the cache file instead of the
+ * image itself. Optionally, a background "hydrate" thread fills in the rest of the cache in disc
+ * order while limiting itself to a given bandwidth.
+ *
+ * The cache directory also keeps the maps of which blocks of files are all zeros (see holes.h) in a
+ * third file, so that files are only scanned for them once.
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CACHE_BLOCK_SIZE    2048              // granularity of the cache (one ISO sector)
+#define CACHE_MAGIC         "ISOFSMAP"        // the first bytes of every bitmap file
+#define CACHE_HOLES_MAGIC   "ISOFSHO2"        // the first bytes of every hole maps file
+#define CACHE_SYNC_INTERVAL (64*1024*1024)    // bytes that may be fetched before the bitmap is saved
+#define CACHE_HYDRATE_CHUNK (256*1024)        // bytes fetched at a time by the hydrate thread
+
+/**
+ * The header of the bitmap file. The bitmap itself immediately follows it.
+ */
+typedef struct _CacheMapHeader {
+    char magic[8];       // always CACHE_MAGIC
+    uint64_t image_size; // size of the image this cache is for
+    uint32_t block_size; // always CACHE_BLOCK_SIZE
+    uint32_t _unused;    // always 0
+} CacheMapHeader;
+
+typedef struct _BlockCache {
+    int src_fd;           // file descriptor of the (slow) image itself
+    int cache_fd;         // file descriptor of the sparse cache file
+    int map_fd;           // file descriptor of the bitmap file
+    uint64_t size;        // size of the image in bytes
+    uint64_t nblocks;     // number of CACHE_BLOCK_SIZE blocks in the image (last may be partial)
+    uint8_t* bitmap;      // one bit for each block, set once the block is in the cache file
+    uint8_t* fetching;    // one bit for each block, set while a thread is copying it (needs the lock)
+    uint64_t unsynced;    // number of bytes fetched since the bitmap was last saved (needs the lock)
+    pthread_mutex_t lock; // held while claiming blocks to fetch, marking them, and saving the bitmap
+    pthread_cond_t fetched; // signaled when blocks have been copied (or failed to be)
+
+    // Background hydration
+    size_t hydrate_rate;  // bytes per second to fill the cache at, 0 to disable
+    pthread_t hydrate_thread;
+    bool hydrating;       // if the hydrate thread was started
+    bool stop;            // tells the hydrate thread to stop (set atomically under the lock)
+    pthread_cond_t wake;  // signaled when stop is set so the hydrate thread doesn't finish its sleep
+
+    // Saved hole maps of files (see holes.h), loaded when first needed
+    int holes_fd;         // file descriptor of the hole maps file (opened for appending)
+    uint8_t* holes;       // the contents of the hole maps file when it was loaded
+    uint8_t** hole_index; // where each record starts in holes, sorted by file
+    size_t nholes;        // number of records
+    uint64_t holes_end;   // where the last complete record ends, 0 if records can't be saved (needs the lock)
+    bool holes_loaded;    // if the hole maps file has been loaded (needs the lock to set)
+} BlockCache;
+
+/**
+ * Checks if a block is in the cache. This can be called without holding the lock since bits are
+ * only ever set and are set after the block is written.
+ */
+static inline bool cache_has_block(const BlockCache* cache, uint64_t block)
+{
+    return (__atomic_load_n(&cache->bitmap[block/8], __ATOMIC_ACQUIRE) >> (block%8)) & 1;
+}
+
+/**
+ * Saves the bitmap of present blocks to disk. The cache file is synced first so that a block is
+ * never marked as present on disk before its data is. The lock must be held.
+ */
+static bool cache_sync(BlockCache* cache)
+{
+    if (fdatasync(cache->cache_fd) == -1) { return false; }
+    size_t length = (cache->nblocks + 7) / 8;
+    if (pwrite(cache->map_fd, cache->bitmap, length, sizeof(CacheMapHeader)) != (ssize_t)length) { return false; }
+    cache->unsynced = 0;
+    return fdatasync(cache->map_fd) == 0;
+}
+
+/**
+ * Copies a run of blocks from the image into the cache file. Returns false if there is a problem,
+ * with errno set.
+ */
+static bool cache_copy(BlockCache* cache, uint8_t* buffer, uint64_t offset, size_t length)
+{
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = pread(cache->src_fd, buffer + done, length - done, offset + done);
+        if (n == -1 && errno == EINTR) { continue; }
+        if (n <= 0) { if (n == 0) { errno = EIO; } return false; }
+        done += n;
+    }
+    ssize_t n = pwrite(cache->cache_fd, buffer, length, offset);
+    if (n != (ssize_t)length) { if (n >= 0) { errno = EIO; } return false; }
+    return true;
+}
+
+/**
+ * Copies the blocks [first, last) from the image into the cache file, skipping ones that are
+ * already present. Runs of missing blocks are claimed under the lock but copied without it, so
+ * other threads can fetch other blocks at the same time, and blocks that another thread is
+ * already copying are waited for instead of being copied twice. The number of bytes copied is
+ * added to `fetched` if it is not NULL. The lock must not be held. Returns false if there is a
+ * problem, with errno set.
+ */
+static bool cache_fill(BlockCache* cache, uint64_t first, uint64_t last, uint64_t* fetched)
+{
+    uint8_t* buffer = NULL;
+    bool okay = true;
+    pthread_mutex_lock(&cache->lock);
+    uint64_t block = first;
+    while (block < last) {
+        if (cache_has_block(cache, block)) { block++; continue; }
+        if ((cache->fetching[block/8] >> (block%8)) & 1) { pthread_cond_wait(&cache->fetched, &cache->lock); continue; }
+
+        // Claim the next run of missing blocks (limited by the size of the buffer)
+        uint64_t end = block;
+        while (end < last && !cache_has_block(cache, end) && !((cache->fetching[end/8] >> (end%8)) & 1) &&
+               (end - block) < CACHE_HYDRATE_CHUNK/CACHE_BLOCK_SIZE) {
+            cache->fetching[end/8] |= 1 << (end%8);
+            end++;
+        }
+
+        // Copy the run from the image to the cache without the lock
+        pthread_mutex_unlock(&cache->lock);
+        uint64_t offset = block*CACHE_BLOCK_SIZE;
+        size_t length = (size_t)(end*CACHE_BLOCK_SIZE > cache->size ? cache->size - offset : (end - block)*CACHE_BLOCK_SIZE);
+        if (!buffer) { buffer = (uint8_t*)malloc(CACHE_HYDRATE_CHUNK); }
+        okay = buffer && cache_copy(cache, buffer, offset, length);
+        if (okay) { TRACE(cache__fetch, offset, length); }
+        int error = errno;
+        pthread_mutex_lock(&cache->lock);
+
+        // Mark the blocks as present (unless they failed) and wake up anyone waiting for them
+        for (uint64_t i = block; i < end; i++) {
+            cache->fetching[i/8] &= ~(1 << (i%8));
+            if (okay) { __atomic_fetch_or(&cache->bitmap[i/8], 1 << (i%8), __ATOMIC_RELEASE); }
+        }
+        pthread_cond_broadcast(&cache->fetched);
+        if (!okay) { errno = error; break; }
+        cache->unsynced += length;
+        if (fetched) { *fetched += length; }
+        block = end;
+    }
+    if (okay && cache->unsynced >= CACHE_SYNC_INTERVAL) { cache_sync(cache); }
+    pthread_mutex_unlock(&cache->lock);
+    free(buffer);
+    return okay;
+}
+
+/**
+ * The fetch function for ISOs that use a BlockCache. Makes sure all blocks in the range are in the
+ * cache file, copying them from the image if they are not.
+ */
+bool cache_fetch(const ISO* iso, uint64_t offset, uint64_t length)
+{
+    BlockCache* cache = (BlockCache*)iso->fetch_data;
+    uint64_t first = offset / CACHE_BLOCK_SIZE;
+    uint64_t last = length ? (offset + length - 1) / CACHE_BLOCK_SIZE + 1 : first;
+
+    // Fast path: everything is already cached
+    uint64_t block = first;
+    while (block < last && cache_has_block(cache, block)) { block++; }
+    if (block == last) { TRACE(cache__hit, offset, length); return true; }
+    TRACE(cache__miss, offset, length);
+    return cache_fill(cache, block, last, NULL);
+}
+
+/**
+ * Computes the identity of an image, which is its size along with a hash of the volume
+ * descriptor area. This is the same no matter where the image is located.
+ */
+static bool cache_identity(int fd, uint64_t size, char key[64])
+{
+    uint8_t data[16*2048];
+    size_t length = size > 0x8000 ? (size - 0x8000 < sizeof(data) ? (size_t)(size - 0x8000) : sizeof(data)) : 0;
+    ssize_t n = pread(fd, data, length, 0x8000);
+    if (n != (ssize_t)length) { if (n >= 0) { errno = EIO; } return false; }
+    uint64_t hash = 14695981039346656037ULL; // 64-bit FNV-1a
+    for (size_t i = 0; i < length; i++) { hash = (hash ^ data[i]) * 1099511628211ULL; }
+    snprintf(key, 64, "%016" PRIx64 "-%" PRIx64, hash, size);
+    return true;
+}
+
+/**
+ * Frees a BlockCache, saving its bitmap first. The image file descriptor is not closed.
+ */
+void cache_close(BlockCache* cache)
+{
+    if (cache->hydrating) {
+        pthread_mutex_lock(&cache->lock);
+        __atomic_store_n(&cache->stop, true, __ATOMIC_RELAXED);
+        pthread_cond_signal(&cache->wake);
+        pthread_mutex_unlock(&cache->lock);
+        pthread_join(cache->hydrate_thread, NULL);
+    }
+    pthread_mutex_lock(&cache->lock);
+    cache_sync(cache);
+    pthread_mutex_unlock(&cache->lock);
+    pthread_mutex_destroy(&cache->lock);
+    pthread_cond_destroy(&cache->fetched);
+    pthread_cond_destroy(&cache->wake);
+    close(cache->cache_fd);
+    close(cache->map_fd);
+    close(cache->holes_fd);
+    free(cache->bitmap);
+    free(cache->fetching);
+    free(cache->holes);
+    free(cache->hole_index);
+    free(cache);
+}
+
+/**
+ * Opens (or creates) the cache for the image with the given file descriptor in the cache directory.
+ * Returns NULL if there is a problem with errno set.
+ */
+BlockCache* cache_open(int src_fd, uint64_t size, const char* cache_dir)
+{
+    char key[64], path[PATH_MAX];
+    if ((size + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE / 8 >= SIZE_MAX) { errno = EFBIG; return NULL; } // bitmap too large
+    if (!cache_identity(src_fd, size, key)) { return NULL; }
+
+    BlockCache* cache = (BlockCache*)calloc(1, sizeof(BlockCache));
+    if (!cache) { return NULL; }
+    cache->src_fd = src_fd;
+    cache->size = size;
+    cache->nblocks = (size + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE;
+    cache->cache_fd = cache->map_fd = cache->holes_fd = -1;
+    size_t bitmap_length = (cache->nblocks + 7) / 8;
+    if (!(cache->bitmap = (uint8_t*)calloc(bitmap_length ? bitmap_length : 1, 1))) { goto error; }
+    if (!(cache->fetching = (uint8_t*)calloc(bitmap_length ? bitmap_length : 1, 1))) { goto error; }
+
+    // Open the cache and bitmap files
+    snprintf(path, sizeof(path), "%s/%s.img", cache_dir, key);
+    if ((cache->cache_fd = open(path, O_RDWR | O_CREAT, 0644)) == -1) { goto error; }
+    snprintf(path, sizeof(path), "%s/%s.map", cache_dir, key);
+    if ((cache->map_fd = open(path, O_RDWR | O_CREAT, 0644)) == -1) { goto error; }
+    snprintf(path, sizeof(path), "%s/%s.holes", cache_dir, key);
+    if ((cache->holes_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644)) == -1) { goto error; }
+
+    // Load the bitmap if it is for this image, otherwise start over with an empty cache (the hole
+    // maps file has the same header)
+    CacheMapHeader header, holes_header;
+    struct stat stats;
+    bool holes_okay = pread(cache->holes_fd, &holes_header, sizeof(holes_header), 0) == sizeof(holes_header) &&
+        memcmp(holes_header.magic, CACHE_HOLES_MAGIC, 8) == 0 && holes_header.image_size == size &&
+        holes_header.block_size == CACHE_BLOCK_SIZE;
+    if (pread(cache->map_fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, CACHE_MAGIC, 8) != 0 || header.image_size != size ||
+        header.block_size != CACHE_BLOCK_SIZE || fstat(cache->cache_fd, &stats) == -1 ||
+        (uint64_t)stats.st_size != size ||
+        pread(cache->map_fd, cache->bitmap, bitmap_length, sizeof(header)) != (ssize_t)bitmap_length) {
+        memset(cache->bitmap, 0, bitmap_length);
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, CACHE_MAGIC, 8);
+        header.image_size = size;
+        header.block_size = CACHE_BLOCK_SIZE;
+        if (ftruncate(cache->cache_fd, 0) == -1 || ftruncate(cache->cache_fd, size) == -1 ||
+            ftruncate(cache->map_fd, 0) == -1 ||
+            pwrite(cache->map_fd, &header, sizeof(header), 0) != sizeof(header) ||
+            pwrite(cache->map_fd, cache->bitmap, bitmap_length, sizeof(header)) != (ssize_t)bitmap_length) { goto error; }
+        holes_okay = false;
+    }
+    if (!holes_okay) {
+        memcpy(header.magic, CACHE_HOLES_MAGIC, 8);
+        if (ftruncate(cache->holes_fd, 0) == -1 || write(cache->holes_fd, &header, sizeof(header)) != sizeof(header)) { goto error; }
+    }
+
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->fetched, NULL);
+    pthread_condattr_t attr; // the hydrate thread sleeps until a time on the monotonic clock
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cache->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    return cache;
+
+error:
+    if (cache->cache_fd != -1) { close(cache->cache_fd); }
+    if (cache->map_fd != -1) { close(cache->map_fd); }
+    if (cache->holes_fd != -1) { close(cache->holes_fd); }
+    free(cache->bitmap);
+    free(cache->fetching);
+    free(cache);
+    return NULL;
+}
+
+/**
+ * The hydrate thread: fills in the cache in disc order at no more than the hydrate rate.
+ */
+static void* cache_hydrate(void* arg)
+{
+    BlockCache* cache = (BlockCache*)arg;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t fetched = 0;
+    const uint64_t chunk = CACHE_HYDRATE_CHUNK / CACHE_BLOCK_SIZE;
+    for (uint64_t block = 0; block < cache->nblocks && !__atomic_load_n(&cache->stop, __ATOMIC_RELAXED); block += chunk) {
+        uint64_t end = block + chunk < cache->nblocks ? block + chunk : cache->nblocks;
+        if (!cache_fill(cache, block, end, &fetched)) { break; }
+
+        // Sleep until the average rate is no more than the hydrate rate (or until told to stop)
+        double wanted = (double)fetched / cache->hydrate_rate;
+        struct timespec until = { start.tv_sec + (time_t)wanted, start.tv_nsec + (long)((wanted - (time_t)wanted) * 1e9) };
+        if (until.tv_nsec >= 1000000000) { until.tv_sec++; until.tv_nsec -= 1000000000; }
+        pthread_mutex_lock(&cache->lock);
+        while (!__atomic_load_n(&cache->stop, __ATOMIC_RELAXED) &&
+               pthread_cond_timedwait(&cache->wake, &cache->lock, &until) != ETIMEDOUT) { }
+        pthread_mutex_unlock(&cache->lock);
+    }
+    pthread_mutex_lock(&cache->lock);
+    cache_sync(cache);
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+}
+
+/**
+ * Starts filling in the cache in the background at the given rate (in bytes per second). This
+ * must be called after FUSE has moved to the background since threads do not survive the fork.
+ */
+bool cache_start_hydrate(BlockCache* cache, size_t rate)
+{
+    if (rate == 0 || cache->hydrating) { return true; }
+    cache->hydrate_rate = rate;
+    __atomic_store_n(&cache->stop, false, __ATOMIC_RELAXED);
+    if ((errno = pthread_create(&cache->hydrate_thread, NULL, cache_hydrate, cache)) != 0) { return false; }
+    cache->hydrating = true;
+    return true;
+}
@@ -0,0 +1,268 @@
+/**
+ * Sharing reads fairly between users. The reads handed off to the data threads (see loop.h) wait
+ * in a queue for each user (by the uid of the process reading) and are taken from the queues with
+ * deficit round-robin: each user in turn gets a quantum of bytes times its weight to spend on its
+ * reads, so one user copying a huge file off the image only gets its share of the data threads
+ * while others are reading too. Users can also be given a most bytes per second that they can read.
+ *
+ * The weights and rates are set with `-o share=UID:WEIGHT[:RATE]` (for example `share=1000:4:50M`)
+ * which can be given more than once, and other users have a weight of 1 and no limit. How much each
+ * user has read and is reading can be seen in /.isofs/users, one line for each user as
+ * "UID WEIGHT RATE READING WAITING READS BYTES" after lines starting with # (where RATE is - for
+ * no limit, READING is the number of reads being handled, and WAITING the number waiting).
+ */
+
+#include <time.h>
+
+#define FAIR_QUANTUM (128*1024) // bytes each user can read for each turn, times its weight
+
+/**
+ * A read waiting for its turn. These are allocated with malloc() by the caller, with this at the
+ * start, and are freed with free().
+ */
+typedef struct _FairRequest {
+    struct _FairRequest* next;
+    struct _FairUser* user;  // set when it is added
+    uid_t uid;
+    uint64_t cost;           // number of bytes being read
+} FairRequest;
+
+typedef struct _FairUser {
+    uid_t uid;
+    unsigned weight;
+    uint64_t rate;           // most bytes per second to read, or 0 for no limit
+    double tokens;           // bytes that can be read now without going over the rate (can be negative)
+    uint64_t refilled;       // when the tokens were last added to
+    int64_t deficit;         // bytes that can still be read this turn
+    FairRequest *first, *last; // the reads waiting, oldest first
+    struct _FairUser* next_active; // the next user with reads waiting
+    bool active;             // if in the list of users with reads waiting
+    uint32_t reading;        // number of reads being handled
+    uint32_t waiting;        // number of reads waiting
+    uint64_t reads, bytes;   // totals of the reads handled
+} FairUser;
+
+typedef struct _FairShare {
+    pthread_mutex_t lock;    // held while using anything in here
+    FairUser** users;        // all users seen or configured, sorted by uid
+    size_t nusers, capacity;
+    FairUser *active, *last_active; // the users with reads waiting, in the order of their turns
+} FairShare;
+
+/**
+ * Gets the current time in nanoseconds.
+ */
+static inline uint64_t fair_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Sets up an empty fair share.
+ */
+void fair_init(FairShare* fair)
+{
+    memset(fair, 0, sizeof(FairShare));
+    pthread_mutex_init(&fair->lock, NULL);
+}
+
+/**
+ * Frees a fair share, including any reads still waiting.
+ */
+void fair_free(FairShare* fair)
+{
+    for (size_t i = 0; i < fair->nusers; i++) {
+        for (FairRequest* req = fair->users[i]->first, *next; req; req = next) { next = req->next; free(req); }
+        free(fair->users[i]);
+    }
+    free(fair->users);
+    pthread_mutex_destroy(&fair->lock);
+}
+
+/**
+ * Finds a user, adding it (with a weight of 1 and no limit) if it hasn't been seen before. The lock
+ * must be held. Returns NULL if out of memory.
+ */
+static FairUser* fair_user(FairShare* fair, uid_t uid)
+{
+    size_t low = 0, high = fair->nusers;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (fair->users[mid]->uid < uid) { low = mid + 1; } else { high = mid; }
+    }
+    if (low < fair->nusers && fair->users[low]->uid == uid) { return fair->users[low]; }
+    if (fair->nusers == fair->capacity) {
+        size_t capacity = fair->capacity ? fair->capacity * 2 : 16;
+        FairUser** users = (FairUser**)realloc(fair->users, capacity * sizeof(FairUser*));
+        if (!users) { return NULL; }
+        fair->users = users;
+        fair->capacity = capacity;
+    }
+    FairUser* user = (FairUser*)calloc(1, sizeof(FairUser));
+    if (!user) { return NULL; }
+    user->uid = uid;
+    user->weight = 1;
+    memmove(fair->users + low + 1, fair->users + low, (fair->nusers - low) * sizeof(FairUser*));
+    fair->users[low] = user;
+    fair->nusers++;
+    return user;
+}
+
+/**
+ * Sets the weight and rate of a user from "UID:WEIGHT[:RATE]" where the rate can have a K, M, or G
+ * suffix. Returns false if it isn't valid (with errno set to EINVAL) or if out of memory.
+ */
+bool fair_set(FairShare* fair, const char* str)
+{
+    char* end;
+    size_t rate = 0;
+    unsigned long uid = strtoul(str, &end, 10);
+    if (end == str || *end != ':' || str[0] == '-') { errno = EINVAL; return false; }
+    const char* weight_str = end + 1;
+    unsigned long weight = strtoul(weight_str, &end, 10);
+    if (end == weight_str || weight_str[0] == '-' || weight == 0 || weight > 1000000 ||
+        (*end && (*end != ':' || !parse_size(end + 1, &rate)))) { errno = EINVAL; return false; }
+    pthread_mutex_lock(&fair->lock);
+    FairUser* user = fair_user(fair, (uid_t)uid);
+    if (user) {
+        user->weight = (unsigned)weight;
+        user->rate = rate;
+        user->tokens = (double)rate;
+    }
+    pthread_mutex_unlock(&fair->lock);
+    if (!user) { errno = ENOMEM; }
+    return user != NULL;
+}
+
+/**
+ * Adds a read to the end of the queue of its user. The lock must be held. Returns false if out of
+ * memory.
+ */
+bool fair_push(FairShare* fair, FairRequest* req)
+{
+    FairUser* user = fair_user(fair, req->uid);
+    if (!user) { return false; }
+    req->user = user;
+    req->next = NULL;
+    if (user->last) { user->last->next = req; } else { user->first = req; }
+    user->last = req;
+    user->waiting++;
+    if (!user->active) {
+        // A user that just started reading starts its turn with nothing saved up
+        user->active = true;
+        user->deficit = 0;
+        user->next_active = NULL;
+        if (fair->last_active) { fair->last_active->next_active = user; } else { fair->active = user; }
+        fair->last_active = user;
+    }
+    return true;
+}
+
+/**
+ * Moves the user whose turn it is to the end of the list of users with reads waiting.
+ */
+static inline void fair_next_turn(FairShare* fair)
+{
+    FairUser* user = fair->active;
+    if (!user->next_active) { return; }
+    fair->active = user->next_active;
+    user->next_active = NULL;
+    fair->last_active->next_active = user;
+    fair->last_active = user;
+}
+
+/**
+ * Takes the next read to handle. The lock must be held. Returns NULL if there aren't any reads
+ * waiting that can be handled now, in which case wait is set to the nanoseconds until one of the
+ * users with a limit can read again (or 0 if no reads are waiting).
+ */
+FairRequest* fair_pop(FairShare* fair, uint64_t* wait)
+{
+    uint64_t now = fair_now();
+    size_t limited = 0, nactive = 0;
+    *wait = 0;
+    for (FairUser* user = fair->active; user; user = user->next_active) { nactive++; }
+    while (fair->active && limited < nactive) {
+        FairUser* user = fair->active;
+
+        // Users with a limit get tokens for the time since they last read, up to a second's worth
+        if (user->rate) {
+            user->tokens += (double)(now - user->refilled) * user->rate / 1e9;
+            if (user->tokens > user->rate) { user->tokens = (double)user->rate; }
+            user->refilled = now;
+            if (user->tokens <= 0) {
+                uint64_t until = (uint64_t)(-user->tokens * 1e9 / user->rate) + 1;
+                if (*wait == 0 || until < *wait) { *wait = until; }
+                limited++;
+                fair_next_turn(fair);
+                continue;
+            }
+        }
+        limited = 0;
+
+        // Take the oldest read if this turn has enough left for it, otherwise it is the next user's turn
+        FairRequest* req = user->first;
+        if ((int64_t)req->cost > user->deficit) {
+            user->deficit += (int64_t)FAIR_QUANTUM * user->weight;
+            fair_next_turn(fair);
+            continue;
+        }
+        user->deficit -= req->cost;
+        if (user->rate) { user->tokens -= req->cost; }
+        if (!(user->first = req->next)) {
+            // Nothing else waiting, so the user is out of the list until it reads again
+            user->last = NULL;
+            user->active = false;
+            fair->active = user->next_active;
+            if (!fair->active) { fair->last_active = NULL; }
+            user->next_active = NULL;
+        }
+        user->waiting--;
+        user->reading++;
+        return req;
+    }
+    return NULL;
+}
+
+/**
+ * Records that a read taken with fair_pop() is done. The lock must be held.
+ */
+void fair_done(FairShare* fair, const FairRequest* req)
+{
+    (void)fair;
+    req->user->reading--;
+    req->user->reads++;
+    req->user->bytes += req->cost;
+}
+
+/**
+ * Writes how much each user has read and is reading, as in /.isofs/users. Returns false if out of
+ * memory.
+ */
+bool fair_report(FairShare* fair, TextBuffer* text)
+{
+    pthread_mutex_lock(&fair->lock);
+    bool ok = text_printf(text, "# quantum: %u bytes\n# uid weight rate reading waiting reads bytes\n", FAIR_QUANTUM);
+    for (size_t i = 0; i < fair->nusers && ok; i++) {
+        const FairUser* user = fair->users[i];
+        if (user->rate) {
+            ok = text_printf(text, "%ju %u %" PRIu64 " %" PRIu32 " %" PRIu32 " %" PRIu64 " %" PRIu64 "\n", (uintmax_t)user->uid, user->weight,
+                             user->rate, user->reading, user->waiting, user->reads, user->bytes);
+        } else {
+            ok = text_printf(text, "%ju %u - %" PRIu32 " %" PRIu32 " %" PRIu64 " %" PRIu64 "\n", (uintmax_t)user->uid, user->weight,
+                             user->reading, user->waiting, user->reads, user->bytes);
+        }
+    }
+    pthread_mutex_unlock(&fair->lock);
+    return ok;
+}
+
+/**
+ * Checks if a node is the users file.
+ */
+static inline bool fair_is_users_file(const Index* index, const Node* node)
+{
+    return node && index->generated && node->parent == index->generated && strcmp(node->name, USERS_FILE) == 0;
+}
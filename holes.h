@@ -0,0 +1,396 @@
+/**
+ * Finding the blocks of files that are all zeros, for images with large and mostly empty files
+ * (like virtual machine disk images). The first time the holes of a file are asked for its data is
+ * scanned and a bitmap of its HOLE_BLOCK_SIZE blocks is kept with its node. After that:
+ *
+ *   - reads of the blocks that are all zeros don't touch the image at all
+ *   - st_blocks only counts the blocks with data, so `du` and sparse-aware tools (like
+ *     `cp --sparse=auto`) can see that the file is sparse
+ *   - the user.isofs.data extended attribute lists where the data of the file is, as
+ *     "OFFSET LENGTH" lines, which is what walking it with SEEK_DATA and SEEK_HOLE would give
+ *
+ * Files of at least HOLE_SCAN_MIN_SIZE are scanned by a background thread after they are opened,
+ * one at a time in the order they were opened, and getting the extended attribute scans the file
+ * right away if it hasn't been yet (FUSE 2.6 has no lseek operation, so SEEK_DATA and SEEK_HOLE
+ * themselves can't be answered). With a cache directory (see cache.h) the bitmaps are saved in it
+ * as well so every file is only ever scanned once, and the saved bitmap of a file is loaded the
+ * first time its attributes are asked for.
+ */
+
+#define HOLE_BLOCK_SIZE    4096        // size of the blocks that are checked for zeros
+#define HOLE_SCAN_SIZE     (1024*1024) // bytes of a file read at a time while scanning it
+#define HOLE_SCAN_MIN_SIZE (1024*1024) // smallest file that is scanned in the background when opened
+#define HOLE_SCAN_QUEUE    256         // most opened files waiting to be scanned
+
+/**
+ * Which blocks of a file are all zeros.
+ */
+typedef struct _HoleMap {
+    uint64_t nblocks; // number of blocks in the file (the last one may be partial)
+    uint64_t ndata;   // number of blocks that aren't all zeros
+    uint8_t bits[];   // one bit for each block, set if the block is all zeros
+} HoleMap;
+
+/**
+ * A saved hole map of a file in the hole maps file of a cache, followed by the bits of the map. The
+ * file is identified by where its data starts and its size.
+ */
+typedef struct _HoleRecord {
+    uint64_t start; // logical byte offset of the first extent of the file
+    uint64_t size;  // size of the file
+    uint64_t check; // checksum of the start, size, and bits (see holes_checksum())
+} HoleRecord;
+
+static inline uint64_t holes_nblocks(uint64_t size) { return (size + HOLE_BLOCK_SIZE - 1) / HOLE_BLOCK_SIZE; }
+static inline bool holes_is_zero(const HoleMap* map, uint64_t block) { return (map->bits[block/8] >> (block%8)) & 1; }
+
+/**
+ * Checks if some data is all zeros. The words are ORed together without any branches so that the
+ * compiler can vectorize the loop.
+ */
+static bool holes_zero(const uint8_t* data, size_t length)
+{
+    uint64_t any = 0;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        any |= word;
+    }
+    for (; i < length; i++) { any |= data[i]; }
+    return any == 0;
+}
+
+/**
+ * Gets the cache that the hole map of a file can be saved in along with the start of its data. The
+ * start of the first extent is used to identify the file so files without one can't be saved.
+ */
+static BlockCache* holes_cache(const Index* index, const Node* node, uint64_t* start)
+{
+    if (node->nextents == 0 || node->extents[0].start == EXTENT_HOLE) { return NULL; }
+    const ISO* iso = index_volume(index, node->extents[0].volume);
+    *start = node->extents[0].start;
+    return iso ? (BlockCache*)iso->fetch_data : NULL;
+}
+
+static const HoleRecord* holes_record(const BlockCache* cache, size_t i) { return (const HoleRecord*)cache->hole_index[i]; }
+
+/**
+ * Computes the checksum of a record, which is a 64-bit FNV-1a hash of its start, size, and the bits
+ * that follow it.
+ */
+static uint64_t holes_checksum(const HoleRecord* record)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    const uint8_t* header = (const uint8_t*)record;
+    for (size_t i = 0; i < offsetof(HoleRecord, check); i++) { hash = (hash ^ header[i]) * 1099511628211ULL; }
+    const uint8_t* bits = (const uint8_t*)(record + 1);
+    for (uint64_t i = 0; i < (holes_nblocks(record->size) + 7) / 8; i++) { hash = (hash ^ bits[i]) * 1099511628211ULL; }
+    return hash;
+}
+
+static int compare_hole_records(const void* a, const void* b)
+{
+    const HoleRecord* x = *(const HoleRecord* const*)a;
+    const HoleRecord* y = *(const HoleRecord* const*)b;
+    if (x->start != y->start) { return x->start < y->start ? -1 : 1; }
+    return x->size < y->size ? -1 : x->size > y->size;
+}
+
+/**
+ * Loads the hole maps file of a cache and sorts its records, if that hasn't been done yet. The
+ * records stop at the first one that is cut off or doesn't match its checksum (from a crash or a
+ * short write while it was being added), and the file is truncated there so that records saved
+ * later line up. Records can only be saved once this has been done.
+ */
+static void holes_load(BlockCache* cache)
+{
+    if (__atomic_load_n(&cache->holes_loaded, __ATOMIC_ACQUIRE)) { return; }
+    pthread_mutex_lock(&cache->lock);
+    struct stat stats;
+    if (!cache->holes_loaded && fstat(cache->holes_fd, &stats) == 0 && (size_t)stats.st_size >= sizeof(CacheMapHeader) &&
+        (cache->holes = (uint8_t*)malloc(stats.st_size)) && pread(cache->holes_fd, cache->holes, stats.st_size, 0) == stats.st_size) {
+        // Find where each record starts
+        size_t capacity = 0;
+        uint64_t pos = sizeof(CacheMapHeader);
+        while (pos + sizeof(HoleRecord) <= (uint64_t)stats.st_size) {
+            const HoleRecord* record = (const HoleRecord*)(cache->holes + pos);
+            uint64_t length = (sizeof(HoleRecord) + (holes_nblocks(record->size) + 7) / 8 + 7) & ~(uint64_t)7;
+            if (record->size > (uint64_t)stats.st_size * 8 * HOLE_BLOCK_SIZE || length > (uint64_t)stats.st_size - pos ||
+                holes_checksum(record) != record->check) { break; }
+            if (cache->nholes == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                uint8_t** index = (uint8_t**)realloc(cache->hole_index, capacity * sizeof(uint8_t*));
+                if (!index) { break; }
+                cache->hole_index = index;
+            }
+            cache->hole_index[cache->nholes++] = cache->holes + pos;
+            pos += length;
+        }
+        qsort(cache->hole_index, cache->nholes, sizeof(uint8_t*), compare_hole_records);
+
+        // Drop whatever is after the last good record
+        if (pos == (uint64_t)stats.st_size || ftruncate(cache->holes_fd, pos) == 0) { cache->holes_end = pos; }
+    }
+    __atomic_store_n(&cache->holes_loaded, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Finds the saved hole map of a file in a cache. Returns a copy of it or NULL if there isn't one.
+ */
+static HoleMap* holes_find_saved(BlockCache* cache, uint64_t start, uint64_t size)
+{
+    holes_load(cache);
+    size_t low = 0, high = cache->nholes;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        const HoleRecord* record = holes_record(cache, mid);
+        if (record->start < start || (record->start == start && record->size < size)) { low = mid + 1; } else { high = mid; }
+    }
+    if (low == cache->nholes || holes_record(cache, low)->start != start || holes_record(cache, low)->size != size) { return NULL; }
+    uint64_t nblocks = holes_nblocks(size), length = (nblocks + 7) / 8;
+    HoleMap* map = (HoleMap*)malloc(sizeof(HoleMap) + length);
+    if (!map) { return NULL; }
+    map->nblocks = nblocks;
+    memcpy(map->bits, holes_record(cache, low) + 1, length);
+    map->ndata = nblocks;
+    for (uint64_t i = 0; i < nblocks; i++) { map->ndata -= holes_is_zero(map, i); }
+    return map;
+}
+
+/**
+ * Saves the hole map of a file to the end of the hole maps file of a cache, padded to 8 bytes. If
+ * it can't all be written then the file is truncated back to where it was, and if that fails then
+ * no more records are saved.
+ */
+static void holes_save(BlockCache* cache, uint64_t start, uint64_t size, const HoleMap* map)
+{
+    holes_load(cache);
+    uint64_t length = (sizeof(HoleRecord) + (map->nblocks + 7) / 8 + 7) & ~(uint64_t)7;
+    uint8_t* record = (uint8_t*)calloc(1, length);
+    if (!record) { return; }
+    HoleRecord* header = (HoleRecord*)record;
+    header->start = start;
+    header->size = size;
+    memcpy(record + sizeof(HoleRecord), map->bits, (map->nblocks + 7) / 8);
+    header->check = holes_checksum(header);
+    pthread_mutex_lock(&cache->lock);
+    ssize_t n = cache->holes_end ? write(cache->holes_fd, record, length) : 0;
+    if (n == (ssize_t)length) { cache->holes_end += length; }
+    else if (cache->holes_end) {
+        if (n >= 0) { errno = EIO; }
+        perror("saving hole map");
+        if (ftruncate(cache->holes_fd, cache->holes_end) == -1) { cache->holes_end = 0; }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    free(record);
+}
+
+/**
+ * Reads all of the data of a file to find the blocks that are all zeros, giving up if *stop is set
+ * (if stop isn't NULL). Returns NULL if there is a problem or it gave up, with errno set.
+ */
+static HoleMap* holes_scan(const Index* index, const Node* node, const bool* stop)
+{
+    uint64_t nblocks = holes_nblocks(node->size);
+    HoleMap* map = (HoleMap*)calloc(1, sizeof(HoleMap) + (nblocks + 7) / 8);
+    uint8_t* buffer = (uint8_t*)malloc(HOLE_SCAN_SIZE);
+    if (!map || !buffer) { free(map); free(buffer); errno = ENOMEM; return NULL; }
+    map->nblocks = map->ndata = nblocks;
+    for (uint64_t offset = 0; offset < node->size; offset += HOLE_SCAN_SIZE) {
+        if (stop && __atomic_load_n(stop, __ATOMIC_RELAXED)) { free(map); free(buffer); errno = ECANCELED; return NULL; }
+        ssize_t n = index_read(index, node, buffer, HOLE_SCAN_SIZE, offset);
+        if (n < 0) { free(map); free(buffer); return NULL; }
+        for (ssize_t i = 0; i < n; i += HOLE_BLOCK_SIZE) {
+            if (!holes_zero(buffer + i, n - i < HOLE_BLOCK_SIZE ? n - i : HOLE_BLOCK_SIZE)) { continue; }
+            uint64_t block = (offset + i) / HOLE_BLOCK_SIZE;
+            map->bits[block/8] |= 1 << (block%8);
+            map->ndata--;
+        }
+    }
+    free(buffer);
+    return map;
+}
+
+/**
+ * Same as holes_get(), but a scan gives up if *stop is set (if stop isn't NULL).
+ */
+static const HoleMap* holes_get_until(const Index* index, const Node* node, bool scan, const bool* stop)
+{
+    node = index_original(node);
+    HoleMap* map = __atomic_load_n(&node->holes, __ATOMIC_ACQUIRE);
+    if (map || !S_ISREG(node->mode) || node->generated) { return map; }
+    uint64_t start;
+    BlockCache* cache = holes_cache(index, node, &start);
+    bool saved = cache && (map = holes_find_saved(cache, start, node->size));
+    if (!map && (!scan || !(map = holes_scan(index, node, stop)))) { return NULL; }
+
+    // Keep the map with the node, unless another thread got there first
+    HoleMap* expected = NULL;
+    if (!__atomic_compare_exchange_n(&((Node*)node)->holes, &expected, map, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(map);
+        return expected;
+    }
+    if (cache && !saved) { holes_save(cache, start, node->size, map); }
+    return map;
+}
+
+/**
+ * Gets the hole map of a file. If it isn't known yet it is loaded from the cache, and if it isn't
+ * there either then the file is scanned if `scan` is true. Only regular files have hole maps.
+ * Returns NULL if the map isn't known (with errno set if there was a problem getting it). The maps
+ * of the nodes of replicas are kept with the original nodes.
+ */
+const HoleMap* holes_get(const Index* index, const Node* node, bool scan)
+{
+    return holes_get_until(index, node, scan, NULL);
+}
+
+/**
+ * Scans the files that have been opened for holes in the background, one at a time.
+ */
+typedef struct _HoleScanner {
+    const Index* index;
+    const Node* queue[HOLE_SCAN_QUEUE]; // the files waiting to be scanned, in a ring
+    size_t first, count;   // where the queue starts and how many files are in it
+    pthread_mutex_t lock;  // held while using any of the above
+    pthread_cond_t wake;   // signalled when there are files to scan or to stop
+    pthread_t thread;
+    bool stop;             // tells the thread to stop
+} HoleScanner;
+
+/**
+ * The scanner thread: scans the files in the queue in order.
+ */
+static void* holes_scanner(void* arg)
+{
+    HoleScanner* scanner = (HoleScanner*)arg;
+    pthread_mutex_lock(&scanner->lock);
+    while (!scanner->stop) {
+        if (!scanner->count) { pthread_cond_wait(&scanner->wake, &scanner->lock); continue; }
+        const Node* node = scanner->queue[scanner->first];
+        scanner->first = (scanner->first + 1) % HOLE_SCAN_QUEUE;
+        scanner->count--;
+        pthread_mutex_unlock(&scanner->lock);
+        holes_get_until(scanner->index, node, true, &scanner->stop); // problems show up when the file is read
+        pthread_mutex_lock(&scanner->lock);
+    }
+    pthread_mutex_unlock(&scanner->lock);
+    return NULL;
+}
+
+/**
+ * Stops the thread of a hole scanner (after the file it is scanning) and frees it.
+ */
+void holes_scanner_stop(HoleScanner* scanner)
+{
+    pthread_mutex_lock(&scanner->lock);
+    __atomic_store_n(&scanner->stop, true, __ATOMIC_RELAXED); // also read while scanning without the lock
+    pthread_cond_signal(&scanner->wake);
+    pthread_mutex_unlock(&scanner->lock);
+    pthread_join(scanner->thread, NULL);
+    pthread_cond_destroy(&scanner->wake);
+    pthread_mutex_destroy(&scanner->lock);
+    free(scanner);
+}
+
+/**
+ * Starts the thread of a hole scanner for an index. This must be called after FUSE has moved to
+ * the background since threads do not survive the fork. Returns NULL if there is a problem, with
+ * errno set.
+ */
+HoleScanner* holes_scanner_start(const Index* index)
+{
+    HoleScanner* scanner = (HoleScanner*)calloc(1, sizeof(HoleScanner));
+    if (!scanner) { return NULL; }
+    scanner->index = index;
+    pthread_mutex_init(&scanner->lock, NULL);
+    pthread_cond_init(&scanner->wake, NULL);
+    if ((errno = pthread_create(&scanner->thread, NULL, holes_scanner, scanner)) != 0) {
+        pthread_cond_destroy(&scanner->wake);
+        pthread_mutex_destroy(&scanner->lock);
+        free(scanner);
+        return NULL;
+    }
+    return scanner;
+}
+
+/**
+ * Tells the scanner that a file was opened, which queues it to be scanned if it is large enough and
+ * its hole map isn't known yet. Files are skipped if the queue is full. The node can be from a
+ * replica of the index.
+ */
+void holes_scanner_opened(HoleScanner* scanner, const Node* node)
+{
+    node = index_original(node);
+    if (!S_ISREG(node->mode) || node->generated || node->size < HOLE_SCAN_MIN_SIZE ||
+        __atomic_load_n(&node->holes, __ATOMIC_ACQUIRE)) { return; }
+    pthread_mutex_lock(&scanner->lock);
+    bool queued = false;
+    for (size_t i = 0; i < scanner->count && !queued; i++) { queued = scanner->queue[(scanner->first + i) % HOLE_SCAN_QUEUE] == node; }
+    if (!queued && scanner->count < HOLE_SCAN_QUEUE) {
+        scanner->queue[(scanner->first + scanner->count++) % HOLE_SCAN_QUEUE] = node;
+        pthread_cond_signal(&scanner->wake);
+    }
+    pthread_mutex_unlock(&scanner->lock);
+}
+
+/**
+ * Gets the number of 512-byte blocks used by the data of a file with a hole map.
+ */
+uint64_t holes_blocks(const HoleMap* map, uint64_t size)
+{
+    uint64_t bytes = map->ndata * HOLE_BLOCK_SIZE;
+    if (map->nblocks && !holes_is_zero(map, map->nblocks - 1)) { bytes -= map->nblocks * HOLE_BLOCK_SIZE - size; }
+    return (bytes + 511) / 512;
+}
+
+/**
+ * Reads part of a file with a hole map, only reading the blocks with data from the image. Returns
+ * the number of bytes read or -1 if there is a problem, with errno set.
+ */
+ssize_t holes_read(const Index* index, const Node* node, const HoleMap* map, void* buf, size_t size, uint64_t offset)
+{
+    if (offset >= node->size) { return 0; }
+    if (node->size - offset < size) { size = node->size - offset; }
+    uint8_t* out = (uint8_t*)buf;
+    size_t done = 0;
+    while (done < size) {
+        // Find the run of blocks that are all zeros or all have data
+        uint64_t block = (offset + done) / HOLE_BLOCK_SIZE, end = block + 1;
+        bool zero = holes_is_zero(map, block);
+        while (end * HOLE_BLOCK_SIZE < offset + size && holes_is_zero(map, end) == zero) { end++; }
+        size_t n = end * HOLE_BLOCK_SIZE - (offset + done) < size - done ? end * HOLE_BLOCK_SIZE - (offset + done) : size - done;
+        if (zero) { memset(out + done, 0, n); }
+        else if (index_read(index, node, out + done, n, offset + done) < 0) { return -1; }
+        done += n;
+    }
+    return size;
+}
+
+/**
+ * Writes where the data of a file is, as "OFFSET LENGTH" lines for each run of blocks that aren't
+ * all zeros. Returns false if out of memory.
+ */
+bool holes_data_ranges(const HoleMap* map, uint64_t size, TextBuffer* text)
+{
+    for (uint64_t block = 0; block < map->nblocks;) {
+        if (holes_is_zero(map, block)) { block++; continue; }
+        uint64_t end = block + 1;
+        while (end < map->nblocks && !holes_is_zero(map, end)) { end++; }
+        uint64_t length = (end * HOLE_BLOCK_SIZE < size ? end * HOLE_BLOCK_SIZE : size) - block * HOLE_BLOCK_SIZE;
+        if (!text_printf(text, "%" PRIu64 " %" PRIu64 "\n", block * HOLE_BLOCK_SIZE, length)) { return false; }
+        block = end;
+    }
+    return true;
+}
+
+/**
+ * Frees the hole maps of all files at or below a node, this must be done before the index is freed.
+ */
+void free_hole_maps(Node* node)
+{
+    free(node->holes);
+    for (uint32_t i = 0; i < node->nchildren; i++) { free_hole_maps(node->children[i]); }
+}
@@ -0,0 +1,265 @@
+/**
+ * The image being served, which can be swapped for a new one without unmounting (like when a new
+ * build of an image comes out). Everything that belongs to one image (the index and the ISOs of its
+ * volumes, the replicas of the index, the prefetcher, and the hole scanner) is kept together in an
+ * Image that is reference counted: the current image has a reference, and so does every file and
+ * directory that is open, so open files keep reading the image they were opened on (and its mapping) until they
+ * are closed even after a swap. The last reference frees it.
+ *
+ * Requests that don't have an open file (like lookups and getattr) use whatever image is current
+ * when the request is started, without taking a reference. Instead the threads serving requests
+ * count the requests in progress, and a swap waits for the requests that started on the old image
+ * to be done before letting go of it. The counts are kept in two phases, where new requests count
+ * in the current phase and a swap waits for the other phase to be empty (twice, flipping the phase
+ * in between), and are spread over several slots so the threads aren't all updating one counter.
+ *
+ * Since the kernel may still have pages of a file from before a swap, each file of a new image
+ * that isn't the same as the file at its path in the old image (by size and times) is marked as
+ * stale, and the next time it is opened the kernel is told to drop its pages. Unchanged files keep
+ * their pages, so only the changed files have to be read again.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+
+#define IMAGE_SLOTS        64   // slots that the counts of requests in progress are spread over
+#define IMAGE_MAX_CPUS     1024 // most CPUs that can have a replica of the index
+#define IMAGE_MAX_REPLICAS 64   // most replicas of the index (one for each NUMA node)
+
+typedef struct _Image {
+    Index* index;         // the original index, which has the ISOs of the volumes
+    Index* replicas[IMAGE_MAX_REPLICAS]; // the replicas of the index (see replica.h)
+    unsigned nreplicas;
+    const Index* cpu_replicas[IMAGE_MAX_CPUS]; // the replica used on each CPU, or NULL for the original
+    Prefetcher* prefetcher; // reads the files of the plan ahead of the client, or NULL
+    HoleScanner* scanner; // scans the files that are opened for holes (see holes.h), or NULL
+    char* files;          // the image files, one on each line
+    uint64_t generation;  // 1 for the image that was mounted, one more for each swap after that
+    unsigned refs;        // open files and directories, plus one while this is the current image
+} Image;
+
+/**
+ * The number of requests in progress in each phase, for the threads using one slot. Each slot has
+ * its own cache line.
+ */
+typedef struct _ImageSlot {
+    unsigned requests[2];
+    char _unused[64 - 2*sizeof(unsigned)];
+} ImageSlot;
+
+typedef struct _Images {
+    Image* current;       // the image used by new requests
+    unsigned phase;       // the phase new requests are counted in
+    ImageSlot slots[IMAGE_SLOTS];
+    unsigned next_slot;   // the slot given to the next thread
+    bool swappable;       // if the requests are counted so the image can be swapped
+    void (*replicate)(Image* image); // makes the replicas of the index of a new image, or NULL
+    pthread_mutex_t lock; // held while using everything below
+    bool swapping;        // if a new image is being loaded and swapped in, only one can be at a time
+    TextBuffer status;    // how the last swap went, as in /.isofs/swap
+    pthread_t thread;     // the thread doing the last swap, if started
+    bool started;
+} Images;
+
+// The image used by the request this thread is handling, or NULL if this thread isn't serving requests
+static __thread Image* image_local;
+
+// The slot this thread counts its requests in, plus one (0 if it hasn't been given one yet)
+static __thread unsigned image_slot;
+
+/**
+ * Sets up the images with the image that is mounted, which is the current image.
+ */
+void images_init(Images* images, Image* image)
+{
+    memset(images, 0, sizeof(Images));
+    pthread_mutex_init(&images->lock, NULL);
+    image->generation = 1;
+    image->refs = 1;
+    images->current = image;
+}
+
+/**
+ * Gets the image that this thread should use: the one of the request it is handling, or the
+ * current image if requests aren't counted (in which case it is never swapped).
+ */
+static inline Image* image_get(Images* images)
+{
+    return image_local ? image_local : __atomic_load_n(&images->current, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Gets the index of an image that this thread should use, which is the replica for its NUMA node if
+ * the image is the one of the request it is handling and there are replicas.
+ */
+static inline const Index* image_index(const Image* image)
+{
+    return image == image_local && replica_local ? replica_local : image->index;
+}
+
+/**
+ * Starts a request: counts it as in progress and gets the current image, which stays around until
+ * image_exit() is called. Returns the phase that it was counted in.
+ */
+static inline unsigned image_enter(Images* images)
+{
+    if (!image_slot) { image_slot = __atomic_fetch_add(&images->next_slot, 1, __ATOMIC_RELAXED) % IMAGE_SLOTS + 1; }
+    unsigned phase = __atomic_load_n(&images->phase, __ATOMIC_SEQ_CST) & 1;
+    __atomic_add_fetch(&images->slots[image_slot-1].requests[phase], 1, __ATOMIC_SEQ_CST);
+    image_local = __atomic_load_n(&images->current, __ATOMIC_SEQ_CST); // after the count
+    return phase;
+}
+
+/**
+ * Ends a request started with image_enter().
+ */
+static inline void image_exit(Images* images, unsigned phase)
+{
+    image_local = NULL;
+    replica_local = NULL;
+    __atomic_sub_fetch(&images->slots[image_slot-1].requests[phase], 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Adds a reference to an image, for an open file or directory.
+ */
+static inline void image_hold(Image* image) { __atomic_add_fetch(&image->refs, 1, __ATOMIC_RELAXED); }
+
+/**
+ * Removes a reference to an image. Returns true if it was the last one, in which case the image
+ * needs to be freed.
+ */
+static inline bool image_put(Image* image) { return __atomic_sub_fetch(&image->refs, 1, __ATOMIC_ACQ_REL) == 0; }
+
+/**
+ * Frees the replicas of the index of an image, once nothing is using them anymore.
+ */
+void image_free_replicas(Image* image)
+{
+    for (unsigned i = 0; i < image->nreplicas; i++) { free_index(image->replicas[i]); }
+    image->nreplicas = 0;
+    memset(image->cpu_replicas, 0, sizeof(image->cpu_replicas));
+}
+
+/**
+ * Waits for the requests counted in one phase to be done.
+ */
+static void image_wait_phase(Images* images, unsigned phase)
+{
+    for (unsigned i = 0; i < IMAGE_SLOTS;) {
+        if (__atomic_load_n(&images->slots[i].requests[phase], __ATOMIC_ACQUIRE)) { sched_yield(); } else { i++; }
+    }
+}
+
+/**
+ * Makes a new image the current image and waits for the requests still using the old one to be
+ * done. This must only be done by the thread that set swapping, and not while holding the lock
+ * (requests may be waiting for it). Returns the old image, which the caller has the reference to.
+ */
+Image* image_swap(Images* images, Image* image)
+{
+    Image* old = __atomic_load_n(&images->current, __ATOMIC_ACQUIRE);
+    image->generation = old->generation + 1;
+    image->refs = 1;
+    __atomic_store_n(&images->current, image, __ATOMIC_SEQ_CST);
+
+    // A request may have read the phase just before it was flipped, so each phase is waited for
+    for (int i = 0; i < 2; i++) {
+        unsigned phase = __atomic_fetch_add(&images->phase, 1, __ATOMIC_SEQ_CST) & 1;
+        image_wait_phase(images, phase);
+    }
+    return old;
+}
+
+/**
+ * Marks the files of a new index that are different from the files at the same paths in the old
+ * index as stale, along with the files that were already stale and haven't been opened since.
+ */
+static void image_mark_stale(const Index* old, const Node* old_dir, Node* dir)
+{
+    for (uint32_t i = 0; i < dir->nchildren; i++) {
+        Node* node = dir->children[i];
+        const Node* before = old_dir ? index_find_child(old_dir, node->name, strlen(node->name)) : NULL;
+        if (before && before == old->generated) { before = NULL; }
+        if (S_ISDIR(node->mode)) { image_mark_stale(old, before && S_ISDIR(before->mode) ? before : NULL, node); continue; }
+        node->stale = !before || before->size != node->size || before->mtime != node->mtime ||
+                      before->ctime != node->ctime || (before->mode & S_IFMT) != (node->mode & S_IFMT) ||
+                      __atomic_load_n(&before->stale, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Checks if the kernel has to be told to drop the pages of a file that is being opened, which
+ * they don't need to be after this (since it is told now).
+ */
+static inline bool image_take_stale(const Node* node)
+{
+    node = index_original(node);
+    return __atomic_load_n(&node->stale, __ATOMIC_RELAXED) && __atomic_exchange_n(&((Node*)node)->stale, false, __ATOMIC_RELAXED);
+}
+
+/**
+ * Starts swapping in a new image in the background with a thread that runs `swap` (which has to
+ * clear swapping when it is done). Returns false if a swap is already in progress (with errno set
+ * to EBUSY) or if the thread can't be started.
+ */
+bool images_start_swap(Images* images, void* (*swap)(void* arg), void* arg)
+{
+    pthread_mutex_lock(&images->lock);
+    if (images->swapping) { pthread_mutex_unlock(&images->lock); errno = EBUSY; return false; }
+    if (images->started) { pthread_join(images->thread, NULL); images->started = false; } // already done
+    int error = pthread_create(&images->thread, NULL, swap, arg);
+    images->swapping = images->started = error == 0;
+    pthread_mutex_unlock(&images->lock);
+    if (error) { errno = error; }
+    return error == 0;
+}
+
+/**
+ * Marks the swap in progress as done, with how it went.
+ */
+void images_end_swap(Images* images, const char* status)
+{
+    pthread_mutex_lock(&images->lock);
+    text_truncate(&images->status, 0);
+    text_printf(&images->status, "%s\n", status); // only the status, so it doesn't matter if it fails
+    images->swapping = false;
+    pthread_mutex_unlock(&images->lock);
+}
+
+/**
+ * Waits for a swap in progress to be done, before the images are freed.
+ */
+void images_join(Images* images)
+{
+    pthread_mutex_lock(&images->lock);
+    bool started = images->started;
+    images->started = false;
+    pthread_mutex_unlock(&images->lock);
+    if (started) { pthread_join(images->thread, NULL); }
+    free(images->status.data);
+    images->status.data = NULL;
+    images->status.length = images->status.capacity = 0;
+}
+
+/**
+ * Writes the current image and how the last swap went, as in /.isofs/swap. Returns false if out of
+ * memory.
+ */
+bool images_report(Images* images, TextBuffer* text)
+{
+    pthread_mutex_lock(&images->lock);
+    const Image* image = __atomic_load_n(&images->current, __ATOMIC_ACQUIRE);
+    bool ok = text_printf(text, "# generation: %" PRIu64 "%s\n%s", image->generation, images->swapping ? " (swapping)" : "", image->files) &&
+              (!images->status.length || text_printf(text, "# %s", images->status.data));
+    pthread_mutex_unlock(&images->lock);
+    return ok;
+}
+
+/**
+ * Checks if a node is the swap file.
+ */
+static inline bool image_is_swap_file(const Index* index, const Node* node)
+{
+    return node && index->generated && node->parent == index->generated && strcmp(node->name, SWAP_FILE) == 0;
+}
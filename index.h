@@ -0,0 +1,627 @@
+/**
+ * An in-memory index of all of the files in an ISO. The index is built once when the ISO is
+ * loaded, either from the ISO-9660 directory records (with Rock Ridge data) or from the UDF file
+ * entries of a hybrid image. After that it is never changed (except that the hole maps of files
+ * are added once they are known), so it can be used by any number of threads without locking.
+ * Each file or directory is a Node with all of the information needed for getattr() and the
+ * locations of its data, and each directory has its children sorted by name so that path lookups
+ * are a binary search for each part of the path. Each thread also keeps the paths it looked up
+ * recently so that the same few paths aren't searched for over and over.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define INDEX_CHUNK_SIZE       (1024*1024) // size of the chunks the index allocates its memory from
+#define EXTENT_HOLE            UINT64_MAX  // the start of an extent that is not recorded (all zeros)
+#define INDEX_PARALLEL_NODES   100000      // indexes with fewer nodes are walked on one thread
+#define INDEX_PARALLEL_THREADS 8           // most threads used to walk an index
+#define LOOKUP_CACHE_SIZE      256         // paths kept in the lookup cache of each thread
+#define LOOKUP_CACHE_PATH      112         // longest path (with the null) kept in the lookup cache
+
+/**
+ * A piece of the data of a file. The start is a logical byte offset in the ISO. Usually the data is
+ * contiguous, but ISO-9660 interleaved files have their data in units of `unit` bytes with the
+ * start of each unit `stride` bytes after the start of the previous one. In a volume set the data
+ * can be on a different volume (ISO file) than the directory hierarchy.
+ */
+typedef struct _Extent {
+    uint64_t start;  // logical byte offset of the data, or EXTENT_HOLE
+    uint64_t length; // number of bytes in the extent
+    uint32_t unit;   // bytes in each interleaved unit, 0 if the extent is contiguous
+    uint32_t stride; // bytes from the start of one interleaved unit to the start of the next
+    uint16_t volume; // volume sequence number of the ISO with the data, 0 for the index's ISO
+} Extent;
+
+typedef struct _Node {
+    const char* name;         // name of the file ("" for the root)
+    struct _Node* parent;     // the parent directory (the root is its own parent)
+    struct _Node** children;  // children sorted by name, only for directories
+    uint32_t nchildren;       // number of children
+    uint32_t nextents;        // number of extents
+    Extent* extents;          // where the data of the file is
+    uint64_t size;            // size of the file in bytes
+    mode_t mode;              // type and permissions of the file
+    nlink_t nlink;            // number of links
+    uid_t uid;                // owner of the file
+    gid_t gid;                // group of the file
+    ino_t ino;                // inode number
+    time_t mtime, atime, ctime;
+    uint64_t total_size;      // for directories, total size of all files below it (recursively)
+    uint64_t total_files;     // for directories, number of files below it (recursively)
+    uint64_t total_dirs;      // for directories, number of directories below it (recursively)
+    struct _GeneratedFile* generated; // for files generated by isofs (see virtual.h), otherwise NULL
+    struct _HoleMap* holes;   // which blocks of the file are all zeros (see holes.h), set once it is known
+    uint64_t tar_size;        // for directories, size of their archive (see tar.h), 0 until it is known
+    struct _Node* original;   // for the nodes of replicas (see replica.h), the node this is a copy of
+    bool stale;               // if the kernel may have pages of the file from an older image (see image.h)
+} Node;
+
+/**
+ * Memory is allocated from a list of chunks that are all freed at once with the index.
+ */
+typedef struct _IndexChunk {
+    struct _IndexChunk* next;
+    size_t used, size;
+    uint8_t data[];
+} IndexChunk;
+
+typedef struct _Index {
+    const ISO* iso;      // the ISO the index is for
+    const ISO** volumes; // for volume sets, the ISO of each volume by sequence number - 1 (or NULL)
+    uint16_t nvolumes;   // size of the volume set, 0 if the index is for a single ISO
+    Node* root;          // the root directory
+    size_t nnodes;       // total number of files and directories
+    const char* format;  // the filesystem the index was built from ("ISO-9660" or "UDF")
+    Node* generated;     // the directory of files generated by isofs (see virtual.h), or NULL
+    struct _TrigramIndex* trigrams; // the index of the trigrams in the names (see trigram.h), or NULL
+    IndexChunk* chunks;  // the memory of the index
+    uint64_t id;         // different for every index made, even ones at the address of a freed one
+} Index;
+
+/**
+ * Allocates memory from the index. It does not need to be freed, it is freed with the index.
+ * Returns NULL if out of memory.
+ */
+void* index_alloc(Index* index, size_t size)
+{
+    size = (size + 7) & ~(size_t)7;
+    IndexChunk* chunk = index->chunks;
+    if (!chunk || chunk->size - chunk->used < size) {
+        size_t chunk_size = size > INDEX_CHUNK_SIZE ? size : INDEX_CHUNK_SIZE;
+        chunk = (IndexChunk*)malloc(sizeof(IndexChunk) + chunk_size);
+        if (!chunk) { return NULL; }
+        chunk->used = 0;
+        chunk->size = chunk_size;
+        chunk->next = index->chunks;
+        index->chunks = chunk;
+    }
+    void* ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+/**
+ * Gets the number of bytes of memory used by the index.
+ */
+size_t index_memory(const Index* index)
+{
+    size_t memory = sizeof(Index);
+    for (const IndexChunk* chunk = index->chunks; chunk; chunk = chunk->next) { memory += sizeof(IndexChunk) + chunk->size; }
+    return memory;
+}
+
+/**
+ * Copies a string into the index memory.
+ */
+static const char* index_strdup(Index* index, const char* str)
+{
+    size_t length = strlen(str) + 1;
+    char* copy = (char*)index_alloc(index, length);
+    if (copy) { memcpy(copy, str, length); }
+    return copy;
+}
+
+/**
+ * Creates a new node in the index with the given name and parent (NULL for the root). Everything
+ * else is zeroed. Returns NULL if out of memory.
+ */
+Node* index_new_node(Index* index, Node* parent, const char* name)
+{
+    Node* node = (Node*)index_alloc(index, sizeof(Node));
+    if (!node) { return NULL; }
+    memset(node, 0, sizeof(Node));
+    if (!(node->name = index_strdup(index, name))) { return NULL; }
+    node->parent = parent ? parent : node;
+    node->ino = ++index->nnodes;
+    return node;
+}
+
+/**
+ * Sets the extents of a node, copying them into the index memory.
+ */
+bool index_set_extents(Index* index, Node* node, const Extent* extents, uint32_t count)
+{
+    node->nextents = count;
+    if (count == 0) { node->extents = NULL; return true; }
+    node->extents = (Extent*)index_alloc(index, count * sizeof(Extent));
+    if (!node->extents) { return false; }
+    memcpy(node->extents, extents, count * sizeof(Extent));
+    return true;
+}
+
+static int compare_nodes(const void* a, const void* b)
+{
+    return strcmp((*(const Node**)a)->name, (*(const Node**)b)->name);
+}
+
+/**
+ * Sets the children of a directory node, copying the array into the index memory and sorting it.
+ */
+bool index_set_children(Index* index, Node* dir, Node** children, uint32_t count)
+{
+    dir->nchildren = count;
+    if (count == 0) { dir->children = NULL; return true; }
+    dir->children = (Node**)index_alloc(index, count * sizeof(Node*));
+    if (!dir->children) { return false; }
+    memcpy(dir->children, children, count * sizeof(Node*));
+    qsort(dir->children, count, sizeof(Node*), compare_nodes);
+    return true;
+}
+
+/**
+ * Adds a child to a directory node after its children have been set, keeping them sorted. The
+ * children are copied to a new array in the index memory. Returns false if out of memory.
+ */
+bool index_add_child(Index* index, Node* dir, Node* child)
+{
+    Node** children = (Node**)index_alloc(index, (dir->nchildren + 1) * sizeof(Node*));
+    if (!children) { return false; }
+    uint32_t i = 0;
+    while (i < dir->nchildren && strcmp(dir->children[i]->name, child->name) < 0) { children[i] = dir->children[i]; i++; }
+    children[i] = child;
+    if (dir->nchildren > i) { memcpy(children + i + 1, dir->children + i, (dir->nchildren - i) * sizeof(Node*)); }
+    dir->children = children;
+    dir->nchildren++;
+    return true;
+}
+
+/**
+ * A growable array of nodes used while reading a directory.
+ */
+typedef struct _NodeList {
+    Node** nodes;
+    uint32_t count, capacity;
+} NodeList;
+
+static bool node_list_add(NodeList* list, Node* node)
+{
+    if (list->count == list->capacity) {
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 16;
+        Node** nodes = (Node**)realloc(list->nodes, capacity * sizeof(Node*));
+        if (!nodes) { return false; }
+        list->nodes = nodes;
+        list->capacity = capacity;
+    }
+    list->nodes[list->count++] = node;
+    return true;
+}
+
+/**
+ * Frees an index, not including the ISO it is for.
+ */
+void free_index(Index* index)
+{
+    IndexChunk* chunk = index->chunks;
+    while (chunk) {
+        IndexChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(index);
+}
+
+/**
+ * Creates a new, empty, index for an ISO. Returns NULL if out of memory.
+ */
+Index* new_index(const ISO* iso, const char* format)
+{
+    Index* index = (Index*)calloc(1, sizeof(Index));
+    if (!index) { return NULL; }
+    static uint64_t next_id = 1;
+    index->iso = iso;
+    index->format = format;
+    index->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+    return index;
+}
+
+/**
+ * Gets the ISO with the data of an extent on the given volume. Returns NULL (with errno set) if
+ * that volume of the volume set was not given.
+ */
+static inline const ISO* index_volume(const Index* index, uint16_t volume)
+{
+    if (index->nvolumes == 0 || volume == 0) { return index->iso; }
+    const ISO* iso = volume <= index->nvolumes ? index->volumes[volume-1] : NULL;
+    if (!iso) { errno = ENXIO; }
+    return iso;
+}
+
+/**
+ * Finds the child of a directory with the given name (which is `length` characters long and does
+ * not need to be null-terminated). Returns NULL if there is no such child.
+ */
+const Node* index_find_child(const Node* dir, const char* name, size_t length)
+{
+    size_t low = 0, high = dir->nchildren;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        const char* child = dir->children[mid]->name;
+        int cmp = strncmp(child, name, length);
+        if (cmp == 0 && child[length] != 0) { cmp = 1; } // child name is longer
+        if (cmp == 0) { return dir->children[mid]; }
+        if (cmp < 0) { low = mid + 1; } else { high = mid; }
+    }
+    return NULL;
+}
+
+/**
+ * Gets the node of the original index for a node, which is different from the node itself for the
+ * nodes of replicas (see replica.h).
+ */
+static inline const Node* index_original(const Node* node)
+{
+    return node->original ? node->original : node;
+}
+
+/**
+ * Gets the node for a path from the index. If the path cannot be found than NULL is returned and
+ * errno is set to ENOENT (file not found). If any part (but the last part) is not a directory, or
+ * the last part is not a directory and there is a trailing slash, than errno is set to ENOTDIR
+ * and NULL is returned. If a part is longer than 255 characters ENAMETOOLONG is used.
+ */
+const Node* index_lookup(const Index* index, const char* path)
+{
+    if (path[0] != '/') { errno = ENOENT; return NULL; }
+    const Node* node = index->root;
+    const char* part = path + 1;
+    while (*part) {
+        const char* slash = strchr(part, '/');
+        size_t length = slash ? (size_t)(slash - part) : strlen(part);
+        if (length > 255) { errno = ENAMETOOLONG; return NULL; }
+        if (!S_ISDIR(node->mode)) { errno = ENOTDIR; return NULL; }
+        if (length == 1 && part[0] == '.') { }
+        else if (length == 2 && part[0] == '.' && part[1] == '.') { node = node->parent; }
+        else if (length > 0) {
+            node = index_find_child(node, part, length);
+            TRACE(lookup__part, path, part, length, node);
+            if (!node) { errno = ENOENT; return NULL; }
+        }
+        if (!slash) { break; }
+        part = slash + 1;
+        if (!*part && !S_ISDIR(node->mode)) { errno = ENOTDIR; return NULL; }
+    }
+    return node;
+}
+
+/**
+ * A path that was recently looked up by a thread. Since the index never changes the node of a path
+ * stays the same as long as the index is the same. The index is known by its id since the image
+ * can be swapped (see image.h) and a new index can end up where a freed one was.
+ */
+typedef struct _LookupCacheEntry {
+    uint64_t index_id;
+    const Node* node;
+    char path[LOOKUP_CACHE_PATH];
+} LookupCacheEntry;
+
+static __thread LookupCacheEntry lookup_cache[LOOKUP_CACHE_SIZE];
+
+/**
+ * Gets the node for a path like index_lookup(), but first checks the paths that this thread looked
+ * up recently. Each thread has its own cache so it stays in the caches of that CPU and needs no
+ * locking.
+ */
+const Node* index_lookup_cached(const Index* index, const char* path)
+{
+    size_t length = strlen(path);
+    if (length >= LOOKUP_CACHE_PATH) { return index_lookup(index, path); }
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) { hash = (hash ^ (uint8_t)path[i]) * 16777619u; }
+    LookupCacheEntry* entry = &lookup_cache[hash % LOOKUP_CACHE_SIZE];
+    if (entry->index_id == index->id && memcmp(entry->path, path, length + 1) == 0) {
+        TRACE(lookup__hit, index->id, path, entry->node);
+        return entry->node;
+    }
+    TRACE(lookup__miss, index->id, path);
+    const Node* node = index_lookup(index, path);
+    if (node) {
+        entry->index_id = index->id;
+        entry->node = node;
+        memcpy(entry->path, path, length + 1);
+    }
+    return node;
+}
+
+
+////////// Totals //////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Adds up the totals of a directory from its children, the totals of the child directories must
+ * already be done.
+ */
+static void index_sum_totals(Node* dir)
+{
+    dir->total_size = dir->total_files = dir->total_dirs = 0;
+    for (uint32_t i = 0; i < dir->nchildren; i++) {
+        const Node* child = dir->children[i];
+        if (S_ISDIR(child->mode)) {
+            dir->total_size += child->total_size;
+            dir->total_files += child->total_files;
+            dir->total_dirs += child->total_dirs + 1;
+        } else {
+            dir->total_size += child->size;
+            dir->total_files++;
+        }
+    }
+}
+
+/**
+ * Works out the totals of a directory and all directories below it, bottom-up.
+ */
+static void index_dir_totals(Node* dir)
+{
+    for (uint32_t i = 0; i < dir->nchildren; i++) {
+        if (S_ISDIR(dir->children[i]->mode)) { index_dir_totals(dir->children[i]); }
+    }
+    index_sum_totals(dir);
+}
+
+/**
+ * The subtrees of the root directory that threads take turns working out the totals of.
+ */
+typedef struct _IndexTotalsWork {
+    Node* root;    // the root directory
+    uint32_t next; // the next child of the root to do
+} IndexTotalsWork;
+
+static void* index_totals_worker(void* arg)
+{
+    IndexTotalsWork* work = (IndexTotalsWork*)arg;
+    uint32_t i;
+    while ((i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) < work->root->nchildren) {
+        if (S_ISDIR(work->root->children[i]->mode)) { index_dir_totals(work->root->children[i]); }
+    }
+    return NULL;
+}
+
+/**
+ * Runs a function on several threads at once, including this one, and waits for all of them to
+ * finish. The threads should take turns doing the `count` pieces of the work, so only as many
+ * threads as there are pieces are used. Small indexes are only worth one thread.
+ */
+void index_parallel(const Index* index, size_t count, void* (*func)(void*), void* arg)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = index->nnodes < INDEX_PARALLEL_NODES || ncpus < 2 ? 0 : (size_t)ncpus - 1;
+    if (nthreads > INDEX_PARALLEL_THREADS) { nthreads = INDEX_PARALLEL_THREADS; }
+    if (nthreads >= count) { nthreads = count ? count - 1 : 0; }
+    pthread_t threads[INDEX_PARALLEL_THREADS];
+    size_t started = 0;
+    while (started < nthreads && pthread_create(&threads[started], NULL, func, arg) == 0) { started++; }
+    func(arg); // this thread helps as well
+    for (size_t i = 0; i < started; i++) { pthread_join(threads[i], NULL); }
+}
+
+/**
+ * Works out the recursive size and number of files and directories below every directory, so that
+ * du-style queries don't need to walk the tree. Large indexes have the subtrees of the root split
+ * between several threads since they don't depend on each other. This is done once the index is
+ * built and before it is used.
+ */
+void index_compute_totals(Index* index)
+{
+    IndexTotalsWork work = { index->root, 0 };
+    index_parallel(index, index->root->nchildren, index_totals_worker, &work);
+    index_sum_totals(index->root);
+}
+
+
+////////// ISO-9660 ////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Fills in the attributes of a node from an ISO-9660 record and its Rock Ridge data. Without the
+ * Rock Ridge data, directories are readable and executable by all and files are readable by all
+ * and they are owned by the current user and group.
+ */
+static void index_iso_attributes(Node* node, const Record* record, const RRExtraData* rr)
+{
+    if (rr->flags & RR_HAS_STAT) {
+        node->mode = rr->mode;
+        node->nlink = rr->nlinks;
+        node->uid = rr->uid;
+        node->gid = rr->gid;
+    } else {
+        if (record->file_flags & FILE_DIRECTORY) {
+            node->mode = S_IFDIR | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+        } else { node->mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH; }
+        node->nlink = 1;
+        node->uid = getuid();
+        node->gid = getgid();
+    }
+    if (rr->flags & RR_HAS_INO) { node->ino = rr->ino; }
+    time_t time = convert_datetime(&record->datetime);
+    node->mtime = (rr->flags & RR_HAS_MODIFICATION) ? rr->modification : time;
+    node->atime = (rr->flags & RR_HAS_ACCESS) ? rr->access : time;
+    node->ctime = (rr->flags & RR_HAS_CREATION) ? rr->creation : time;
+}
+
+/**
+ * Adds all of the records in the directory with the given record to the index as children of the
+ * directory node, recursing into subdirectories. Files with multiple extents (which have the
+ * FILE_ADDL_RECORDS flag on all but their last record) become a single node.
+ */
+static bool index_iso_directory(Index* index, Node* dir, const Record* dir_record, int depth)
+{
+    const ISO* iso = index->iso;
+    size_t block_size = iso->pvd->logical_block_size;
+    uint32_t length = dir_record->extent_length; // the record may not stay mapped
+    uint64_t start_pos; // Start of directory
+    if (depth > 255) { errno = ELOOP; return false; }
+    if (!iso_block_offset(iso, dir_record->extent_location, length, &start_pos) ||
+        !iso_fetch(iso, start_pos, length)) { return false; }
+
+    NodeList children = { NULL, 0, 0 };
+    Extent* extents = NULL;
+    uint32_t nextents = 0, extents_capacity = 0;
+    bool okay = true, continued = false;
+    Node* node = NULL;
+
+    // Go through each record in the directory
+    uint32_t offset = 0;
+    while (offset < length) {
+        // Nothing from the previous record (or subdirectories) is used anymore
+        iso_unpin(iso);
+        const Record* record = (const Record*)iso_ptr(iso, start_pos + offset);
+        if (record->length == 0) {
+            // Jump to the next block
+            offset = ((offset/block_size) + 1)*block_size;
+            continue;
+        }
+        if (record->length < sizeof(Record) || offset + record->length > length) { break; }
+        offset += record->length;
+        if (record->filename_length == 1 && (record->filename[0] == 0 || record->filename[0] == 1)) {
+            // The current (.) and parent (..) directory records; the root's '.' record is where
+            // the root directory gets its attributes from
+            if (record->filename[0] == 0 && dir->parent == dir) {
+                RRExtraData rr;
+                read_rock_ridge_data(iso, record, &rr);
+                index_iso_attributes(dir, record, &rr);
+            }
+            continue;
+        }
+
+        // Add another extent to the previous file if it said there would be more
+        if (!continued) {
+            RRExtraData rr;
+            char filename[256];
+            read_rock_ridge_data(iso, record, &rr); // returns right away on images without Rock Ridge
+            get_record_filename_rr(record, &rr, filename);
+            if (!(node = index_new_node(index, dir, filename)) || !node_list_add(&children, node)) { okay = false; break; }
+            index_iso_attributes(node, record, &rr);
+            nextents = 0;
+        }
+        if (!(record->file_flags & FILE_DIRECTORY)) {
+            if (nextents == extents_capacity) {
+                extents_capacity = extents_capacity ? extents_capacity * 2 : 4;
+                Extent* bigger = (Extent*)realloc(extents, extents_capacity * sizeof(Extent));
+                if (!bigger) { okay = false; break; }
+                extents = bigger;
+            }
+            // File data past the end of the image (such as a truncated download) only causes
+            // errors when it is read
+            iso_block_offset(iso, record->extent_location, record->extent_length, &extents[nextents].start);
+            extents[nextents].length = record->extent_length;
+            extents[nextents].unit = record->interleaved_unit_size*block_size;
+            extents[nextents].stride = (record->interleaved_unit_size + record->interleaved_gap_size)*block_size;
+            extents[nextents].volume = record->volume_sequence_number;
+            nextents++;
+            node->size += record->extent_length;
+        }
+        continued = record->file_flags & FILE_ADDL_RECORDS;
+        if (!continued) {
+            if (record->file_flags & FILE_DIRECTORY) {
+                node->size = record->extent_length;
+                if (!index_iso_directory(index, node, record, depth + 1)) { okay = false; break; }
+            } else if (!index_set_extents(index, node, extents, nextents)) { okay = false; break; }
+        }
+    }
+
+    okay = okay && index_set_children(index, dir, children.nodes, children.count);
+    free(children.nodes);
+    free(extents);
+    return okay;
+}
+
+/**
+ * Builds the index from the ISO-9660 directory records of the ISO. Returns NULL if there is a
+ * problem, with errno set.
+ */
+Index* build_iso_index(const ISO* iso)
+{
+    Index* index = new_index(iso, iso->evd ? "ISO 9660:1999" : "ISO-9660");
+    if (!index) { return NULL; }
+    const Record* root_record = iso_root(iso);
+    if ((index->root = index_new_node(index, NULL, ""))) {
+        // The root gets the default attributes unless its '.' record has Rock Ridge data
+        RRExtraData rr = { 0 };
+        index_iso_attributes(index->root, root_record, &rr);
+        index->root->size = root_record->extent_length;
+        if (index_iso_directory(index, index->root, root_record, 0)) { return index; }
+    }
+    int error = errno;
+    free_index(index);
+    errno = error;
+    return NULL;
+}
+
+/**
+ * Reads up to `size` bytes of the data of a file starting at `offset` into `buf`, going through its
+ * extents. Returns the number of bytes read (which is only less than size at the end of the file)
+ * or -1 if there is a problem, with errno set.
+ */
+ssize_t index_read(const Index* index, const Node* node, void* buf, size_t size, uint64_t offset)
+{
+    if (offset >= node->size) { return 0; }
+    if (node->size - offset < size) { size = node->size - offset; }
+    uint8_t* out = (uint8_t*)buf;
+    size_t done = 0;
+    for (uint32_t i = 0; i < node->nextents && done < size; i++) {
+        const Extent* extent = &node->extents[i];
+        if (offset >= extent->length) { offset -= extent->length; continue; }
+        size_t n = extent->length - offset < size - done ? extent->length - offset : size - done;
+        const ISO* iso = NULL;
+        if (extent->start == EXTENT_HOLE) { memset(out + done, 0, n); }
+        else if (!(iso = index_volume(index, extent->volume))) { return -1; }
+        else if (extent->unit == 0) {
+            if (!iso_read(iso, out + done, extent->start + offset, n)) { return -1; }
+        } else {
+            // Interleaved, copy whole units (or what is needed of them) skipping the gaps
+            uint64_t unit = offset / extent->unit;
+            size_t within = offset % extent->unit;
+            for (size_t left = n; left > 0; unit++, within = 0) {
+                uint64_t start = extent->start + unit*extent->stride + within;
+                size_t count = extent->unit - within < left ? extent->unit - within : left;
+                if (!iso_read(iso, out + done + n - left, start, count)) { return -1; }
+                left -= count;
+            }
+        }
+        done += n;
+        offset = 0;
+    }
+    // Anything past the recorded extents reads as zeros
+    if (done < size) { memset(out + done, 0, size - done); }
+    return size;
+}
+
+/**
+ * Starts reading all of the data of a file ahead of when it is needed, see iso_prefetch(). Returns
+ * false if there is a problem, with errno set.
+ */
+bool index_prefetch(const Index* index, const Node* node)
+{
+    for (uint32_t i = 0; i < node->nextents; i++) {
+        const Extent* extent = &node->extents[i];
+        const ISO* iso;
+        if (extent->start == EXTENT_HOLE || extent->length == 0) { continue; }
+        if (!(iso = index_volume(index, extent->volume))) { return false; }
+        // Interleaved extents are prefetched along with their gaps
+        uint64_t length = extent->unit == 0 ? extent->length :
+                          (extent->length - 1) / extent->unit * extent->stride + extent->unit;
+        if (!iso_prefetch(iso, extent->start, length)) { return false; }
+    }
+    return true;
+}
@@ -86,6 +86,10 @@ typedef struct PACKED _Record {
 ////////// Volume Descriptor Definitions //////////
 ///////////////////////////////////////////////////
 
+// Bytes of user data in each sector of an image, this is also where the volume descriptors start
+#define ISO_SECTOR_SIZE 2048
+#define ISO_DESCRIPTORS_START 0x8000
+
 // VolumeDescriptor ID value
 #define CD001 "CD001"
 
@@ -96,6 +100,10 @@ typedef struct PACKED _Record {
 #define VD_PARTITION     0x03
 #define VD_TERMINATOR    0xFF
 
+// A supplementary volume descriptor with this version is an ISO 9660:1999 enhanced volume
+// descriptor, its directory tree has long names (up to 207 bytes) and may be deeper than 8 levels
+#define VD_ENHANCED_VERSION 2
+
 typedef struct PACKED _dec_datetime {
     // Note: if all strings are spaces and time zone is 0 it means the date/time is not specified
     char_d year[4]; // string 1 to 9999
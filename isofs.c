@@ -8,14 +8,76 @@
  * To run it will be something along the lines of:
  *     ./isofs [-f] test.iso mount
  * Where [] indicates optional. The mount folder must exist and be empty (use mkdir to create it).
+ * Instead of an ISO file, a raw CD image (such as a BIN file) or its CUE sheet can be given.
  * You can use the command `umount mount` to unmount the drive (or CTRL+C if you started the
  * program with -f). Note that if the program crashes you may still need to unmount it.
+ *
+ * Images on slow storage can be cached locally with `-o cache_dir=DIR`. Blocks are copied into a
+ * sparse file in DIR as they are read and are reused the next time the same image is mounted.
+ * Adding `-o hydrate=RATE` (bytes per second, with an optional K, M, or G suffix) also fills in the
+ * rest of the cache in the background.
+ *
+ * ISO 9660:1999 images with an enhanced volume descriptor use its directory tree, which has long
+ * names without needing Rock Ridge.
+ *
+ * When the image also has a UDF filesystem (such as DVD images) that is used instead of ISO-9660
+ * since it supports files larger than 4 GiB and long Unicode names. Use `-o noudf` to see the
+ * ISO-9660 filesystem instead.
+ *
+ * Images too large for the address space (such as on 32-bit systems) are mapped in windows that
+ * are mapped and unmapped as needed. Use `-o window=SIZE` to always do that with the given size.
+ *
+ * The total size and number of files and directories below each directory are worked out when the
+ * image is loaded. They can be read for one directory with `getfattr -n user.isofs.du DIR` or for
+ * all directories at once from the /.isofs/stats file, which is much faster than running du.
+ * Similarly, /.isofs/manifest lists every file in the image with its type, size, mode, and so on
+ * so that tools that need all of that can read one file instead of walking the whole tree.
+ * Reading /.isofs/query/QUERY gives the paths of the files that match the query, such as
+ * `name=*.rpm&size=+1M`, which is like find but without going through the kernel (see query.h).
+ * Mounting with `-o trigrams` builds an index of the names so that queries for names containing
+ * a string (like `contains=kernel`) are nearly instant even with millions of files.
+ * Any directory DIR can be copied as a tar archive by reading /.isofs/tar/DIR.tar (see tar.h).
+ * Reading /.isofs/bundle/QUERY gives the contents of all files matching the query at once, after
+ * a table of where each one is, for loading many small files (see bundle.h).
+ * Writing the order files will be read in to /.isofs/plan has them read ahead of the client, for
+ * shuffled reads that the kernel's readahead can't predict (see prefetch.h).
+ * Large files are scanned for blocks of zeros in the background once they are opened, after which
+ * the zeros aren't read from the image and st_blocks only counts the data, and `user.isofs.data`
+ * lists where the data of a file is (see holes.h).
+ *
+ * Requests are served by one thread for each CPU, or `-o threads=N` threads (see loop.h), which
+ * `-o pin` keeps on their own CPUs spread over the NUMA nodes, and `-o numa_replicas` gives each
+ * NUMA node its own copy of the index (see replica.h). Reads of file data are handled by separate
+ * threads (`-o data_threads=N`) so they don't hold up requests for metadata, and are shared
+ * fairly between users with `-o share=UID:WEIGHT[:RATE]` setting the share of each user (see
+ * fairshare.h). How much each user is reading can be seen in /.isofs/users. The kernel is
+ * allowed to cache lookups and file contents for an hour since the image never changes, but only
+ * keeps attributes for a second so that st_blocks is updated once a file is scanned for holes; give
+ * `-o entry_timeout=...,negative_timeout=...,attr_timeout=...` to change that. `-o fuse_loop` serves
+ * requests with the multithreaded libfuse loop instead, for comparing against (see the benchmarks
+ * in tests/).
+ *
+ * The mapped windows of the image, the prefetched files, and the contents of the generated files
+ * are kept within `-o mem_budget=SIZE` and shrink while the host is short on memory (see
+ * pressure.h), as shown in /.isofs/stats.
+ *
+ * Mounting with `-o swappable` lets the image be swapped for a new one without unmounting: writing
+ * the paths of the new image files to /.isofs/swap loads them in the background and new requests
+ * use the new image once it is ready, while files that are already open keep reading the old one
+ * (see image.h). The kernel then only caches lookups and attributes for a second, so the new image
+ * shows up right away.
+ *
+ * Each operation, path lookup, and cache fetch has a static probe for tracing with bpftrace when
+ * built where <sys/sdt.h> is available (see trace.h and the scripts in bpftrace/).
  */
 
 // Enable POSIX 2008 functions
 #define _POSIX_C_SOURCE 200809L
 #define _XOPEN_SOURCE 700
 #define _DARWIN_C_SOURCE
+#ifdef __linux__
+#define _GNU_SOURCE // for CPU affinity
+#endif
 
 // The FUSE API has been changed a number of times. We announce that we support v2.6.
 #define FUSE_USE_VERSION 26
@@ -25,12 +87,31 @@
 
 // Tons of includes...
 #include "iso.h"
+#include "trace.h"
 #include "util.h"
+#include "cache.h"
+#include "window.h"
+#include "reader.h"
+#include "index.h"
+#include "udf.h"
+#include "trigram.h"
+#include "virtual.h"
+#include "query.h"
+#include "tar.h"
+#include "bundle.h"
+#include "prefetch.h"
+#include "holes.h"
+#include "replica.h"
+#include "fairshare.h"
+#include "pressure.h"
+#include "image.h"
+#include "loop.h"
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <string.h>
 #include <limits.h>
 #include <unistd.h>
@@ -40,11 +121,41 @@
 #include <sys/stat.h>
 
 #include <fuse.h>
+#include <fuse_opt.h>
 #ifdef __APPLE__
 #include <fuse_darwin.h>
 #endif
 
-#define GET_ISO() ((const ISO*)fuse_get_context()->private_data)
+#define GET_IMAGE() image_get(&images)
+#define GET_INDEX() image_index(GET_IMAGE())
+#define GET_ISO() (GET_INDEX()->iso)
+
+// Extended attribute with the recursive totals of a directory as "SIZE FILES DIRECTORIES"
+#define XATTR_DU "user.isofs.du"
+// Extended attribute with where the data of a file is, as "OFFSET LENGTH" lines (see holes.h)
+#define XATTR_DATA "user.isofs.data"
+#ifndef ENOATTR
+#define ENOATTR ENODATA
+#endif
+
+// Bytes per second to fill in the cache at in the background, 0 to not do it (-o hydrate=RATE)
+static size_t hydrate_rate = 0;
+
+// How images are loaded (-o cache_dir=DIR, -o window=SIZE, -o noudf, and -o trigrams), which is
+// kept for the images swapped in later
+static const char* cache_dir = NULL;
+static size_t window_size = 0;
+static bool use_udf = true;
+static bool use_trigrams = false;
+
+// The image being served and the ones still used by open files
+static Images images;
+
+// How reads are shared between users (-o share=UID:WEIGHT[:RATE])
+static FairShare fair_share;
+
+// How much memory the caches can use (-o mem_budget=SIZE), shrunk when memory is short
+static MemoryBudget memory_budget;
 
 // If you add -D_DEBUG to your compile command-line than every isofs_*() function will printout when
 // it gets called (you would also need to run your program with -f to be in the foreground).
@@ -54,19 +165,75 @@
 #define LOG(s, ...)
 #endif
 
+/**
+ * Cleans up an ISO structure after it is done being used. This means that the memory is unmapped,
+ * the file descriptor is closed, and the allocated memory is freed.
+ */
+void free_iso(ISO* iso)
+{
+    if (iso->fetch_data) { cache_close((BlockCache*)iso->fetch_data); }
+    if (iso->map_data) { map_windows_close((MapWindows*)iso->map_data); }
+    close(iso->fd);
+    if (iso->raw) { munmap(iso->raw, iso->size); }
+    free(iso->pvd);
+    free(iso->evd);
+    free(iso);
+}
+
+/**
+ * Copies a primary (or supplementary) volume descriptor out of the ISO memory.
+ */
+static PrimaryVolumeDescriptor* copy_volume_descriptor(const VolumeDescriptor* descr)
+{
+    PrimaryVolumeDescriptor* copy = (PrimaryVolumeDescriptor*)malloc(sizeof(PrimaryVolumeDescriptor));
+    if (copy) { memcpy(copy, descr, sizeof(PrimaryVolumeDescriptor)); }
+    return copy;
+}
+
 /**
  * Loads an ISO file into an ISO structure from the given file name. This opens the file, maps it
  * into memory, and finds the Primary Volume Descriptor while also checking that the headers of the
  * ISO file are valid. Returns NULL if there is an issue. If a problem is found with the actual
  * ISO headers than errno is set to EINVAL. In all other cases of problems, errno can be assumed to
  * be set by the called function.
+ *
+ * The layout of the sectors in the file is detected automatically, so raw CD images (such as
+ * MODE1/2352 BIN files) work as well. If given a CUE sheet, its first data track is loaded (from
+ * wherever it starts in its file).
+ *
+ * If cache_dir is not NULL then the image is not mapped directly. Instead, the blocks of the image
+ * are copied into a persistent cache in that directory as they are needed and the cache is mapped.
+ *
+ * If window_size is not 0, or the image is too large to map all at once, then the image is mapped
+ * in windows of that size (or MAP_WINDOW_SIZE) as they are needed instead.
  */
-ISO* load_iso(const char* filename)
+ISO* load_iso(const char* filename, const char* cache_dir, size_t window_size)
 {
+    // CUE sheets just point to the actual data file and say what format it is in
+    char cue_path[PATH_MAX], cue_mode[16];
+    const char* mode = NULL;
+    uint32_t track_start = 0;
+    size_t name_length = strlen(filename);
+    if (name_length > 4 && strcasecmp(filename + name_length - 4, ".cue") == 0) {
+        if (!read_cue_sheet(filename, cue_path, cue_mode, &track_start)) { return NULL; }
+        filename = cue_path;
+        mode = cue_mode;
+    }
+
     // Allocate the memory for our filesystem, make sure that pvd is set to NULL
     ISO* iso = (ISO*) malloc(sizeof(ISO));
     if (!iso) { return NULL; }
     iso->pvd = NULL;
+    iso->evd = NULL;
+    iso->raw = NULL;
+    iso->sector_size = ISO_SECTOR_SIZE;
+    iso->sector_offset = 0;
+    iso->track_start = track_start;
+    iso->fetch = NULL;
+    iso->fetch_data = NULL;
+    iso->map = NULL;
+    iso->release = NULL;
+    iso->map_data = NULL;
 
     // Open the ISO file
     // Setup the fd, size, and data fields in iso
@@ -74,166 +241,319 @@ ISO* load_iso(const char* filename)
     struct stat stats;
     if (fstat(iso->fd, &stats) == -1) { close(iso->fd); free(iso); return NULL; }
     iso->size = stats.st_size;
-    if ((iso->raw = mmap(NULL, iso->size, PROT_READ, MAP_PRIVATE, iso->fd, 0)) == (void *) -1) { close(iso->fd); free(iso); return NULL; }
+    int map_fd = iso->fd, map_flags = MAP_PRIVATE;
+    if (cache_dir) {
+        // Map the cache file instead, it is shared so that blocks written to it show up in memory
+        BlockCache* cache = cache_open(iso->fd, iso->size, cache_dir);
+        if (!cache) { close(iso->fd); free(iso); return NULL; }
+        iso->fetch = cache_fetch;
+        iso->fetch_data = cache;
+        map_fd = cache->cache_fd;
+        map_flags = MAP_SHARED;
+    }
+    if (!window_size && (iso->size > SIZE_MAX || (iso->raw = mmap(NULL, iso->size, PROT_READ, map_flags, map_fd, 0)) == (void *) -1)) {
+        // Not enough address space to map it all at once
+        iso->raw = NULL;
+        if (iso->size <= SIZE_MAX && errno != ENOMEM) { free_iso(iso); return NULL; }
+        window_size = MAP_WINDOW_SIZE;
+    }
+    if (!iso->raw && !map_windows_open(iso, map_fd, map_flags, window_size)) { free_iso(iso); return NULL; }
+
+    // Figure out how the sectors are laid out in the file
+    if (!detect_image_format(iso, mode)) {
+        errno = EINVAL;
+        free_iso(iso);
+        return NULL;
+    }
 
     // Setup fields based on ISO data
-    int offset = 0x8000;
+    uint64_t offset = ISO_DESCRIPTORS_START;
     bool terminated = false;
     while(offset < iso->size) {
-        VolumeDescriptor* curr_descr = (VolumeDescriptor*) &iso->raw[offset]; // The current volume descriptor
-        // Checks the version, id, type code, and if a primary volume descriptor has already been found
-        if (curr_descr->version != 1 || memcmp(curr_descr->id, CD001, 5) != 0)
+        if (!iso_fetch(iso, offset, sizeof(PrimaryVolumeDescriptor))) { free_iso(iso); return NULL; }
+        VolumeDescriptor* curr_descr = (VolumeDescriptor*) iso_ptr(iso, offset); // The current volume descriptor
+        bool enhanced = curr_descr->type_code == VD_SUPPLEMENTARY && curr_descr->version == VD_ENHANCED_VERSION;
+        // Checks the version, id, type code, and if a primary (or enhanced) volume descriptor has
+        // already been found, keeping copies since the descriptors might not stay mapped
+        if ((curr_descr->version != 1 && !enhanced) || memcmp(curr_descr->id, CD001, 5) != 0)
         {
             errno = EINVAL;
-            close(iso->fd);
-            munmap(iso->raw, iso->size);
-            free(iso);
+            free_iso(iso);
             return NULL;
         } else if (curr_descr->type_code == VD_PRIMARY && !iso->pvd) {
-            iso->pvd = (PrimaryVolumeDescriptor*)curr_descr;
+            if (!(iso->pvd = copy_volume_descriptor(curr_descr))) { free_iso(iso); return NULL; }
+        } else if (enhanced && !iso->evd) {
+            if (!(iso->evd = copy_volume_descriptor(curr_descr))) { free_iso(iso); return NULL; }
         }
         if (curr_descr->type_code == VD_TERMINATOR) { terminated = true; break; }
-        offset += 0x800;
+        offset += ISO_SECTOR_SIZE;
     }
     // TODO: Check the ISO for problems and cleanup everything if there is a problem
     // TODO: Also find the Primary Volume Descriptor and set the pvd fields in the iso variable
 
     // Check if a Primary Volume Descriptor was not found or we got to the end of the file
     // before the Terminator was found
-    if (!iso->pvd || !terminated) {
+    if (!iso->pvd || !terminated || (iso->evd && iso->evd->logical_block_size != iso->pvd->logical_block_size)) {
         errno = EINVAL;
-        close(iso->fd);
-        munmap(iso->raw, iso->size);
-        free(iso);
+        free_iso(iso);
         return NULL;
     }
+    detect_rock_ridge(iso);
 
     // Return the setup iso variable
+    iso_unpin(iso);
     return iso;
 }
 
 /**
- * Cleans up an ISO structure after it is done being used. This means that the memory is unmapped,
- * the file descriptor is closed, and the allocated memory is freed.
+ * Builds the index of the files in the ISO. Hybrid images with a UDF filesystem use it (unless
+ * use_udf is false) since it can have larger files and longer names, otherwise the ISO-9660
+ * records are used. The totals of the directories are computed and the generated files are added
+ * as well. Returns NULL if there is an issue, with errno set.
  */
-void free_iso(ISO* iso)
+Index* build_index(const ISO* iso, bool use_udf)
 {
-    close(iso->fd);
-    if (iso->raw) { munmap(iso->raw, iso->size); }
-    free(iso);
+    Index* index = NULL;
+    if (use_udf && udf_detect(iso) && !(index = build_udf_index(iso))) {
+        fprintf(stderr, "unable to use UDF filesystem (%s), using ISO-9660 instead\n", strerror(errno));
+    }
+    if (!index) { index = build_iso_index(iso); }
+    iso_unpin(iso);
+    if (!index) { return NULL; }
+    index_compute_totals(index);
+    if (!index_add_virtual_files(index)) { free_index(index); return NULL; }
+    return index;
 }
 
 /**
- * Gets a single record from an ISO based on the given path. If the path cannot be found than NULL
- * is returned.
- * 
- * This starts from the root record in the primary volume descriptor of the ISO file. This matches
- * the / path of the ISO file. Using get_path_names(), the other parts of the path name can be
- * obtained from the given path. Each directory is searched, matching the current path name part
- * with the record's filename (obtained using get_record_filename()). If a part cannot be found,
- * than ernno is set to ENOENT (file not found) and NULL is returned. If any part (but the last
- * part) is not a directory, than errno is set to ENOTDIR and NULL is returned. This is also done
- * if the last part is not a directory and their is a trailing slash. 
- */
-const Record* get_record(const ISO* iso, const char* path)
-{
-    // Get the root directory record, if path is just "/" then return it
-    Record* curr_record;
-    Record* curr_dir = &iso->pvd->root_record; // The current directory; beginning from the root
-    if (!strcmp(path, "/")) { return curr_dir; }
-    
-    // Get the path name parts from the given path
-    path_names* path_parts = get_path_names(path);
-    if (!path_parts) { return NULL; }
-    // Go through each name in the set of path names
-    for (int i = 0; i < path_parts->count; i++) {
-        // Check that the end of the extent is within the ISO file raw data
-        uint32_t start_pos = curr_dir->extent_location*iso->pvd->logical_block_size; // Start of directory
-        if (start_pos + curr_dir->extent_length > iso->size) {
+ * Finds the volume of a volume set that has the directory hierarchy, which is the one with the
+ * highest sequence number since each volume records the files on it and all earlier volumes.
+ */
+ISO* last_volume(ISO* const* isos, int count)
+{
+    ISO* last = isos[0];
+    for (int i = 1; i < count; i++) {
+        if (isos[i]->pvd->volume_sequence_number > last->pvd->volume_sequence_number) { last = isos[i]; }
+    }
+    return last;
+}
+
+/**
+ * Adds the volumes of a volume set to an index so that extents on any of them can be read. They
+ * must all have the same volume set identifier and size. Volumes that are missing from the set
+ * only cause errors when files on them are read. Returns false if there is an issue, with errno set.
+ */
+bool add_volume_set(Index* index, ISO* const* isos, int count)
+{
+    const PrimaryVolumeDescriptor* pvd = index->iso->pvd;
+    if (count == 1 && pvd->volume_set_size <= 1) { return true; } // not a volume set
+    index->nvolumes = pvd->volume_set_size;
+    index->volumes = (const ISO**)index_alloc(index, index->nvolumes * sizeof(ISO*));
+    if (!index->volumes) { return false; }
+    memset(index->volumes, 0, index->nvolumes * sizeof(ISO*));
+    for (int i = 0; i < count; i++) {
+        const PrimaryVolumeDescriptor* other = isos[i]->pvd;
+        uint16_t number = other->volume_sequence_number;
+        if (other->volume_set_size != pvd->volume_set_size || memcmp(other->volume_set_id, pvd->volume_set_id, sizeof(pvd->volume_set_id)) != 0 ||
+            number == 0 || number > index->nvolumes || index->volumes[number-1]) {
             errno = EINVAL;
-            free_path_names(path_parts);
-            return NULL;
+            return false;
         }
+        index->volumes[number-1] = isos[i];
+    }
+    if (count < index->nvolumes) { fprintf(stderr, "only %d of %u volumes of the volume set given\n", count, index->nvolumes); }
+    return true;
+}
 
-        // Go through each record in the directory, comparing the filename of the record
-        // with the path name part
-        curr_record = (Record*) &iso->raw[start_pos];
-        uint32_t offset = 0;
-        bool found_path_part = false;
-        while (offset < curr_dir->extent_length) {
-            // Get the record's filename and check for a match
-            char filename[256];
-            get_record_filename(iso, curr_record, filename);
-            if ((found_path_part = !strcmp(filename, path_parts->names[i]))) { break; }
-
-            // Advance to the next record (make sure to account for end-of-sector issues)
-            // Update offset; jump to next block if necessary
-            offset += curr_record->length;
-            curr_record = (Record*) &iso->raw[offset + start_pos];
-            if (curr_record->length == 0) {
-                offset = ((offset/iso->pvd->logical_block_size) + 1)*iso->pvd->logical_block_size;
-                curr_record = (Record*) &iso->raw[offset + start_pos];
-            }
-        }
+/**
+ * Frees the index and all of the ISOs it is for.
+ */
+void free_index_and_volumes(Index* index)
+{
+    ISO* iso = (ISO*)index->iso;
+    free_virtual_files(index);
+    free_hole_maps(index->root);
+    for (uint16_t i = 0; i < index->nvolumes; i++) {
+        if (index->volumes[i] && index->volumes[i] != iso) { free_iso((ISO*)index->volumes[i]); }
+    }
+    free_index(index);
+    free_iso(iso);
+}
 
-        // Check if we failed to find a match - file/directory does not exist
-        if (!found_path_part) {
-            errno = ENOENT;
-            free_path_names(path_parts);
-            return NULL;
-        }
+/**
+ * Loads the ISO files of an image (more than one for a volume set) and builds the index of their
+ * files from the last volume. Problems are printed, with errno set. Returns NULL if there is a
+ * problem.
+ */
+Image* load_image(char* const* filenames, int nfiles)
+{
+    Image* image = (Image*)calloc(1, sizeof(Image));
+    ISO** isos = (ISO**)calloc(nfiles, sizeof(ISO*));
+    TextBuffer files = { NULL, 0, 0 };
+    bool ok = image && isos;
+    for (int i = 0; i < nfiles && ok; i++) { ok = text_printf(&files, "%s\n", filenames[i]); }
+    if (!ok) { errno = ENOMEM; perror("isofs"); free(files.data); free(isos); free(image); return NULL; }
+
+    // Load the ISO files and build the index of their files from the last volume
+    Index* index = NULL;
+    const char* problem = NULL;
+    for (int i = 0; i < nfiles && !problem; i++) {
+        if (!(isos[i] = load_iso(filenames[i], cache_dir, window_size))) { problem = filenames[i]; }
+    }
+    if (!problem && !(index = build_index(last_volume(isos, nfiles), use_udf))) { problem = "reading iso"; }
+    if (!problem && !add_volume_set(index, isos, nfiles)) { problem = "volume set"; index->nvolumes = 0; }
+    if (problem) {
+        int error = errno;
+        perror(problem);
+        if (index) { free_index(index); }
+        for (int i = 0; i < nfiles; i++) { if (isos[i]) { free_iso(isos[i]); } }
+        free(files.data); free(isos); free(image);
+        errno = error;
+        return NULL;
+    }
+    fprintf(stderr, "%zu files in %s filesystem\n", index->nnodes, index->format);
+    if (use_trigrams && !index_build_trigrams(index)) { perror("trigram index"); }
+    for (int i = 0; i < nfiles; i++) {
+        MapWindows* maps = (MapWindows*)isos[i]->map_data;
+        if (maps && !pressure_register(&memory_budget, "windows", MAP_MAX_WINDOWS * maps->window_size, map_windows_resize, maps)) { perror("windows"); }
+    }
+    if (index->generated && !pressure_register(&memory_budget, "generated", GENERATED_CACHE_BYTES, generated_resize, index)) { perror("generated files"); }
+    free(isos);
+    image->index = index;
+    image->files = files.data;
+    return image;
+}
 
-        // Check if a regular file matched something supposed to be a directory
-        if ((i != path_parts->count - 1 || path_parts->trailing_slash) && !(curr_record->file_flags & FILE_DIRECTORY)) {
-            errno = ENOTDIR;
-            free_path_names(path_parts);
-            return NULL;
-        }
-        
-        curr_dir = curr_record;
+/**
+ * Starts the threads that go with an image: filling in the caches of its volumes, prefetching, and
+ * scanning for holes.
+ * This must be done after FUSE has moved to the background since threads do not survive the fork.
+ */
+void start_image(Image* image)
+{
+    const Index* index = image->index;
+    uint16_t nvolumes = index->nvolumes ? index->nvolumes : 1;
+    for (uint16_t i = 0; i < nvolumes && hydrate_rate; i++) {
+        const ISO* iso = index->nvolumes ? index->volumes[i] : index->iso;
+        if (iso && iso->fetch_data) { cache_start_hydrate((BlockCache*)iso->fetch_data, hydrate_rate); }
+    }
+    if (index->generated && !(image->prefetcher = prefetch_start(index))) { perror("prefetch"); }
+    if (image->prefetcher && !pressure_register(&memory_budget, "prefetch", PREFETCH_WINDOW_BYTES, prefetch_resize, image->prefetcher)) { perror("prefetch"); }
+    if (!(image->scanner = holes_scanner_start(index))) { perror("hole scanner"); }
+}
+
+/**
+ * Frees an image once nothing is using it anymore, along with everything that goes with it.
+ */
+void free_image(Image* image)
+{
+    const Index* index = image->index;
+    if (image->prefetcher) { pressure_unregister(&memory_budget, image->prefetcher); prefetch_stop(image->prefetcher); }
+    if (image->scanner) { holes_scanner_stop(image->scanner); }
+    if (index->generated) { pressure_unregister(&memory_budget, image->index); }
+    uint16_t nvolumes = index->nvolumes ? index->nvolumes : 1;
+    for (uint16_t i = 0; i < nvolumes; i++) {
+        const ISO* iso = index->nvolumes ? index->volumes[i] : index->iso;
+        if (iso && iso->map_data) { pressure_unregister(&memory_budget, iso->map_data); }
     }
+    image_free_replicas(image);
+    free_index_and_volumes(image->index);
+    free(image->files);
+    free(image);
+}
+
+/**
+ * Removes a reference to an image, freeing it if it was the last one.
+ */
+static inline void put_image(Image* image)
+{
+    if (image_put(image)) { free_image(image); }
+}
 
-    // Cleanup and return the found record
-    free_path_names(path_parts);
-    return curr_record;
+/**
+ * The thread that swaps in a new image: loads the image files written to the swap file (one on
+ * each line, given as the argument which is freed here) and makes it the current image.
+ */
+static void* swap_worker(void* arg)
+{
+    // Split the lines, skipping empty ones
+    char* lines = (char*)arg;
+    size_t count = 1;
+    for (const char* c = lines; *c; c++) { count += *c == '\n'; }
+    char** filenames = (char**)malloc(count * sizeof(char*));
+    if (!filenames) { free(lines); images_end_swap(&images, "failed: out of memory"); return NULL; }
+    int nfiles = 0;
+    for (char *line = lines, *end; line; line = end) {
+        if ((end = strchr(line, '\n'))) { *end++ = 0; }
+        size_t length = strlen(line);
+        if (length > 0 && line[length-1] == '\r') { line[--length] = 0; }
+        if (length > 0) { filenames[nfiles++] = line; }
+    }
+
+    // Load the new image, then have new requests use it (the kernel has to drop the pages of the
+    // files that changed)
+    char status[PATH_MAX + 64];
+    Image* image = nfiles ? load_image(filenames, nfiles) : NULL;
+    if (!nfiles) { snprintf(status, sizeof(status), "failed: no image files given"); }
+    else if (!image) { snprintf(status, sizeof(status), "failed: %s", strerror(errno)); }
+    else {
+        Image* old = image_get(&images);
+        start_image(image);
+        if (images.replicate) { images.replicate(image); }
+        image_mark_stale(old->index, old->index->root, image->index->root);
+        old = image_swap(&images, image);
+        snprintf(status, sizeof(status), "swapped in generation %" PRIu64, image->generation);
+        fprintf(stderr, "%s\n", status);
+        put_image(old);
+    }
+    free(filenames);
+    free(lines);
+    images_end_swap(&images, status);
+    return NULL;
 }
 
 /**
- * Check that the current user is allowed to access the given Record/path in the ISO. The mask is a
- * combination of R_OK, W_OK, and X_OK flags as would be given to the access system function
- * (except F_OK is not allowed).
+ * Check that the user described by the FUSE context has the access in the mask to the node itself,
+ * ignoring the directories above it. This is also the permits function of queries (see query.h).
  */
-bool check_access(const ISO* iso, const Record* record, const char* path, int mask)
+static bool check_node_access(const Node* node, int mask, const void* user)
+{
+    const struct fuse_context* context = (const struct fuse_context*)user;
+    bool is_root = context->uid == 0;
+    bool is_user = context->uid == node->uid;
+    bool is_grp  = context->gid == node->gid;
+    int access = is_root ? ((node->mode&(S_IXUSR|S_IXGRP|S_IXOTH)) ? 7 : 6) : // super/root user is special
+                    (node->mode >> (is_user ? 6 : (is_grp ? 3 : 0))); // these just need to extract a different set of 3 bits
+    return (access & 7 & mask) == mask;
+}
+
+/**
+ * Check that the user described by the FUSE context is allowed to access the given node in the
+ * index. The mask is a combination of R_OK, W_OK, and X_OK flags as would be given to the access
+ * system function (except F_OK is not allowed). This is also the permits function of plans (see
+ * prefetch.h).
+ */
+static bool check_user_access(const Node* node, int mask, const void* user)
 {
     // First we are going to check that we can access the path itself - we need the execute
     // privilege on every parent directory. We do this recursively.
-    // First we get the name of the parent directory.
-    char parent[PATH_MAX];
-    strncpy(parent, path, PATH_MAX); // copy the entire filename first
-    char* slash = strrchr(parent, '/'); // find the last slash
-    if (slash && !slash[1]) { *slash = 0; slash = strrchr(parent, '/'); } // remove trailing slash
-    if (slash) {
-        // Has a parent directory - check the execute bit on it
-        slash[1] = 0; // chop the string off just after the slash to be only the parent directory name
-        if (!check_access(iso, get_record(iso, parent), parent, X_OK)) { // recursively check access
-            // We found the parent directory and it has bad access
-            return false;
-        }
+    if (node->parent != node && !check_user_access(node->parent, X_OK, user)) {
+        // We found the parent directory and it has bad access
+        return false;
     }
 
     // Check the access to the file itself
-    bool is_root = fuse_get_context()->uid == 0;
-    bool is_user = fuse_get_context()->uid == getuid();
-    bool is_grp  = fuse_get_context()->gid == getgid();
-    bool is_dir = record->file_flags & FILE_DIRECTORY;
-    RRExtraData rr;
-    read_rock_ridge_data(iso, record, &rr);
-    int access = !(rr.flags & RR_HAS_STAT) ? (is_dir ? 5 : 4) :
-                    (is_root ? ((rr.mode&(S_IXUSR|S_IXGRP|S_IXOTH)) ? 7 : 6) : // super/root user is special
-                            (rr.mode >> (is_user ? 6 : (is_grp ? 3 : 0)))); // these just need to extract a different set of 3 bits
-    return (access & 7 & mask) == mask;
+    return check_node_access(node, mask, user);
 }
 
+/**
+ * Check that the current user is allowed to access the given node in the index (see
+ * check_user_access()).
+ */
+bool check_access(const Node* node, int mask)
+{
+    return check_user_access(node, mask, fuse_get_context());
+}
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Prototypes for all these functions and the C-style come from /usr/include/fuse.h or            //
@@ -250,18 +570,26 @@ void *isofs_init(struct fuse_conn_info *conn)
 {
     // This is just what we have to do here. It would be nice if we could open the ISO file in this
     // function, but we have no way to send error messages if it fails to open for some reason.
-    // Instead that is all done in the main() function.
-    return (void*)GET_ISO();
+    // Instead that is all done in the main() function, which makes the current image.
+
+    // Background threads have to be started here since FUSE forks after main() when not using -f
+    start_image(images.current);
+    if (!pressure_start(&memory_budget)) { perror("memory pressure"); }
+    return fuse_get_context()->private_data;
 }
 
 /**
  * Clean up filesystem. Called on filesystem exit.
  * 
- * It unmaps the file, closes the open file descriptor, and frees allocated memory.
+ * It frees the image (after waiting for a swap in progress), which frees the index, unmaps the
+ * files, closes the open file descriptors, and frees allocated memory.
  */
 void isofs_destroy(void *userdata)
 {
-    free_iso((ISO*)userdata);
+    pressure_stop(&memory_budget);
+    images_join(&images);
+    put_image(images.current);
+    images.current = NULL;
 }
 
 
@@ -276,7 +604,8 @@ void isofs_destroy(void *userdata)
 int isofs_statfs(const char *path, struct statvfs *statv)
 {
     LOG("statfs(path=\"%s\", statvfs=%p)\n", path, statv);
-    const ISO* iso = GET_ISO();
+    const Index* index = GET_INDEX();
+    const ISO* iso = index->iso;
 
     // Most of these values are just set to 0 or filler values. The only ones with actual values are
     // the logical size of a block and fragment (use the same value for both), the total size of the
@@ -284,7 +613,7 @@ int isofs_statfs(const char *path, struct statvfs *statv)
     statv->f_bsize = iso->pvd->logical_block_size;
     statv->f_frsize = iso->pvd->logical_block_size;
     statv->f_blocks = iso->pvd->volume_space_size;
-    statv->f_files = get_number_of_files(iso);
+    statv->f_files = index->nnodes;
 
     // The rest are just filled in with whatever
     statv->f_bfree = 0;
@@ -306,46 +635,51 @@ int isofs_getattr(const char *path, struct stat *statbuf)
 {
     LOG("getattr(path=\"%s\", statbuf=%p)\n", path, statbuf);
 
-    // Find the ISO record (which can be either a file or directory)
+    // Find the node in the index (which can be either a file or directory)
     // In the case of an error, return -errno
-    const ISO* iso = GET_ISO();
-    const Record* record = get_record(iso, path);
-    if (!record) { return -errno; }
-
-    // Get any extra available Rock Ridge data (see the main() in part 2 for an example)
-    RRExtraData rr;
-    read_rock_ridge_data(iso, record, &rr);
-    
-    // TODO: Fill in the filesystem stat object using the record and the Rock Ridge data
-    // Prefer Rock Ridge data over record data if available
-    // If not otherwise available:
-    //  directories should be readable and executable by all and files should be readable by all
-    //  uid and gid should be the current user and group (use getuid() and getgid())
-    //  nlink should be a fixed, reasonable, value
-    if (rr.flags & RR_HAS_STAT) {
-        statbuf->st_mode = rr.mode;
-        statbuf->st_nlink = rr.nlinks;
-        statbuf->st_uid = rr.uid;
-        statbuf->st_gid = rr.gid;
+    const Index* index = GET_INDEX();
+    const Node* node = index_lookup_cached(index, path);
+    const char* query_str;
+    int64_t size;
+    mode_t mode;
+    nlink_t nlink = 1;
+    ino_t ino = 0;
+    if (!node && errno == ENOENT && ((node = query_lookup(index, path, QUERY_DIR, &query_str)) ||
+                                     (node = query_lookup(index, path, BUNDLE_DIR, &query_str)))) {
+        // Queries (and bundles) look like read-only files in their directory, their size isn't
+        // known until they are run when opened
+        Query query;
+        if (!query_parse(index, query_str, &query)) { return -errno; }
+        query_free(&query);
+        mode = S_IFREG | 0444;
+        size = 0;
+    } else if (!node && errno == ENOENT && tar_lookup(index, path, &node) == TAR_DIR_ARCHIVE) {
+        // Archives are read-only files with the owner of their directory
+        size = tar_size(index, node);
+        mode = S_IFREG | (node->mode & 0444);
+    } else if (!node) {
+        return -errno;
     } else {
-        if (record->file_flags & FILE_DIRECTORY) {
-            statbuf->st_mode = S_IFDIR | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
-        } else { statbuf->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH; }
-        statbuf->st_nlink = 1;
-        statbuf->st_uid = getuid();
-        statbuf->st_gid = getgid();
-    }
-    if (rr.flags & RR_HAS_INO) { statbuf->st_ino = rr.ino; }
-    else { statbuf->st_ino = 1; }
-    if (rr.flags & RR_HAS_MODIFICATION) { statbuf->st_mtime = rr.modification; }
-    else { statbuf->st_mtime = convert_datetime(&record->datetime); }
-    if (rr.flags & RR_HAS_ACCESS) { statbuf->st_atime = rr.access; }
-    else { statbuf->st_atime = convert_datetime(&record->datetime); }
-    if (rr.flags & RR_HAS_CREATION) { statbuf->st_ctime = rr.creation; }
-    else { statbuf->st_ctime = convert_datetime(&record->datetime); }
- 
-    statbuf->st_size = record->extent_length;
-    statbuf->st_blocks = (statbuf->st_size + 511) / 512;
+        // Everything was already worked out when the index was built, preferring Rock Ridge (or
+        // UDF) data over the ISO-9660 record data, except the size of generated files (the
+        // directories in the tar directory use their directory in the image as well)
+        if ((size = generated_size(index, node)) < 0) { return -errno; }
+        mode = node->mode;
+        nlink = node->nlink;
+        ino = node->ino;
+    }
+    statbuf->st_mode = mode;
+    statbuf->st_nlink = nlink;
+    statbuf->st_uid = node->uid;
+    statbuf->st_gid = node->gid;
+    statbuf->st_ino = ino;
+    statbuf->st_mtime = node->mtime;
+    statbuf->st_atime = node->atime;
+    statbuf->st_ctime = node->ctime;
+    statbuf->st_size = size;
+    // Only the blocks with data count once a file has been scanned for zeros
+    const HoleMap* holes = holes_get(index, node, false);
+    statbuf->st_blocks = holes ? holes_blocks(holes, size) : (statbuf->st_size + 511) / 512;
 
     // Always set rdev to 0 and don't touch dev and blksize
     statbuf->st_rdev = 0;
@@ -364,23 +698,103 @@ int isofs_access(const char *path, int mask)
 {
     LOG("access(path=\"%s\", mask=%d)\n", path, mask);
 
-    // Our filesystem is read-only, if they request W_OK access return -EROFS
-    if (mask & W_OK) { return -EROFS; }
-
-    // Find the ISO record (which can be either a file or directory)
+    // Find the node in the index (which can be either a file or directory)
     // In the case of an error, return -errno
-    const ISO* iso = GET_ISO();
-    const Record* record = get_record(iso, path);
-    if (!record) { return -errno; }
+    const char* query;
+    const Node* node = index_lookup_cached(GET_INDEX(), path);
+
+    // Our filesystem is read-only except for the plan and swap files, if they request W_OK access return -EROFS
+    if ((mask & W_OK) && !prefetch_is_plan(GET_INDEX(), node) && !image_is_swap_file(GET_INDEX(), node)) { return -EROFS; }
+    if (!node && errno == ENOENT && ((node = query_lookup(GET_INDEX(), path, QUERY_DIR, &query)) ||
+                                     (node = query_lookup(GET_INDEX(), path, BUNDLE_DIR, &query)))) {
+        // Queries and bundles can only be read and need access to their directory
+        if (mask & X_OK) { return -EACCES; }
+        mask = X_OK;
+    } else if (!node && errno == ENOENT && tar_lookup(GET_INDEX(), path, &node) == TAR_DIR_ARCHIVE) {
+        // Archives can only be read and need their directory to be readable
+        if (mask & X_OK) { return -EACCES; }
+        mask = mask ? R_OK | X_OK : F_OK;
+    }
+    if (!node) { return -errno; }
 
     // Check the access bits (take note of the check_access() function here, you will need it later)
     if (mask == F_OK) { return 0; }
-    if (!check_access(iso, record, path, mask)) { return -EACCES; }
+    if (!check_access(node, mask)) { return -EACCES; }
     return 0;
 }
 
+/** Get extended attributes
+ *
+ * There is XATTR_DU, the recursive totals of a directory (a file is just itself), and XATTR_DATA
+ * for regular files, where their data is (which means scanning them the first time).
+ */
+// This is emulating the system call getxattr: https://linux.die.net/man/2/getxattr
+//    A size of 0 asks for the size of the value instead of the value.
+#ifdef __APPLE__
+int isofs_getxattr(const char *path, const char *name, char *value, size_t size, uint32_t position)
+#else
+int isofs_getxattr(const char *path, const char *name, char *value, size_t size)
+#endif
+{
+    LOG("getxattr(path=\"%s\", name=\"%s\", value=%p, size=%zu)\n", path, name, value, size);
+
+    const Index* index = GET_INDEX();
+    const Node* node = index_lookup_cached(index, path);
+    if (!node) { return -errno; }
+    if (strcmp(name, XATTR_DATA) == 0 && S_ISREG(node->mode) && !node->generated) {
+        if (!check_access(node, R_OK)) { return -EACCES; }
+        const HoleMap* holes = holes_get(index, node, true);
+        if (!holes) { return -errno; }
+        TextBuffer ranges = { NULL, 0, 0 };
+        if (!holes_data_ranges(holes, node->size, &ranges)) { free(ranges.data); return -ENOMEM; }
+        int length = ranges.length > INT_MAX ? -E2BIG : (int)ranges.length;
+        if (size != 0 && length >= 0) {
+            if (size < ranges.length) { length = -ERANGE; } else if (ranges.length) { memcpy(value, ranges.data, ranges.length); }
+        }
+        free(ranges.data);
+        return length;
+    }
+    if (strcmp(name, XATTR_DU) != 0) { return -ENOATTR; }
+
+    char du[3*24];
+    int length = S_ISDIR(node->mode) ?
+        snprintf(du, sizeof(du), "%" PRIu64 " %" PRIu64 " %" PRIu64, node->total_size, node->total_files, node->total_dirs) :
+        snprintf(du, sizeof(du), "%" PRIu64 " 1 0", node->size);
+    if (size == 0) { return length; }
+    if (size < (size_t)length) { return -ERANGE; }
+    memcpy(value, du, length);
+    return length;
+}
+
+/** List extended attributes
+ */
+// This is emulating the system call listxattr: https://linux.die.net/man/2/listxattr
+//    The names are each null-terminated, and a size of 0 asks for the size of the list.
+int isofs_listxattr(const char *path, char *list, size_t size)
+{
+    LOG("listxattr(path=\"%s\", list=%p, size=%zu)\n", path, list, size);
+
+    // Regular files also have XATTR_DATA
+    static const char names[] = XATTR_DU "\0" XATTR_DATA;
+    const Node* node = index_lookup_cached(GET_INDEX(), path);
+    if (!node) { return -errno; }
+    size_t length = S_ISREG(node->mode) && !node->generated ? sizeof(names) : sizeof(XATTR_DU);
+    if (size == 0) { return length; }
+    if (size < length) { return -ERANGE; }
+    memcpy(list, names, length);
+    return length;
+}
+
 ////////// Directory Reading ///////////////////////////////////////////////////////////////////////
 
+// This is our "directory" object
+typedef struct _isofs_dir {
+    const Node* node; // the node of the directory in the index
+    bool tar;         // if this is the mirror of the directory in the tar directory
+    Image* image;     // the image the directory is in, which is held until it is closed
+    const Index* index; // the index of the image the node is from
+} isofs_dir;
+
 /** Open directory
  *
  * Unless the 'default_permissions' mount option is given, this method should check if opendir is
@@ -388,23 +802,35 @@ int isofs_access(const char *path, int mask)
  * fuse_file_info structure, which will be passed to readdir, closedir and fsyncdir.
  */
 // This is emulating the system function opendir: https://linux.die.net/man/3/opendir
-// This needs to find the directory record (making sure it is a directory), check that it can be
-// read, then assign the record as the "file-handle".
+// This needs to find the directory node (making sure it is a directory), check that it can be
+// read, then assign the node as the "file-handle".
 int isofs_opendir(const char *path, struct fuse_file_info *fi)
 {
     LOG("opendir(path=\"%s\", fi=%p)\n", path, fi);
 
-    const ISO* iso = GET_ISO();
-    // Get the directory record
-    const Record* record = get_record(iso, path);
+    // Get the directory node, the directories in the tar directory mirror the directories of the
+    // image (and the tar directory itself mirrors the root)
+    Image* image = GET_IMAGE();
+    const Index* index = image_index(image);
+    const Node* node = index_lookup_cached(index, path);
+    int tar = 0;
+    if (node && node->parent == index->generated && strcmp(node->name, TAR_DIR) == 0) { tar = tar_lookup(index, path, &node); }
+    else if (!node && errno == ENOENT) { tar = tar_lookup(index, path, &node); }
     // In the case of an error, return -errno
-    if (!record) { return -errno; }
+    if (!node) { return -errno; }
      // If it isn't a directory, return -ENOTDIR, if it doesn't have R_OK access, return -EACCES
-    if (!(record->file_flags & FILE_DIRECTORY)) { return -ENOTDIR; }
-    if (!check_access(iso, record, path, R_OK)) { return -EACCES; }
+    if (!S_ISDIR(node->mode) || tar == TAR_DIR_ARCHIVE) { return -ENOTDIR; }
+    if (!check_access(node, R_OK)) { return -EACCES; }
 
     // Set the file-handle as our directory object
-	fi->fh = (uintptr_t)record;
+    isofs_dir* dir = (isofs_dir*)malloc(sizeof(isofs_dir));
+    if (!dir) { return -ENOMEM; }
+    dir->node = node;
+    dir->tar = tar == TAR_DIR_MIRROR;
+    dir->image = image;
+    dir->index = index;
+    image_hold(image);
+	fi->fh = (uintptr_t)dir;
 	return 0;
 }
 
@@ -439,29 +865,24 @@ int isofs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t _of
 {
     LOG("readdir(path=\"%s\", buf=%p, filler=%p, ..., fi=%p)\n", path, buf, filler, fi);
 
-    const Record* directory = (const Record *)(uintptr_t)fi->fh;
-    const ISO* iso = GET_ISO();
-
-    // Get the root directory record, if path is just "/" then return it
-    Record* curr_record = (Record*) &iso->raw[directory->extent_location*iso->pvd->logical_block_size];
-    uint32_t offset = 0;
-    while (offset < directory->extent_length) {
-        // Get the record's filename and check for a match
-        char filename[256];
-        get_record_filename(iso, curr_record, filename);
-        if (filler(buf, filename, NULL, 0) != 0) {
-            return -ENOMEM;
-        }
+    const isofs_dir* dir = (const isofs_dir*)(uintptr_t)fi->fh;
+    const Node* directory = dir->node;
 
-        
+    // The current and parent directories aren't in the index
+    if (filler(buf, ".", NULL, 0) != 0 || filler(buf, "..", NULL, 0) != 0) {
+        return -ENOMEM;
+    }
+
+    // The directories in the tar directory are empty when listed so that walking them doesn't read
+    // the image once for each level, their archives can only be looked up
+    if (dir->tar) { return 0; }
 
-        // Advance to the next record (make sure to account for end-of-sector issues)
-        offset += curr_record->length;
-        curr_record = (Record*) &iso->raw[offset + directory->extent_location*iso->pvd->logical_block_size];
-        // Update offset; jump to next block if necessary
-        if (curr_record->length == 0) {
-            offset = ((offset/iso->pvd->logical_block_size) + 1)*iso->pvd->logical_block_size;
-            curr_record = (Record*) &iso->raw[offset + directory->extent_location*iso->pvd->logical_block_size];
+    // Give the name of each child
+    for (uint32_t i = 0; i < directory->nchildren; i++) {
+        const Node* child = directory->children[i];
+        if (child == dir->index->generated) { continue; } // /.isofs can only be looked up
+        if (filler(buf, child->name, NULL, 0) != 0) {
+            return -ENOMEM;
         }
     }
 
@@ -474,7 +895,9 @@ int isofs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t _of
 int isofs_releasedir(const char *path, struct fuse_file_info *fi)
 {
     LOG("releasedir(path=\"%s\", fi=%p)\n", path, fi);
-    // Nothing to do here actually
+    isofs_dir* dir = (isofs_dir*)(uintptr_t)fi->fh;
+    put_image(dir->image);
+    free(dir);
 	return 0;
 }
 
@@ -483,8 +906,19 @@ int isofs_releasedir(const char *path, struct fuse_file_info *fi)
 
 // This is our "file" object
 typedef struct _isofs_file {
-    uint8_t* data;  // the data for the file
-    size_t size;    // the size of the file data (in bytes)
+    const Node* node;   // the node of the file in the index (the query directory for queries)
+    bool query;         // if this is a query
+    TextBuffer results; // for queries, the paths of the matching files
+    TarFile* tar;       // for tar archives, what is in the archive
+    Bundle* bundle;     // for bundles, the files in the bundle
+    bool plan;          // if this is the plan file opened for writing
+    bool swap;          // if this is the swap file opened for writing
+    TextBuffer pending; // for the plan file, the last line written if it didn't have a newline yet,
+                        // and for the swap file everything written since it was last flushed
+    struct fuse_context user; // for the plan file, the user that opened it
+    PlanWriter writer;  // for the plan file, checks that user can read the files in the plan
+    Image* image;       // the image the file is in, which is held until it is closed
+    const Index* index; // the index of the image the node is from
 } isofs_file;
 
 /** File open operation
@@ -499,35 +933,184 @@ typedef struct _isofs_file {
  * fuse_file_info structure, which will be passed to all file operations.
  */
  // This is emulating the system call open: https://linux.die.net/man/2/open
-int isofs_open(const char *path, struct fuse_file_info *fi)
+ //
+ // The file is opened in the current image, which the file holds on to until it is released (see
+ // isofs_open() below).
+static int open_in_image(Image* image, const char *path, struct fuse_file_info *fi)
 {
-    LOG("open(path=\"%s\", fi=%p)\n", path, fi);
+    // Get the file node
+    const Index* index = image_index(image);
+    const char* query_str;
+    const Node* node = index_lookup_cached(index, path);
+
+    // Writing the plan file starts a new plan
+    bool writing = (fi->flags & O_RDWR) || (fi->flags & O_WRONLY);
+    if (writing && prefetch_is_plan(index, node)) {
+        if (!check_access(node, W_OK)) { return -EACCES; }
+        if (!image->prefetcher) { return -ENOTSUP; }
+        isofs_file *f = (isofs_file*) calloc(1, sizeof(isofs_file));
+        if (!f) { return -ENOMEM; }
+        f->node = node;
+        f->plan = true;
+        f->user = *fuse_get_context();
+        f->writer.permits = check_user_access;
+        f->writer.user = &f->user;
+        prefetch_new_plan(image->prefetcher);
+        fi->direct_io = 1;
+        fi->fh = (uintptr_t)f;
+        return 0;
+    }
 
-    // If either write or read/write access is requested (available in fi->flags) then return -EACCESS
-    if ((fi->flags & O_RDWR) || (fi->flags & O_WRONLY)) { return -EACCES; }
-    const ISO* iso = GET_ISO();
+    // Writing the swap file gives the image files to swap in when it is closed
+    if (writing && image_is_swap_file(index, node)) {
+        if (!check_access(node, W_OK)) { return -EACCES; }
+        if (!images.swappable) { return -ENOTSUP; }
+        isofs_file *f = (isofs_file*) calloc(1, sizeof(isofs_file));
+        if (!f) { return -ENOMEM; }
+        f->node = node;
+        f->swap = true;
+        fi->direct_io = 1;
+        fi->fh = (uintptr_t)f;
+        return 0;
+    }
 
-    // Get the directory record
-    const Record* record = get_record(iso, path);
+    // If either write or read/write access is requested (available in fi->flags) then return -EACCESS
+    if (writing) { return -EACCES; }
+    if (image_is_swap_file(index, node)) {
+        // The image files and how the last swap went are made now, like queries
+        if (!check_access(node, R_OK)) { return -EACCES; }
+        isofs_file *f = (isofs_file*) calloc(1, sizeof(isofs_file));
+        if (!f) { return -ENOMEM; }
+        f->node = node;
+        f->query = true;
+        if (!images_report(&images, &f->results)) { free(f->results.data); free(f); return -ENOMEM; }
+        fi->direct_io = 1;
+        fi->fh = (uintptr_t)f;
+        return 0;
+    }
+    if (fair_is_users_file(index, node)) {
+        // The users file is made now, like queries
+        if (!check_access(node, R_OK)) { return -EACCES; }
+        isofs_file *f = (isofs_file*) calloc(1, sizeof(isofs_file));
+        if (!f) { return -ENOMEM; }
+        f->node = node;
+        f->query = true;
+        if (!fair_report(&fair_share, &f->results)) { free(f->results.data); free(f); return -ENOMEM; }
+        fi->direct_io = 1;
+        fi->fh = (uintptr_t)f;
+        return 0;
+    }
+    if (pressure_is_stats_file(index, node)) {
+        // The memory budget changes so it is put in front of the rest of the stats each time
+        if (!check_access(node, R_OK)) { return -EACCES; }
+        isofs_file *f = (isofs_file*) calloc(1, sizeof(isofs_file));
+        if (!f) { return -ENOMEM; }
+        f->node = node;
+        f->query = true;
+        if (!pressure_report(&memory_budget, &f->results)) { free(f->results.data); free(f); return -ENOMEM; }
+        if (!generated_append(index, node, &f->results)) { int error = errno; free(f->results.data); free(f); return -error; }
+        fi->direct_io = 1;
+        fi->fh = (uintptr_t)f;
+        return 0;
+    }
+    if (!node && errno == ENOENT && (node = query_lookup(index, path, QUERY_DIR, &query_str))) {
+        // Queries are run now, they need to be able to get into the query directory
+        if (!check_access(node, X_OK)) { return -EACCES; }
+        Query query;
+        if (!query_parse(index, query_str, &query)) { return -errno; }
+        // Only files that the user could find by listing the directory (and those below it) are
+        // given, the threads running the query see the user through a copy of the context
+        if (!check_access(query.dir, X_OK)) { query_free(&query); return -EACCES; }
+        struct fuse_context user = *fuse_get_context();
+        query.permits = check_node_access;
+        query.user = &user;
+        isofs_file *f = (isofs_file*) calloc(1, sizeof(isofs_file));
+        if (!f) { query_free(&query); return -ENOMEM; }
+        f->node = node;
+        f->query = true;
+        bool ok = query_run(index, &query, &f->results);
+        query_free(&query);
+        if (!ok) { free(f->results.data); free(f); return -ENOMEM; }
+
+        // The size given by getattr is 0, so the kernel has to read until the end
+        fi->direct_io = 1;
+        fi->fh = (uintptr_t)f;
+        return 0;
+    }
+    if (!node && errno == ENOENT && (node = query_lookup(index, path, BUNDLE_DIR, &query_str))) {
+        // Bundles are made now, like queries, with the same files as the query would give except
+        // for the ones that the user can't read
+        if (!check_access(node, X_OK)) { return -EACCES; }
+        Query query;
+        if (!query_parse(index, query_str, &query)) { return -errno; }
+        if (!check_access(query.dir, X_OK)) { query_free(&query); return -EACCES; }
+        struct fuse_context user = *fuse_get_context();
+        query.permits = check_node_access;
+        query.user = &user;
+        Bundle* bundle = bundle_open(index, &query);
+        query_free(&query);
+        if (!bundle) { return -errno; }
+        isofs_file *f = (isofs_file*) calloc(1, sizeof(isofs_file));
+        if (!f) { bundle_close(bundle); return -ENOMEM; }
+        f->node = node;
+        f->bundle = bundle;
+        fi->direct_io = 1;
+        fi->fh = (uintptr_t)f;
+        return 0;
+    }
+    if (!node && errno == ENOENT && tar_lookup(index, path, &node) == TAR_DIR_ARCHIVE) {
+        // Archives are worked out now, every file in them must be readable
+        TarFile* tar = tar_open(index, node);
+        if (!tar) { return -errno; }
+        for (size_t i = 0; i <= tar->nentries; i++) {
+            const Node* entry = i < tar->nentries ? tar->entries[i].node : node;
+            if (!check_access(entry, S_ISDIR(entry->mode) ? R_OK | X_OK : R_OK)) { tar_close(tar); return -EACCES; }
+        }
+        isofs_file *f = (isofs_file*) calloc(1, sizeof(isofs_file));
+        if (!f) { tar_close(tar); return -ENOMEM; }
+        f->node = node;
+        f->tar = tar;
+        fi->fh = (uintptr_t)f;
+        return 0;
+    }
     // In the case of an error, return -errno
-    if (!record) { return -errno; }
+    if (!node) { return -errno; }
     // If it is a directory, return -EISDIR, if it doesn't have R_OK access, return -EACCES
-    if (record->file_flags & FILE_DIRECTORY) { return -EISDIR; }
-    if (!check_access(iso, record, path, R_OK)) { return -EACCES; }
+    if (S_ISDIR(node->mode)) { return -EISDIR; }
+    if (!check_access(node, R_OK)) { return -EACCES; }
 
     // Allocate a new isofs_file object (if it cannot be allocated return -ENOMEM)
-    isofs_file *f = (isofs_file*) malloc(sizeof(isofs_file));
+    isofs_file *f = (isofs_file*) calloc(1, sizeof(isofs_file));
     if (!f) {return -ENOMEM; }
 
     // Fill in the fields of the structure so they can be used later
-    f->data = &iso->raw[record->extent_location*iso->pvd->logical_block_size];
-    f->size = record->extent_length;
+    f->node = node;
+    if (image->prefetcher) { prefetch_opened(image->prefetcher, node); }
+    if (image->scanner) { holes_scanner_opened(image->scanner, node); }
+
+    // The files of an image never change, so the kernel can keep their pages between opens, unless
+    // the file changed when the image was swapped
+    if (!node->generated) { fi->keep_cache = !image_take_stale(node); }
 
     // Set the file-handle as our file object
     fi->fh = (uintptr_t)f;
     return 0;
 }
 
+int isofs_open(const char *path, struct fuse_file_info *fi)
+{
+    LOG("open(path=\"%s\", fi=%p)\n", path, fi);
+    Image* image = GET_IMAGE();
+    int result = open_in_image(image, path, fi);
+    if (result == 0) {
+        isofs_file *f = (isofs_file*)(uintptr_t)fi->fh;
+        f->image = image;
+        f->index = image_index(image);
+        image_hold(image);
+    }
+    return result;
+}
+
 /** Read data from an open file
  *
  * Read should return exactly the number of bytes requested except on EOF or error, otherwise the
@@ -549,12 +1132,82 @@ int isofs_read(const char *path, char *buf, size_t size, off_t offset, struct fu
     isofs_file *f = (isofs_file*)(uintptr_t)fi->fh;
 
     // Copy the necessary data to the buffer and return the number of bytes copied
-    if (f->size - offset < size) { size = f->size - offset; }
-    memcpy(buf, f->data + offset, size);
+    if (f->query) {
+        if ((uint64_t)offset >= f->results.length) { return 0; }
+        if (f->results.length - offset < size) { size = f->results.length - offset; }
+        memcpy(buf, f->results.data + offset, size);
+        return size;
+    }
+    if (f->tar) {
+        ssize_t n = tar_read(f->tar, buf, size, offset);
+        return n < 0 ? -errno : n;
+    }
+    if (f->bundle) {
+        ssize_t n = bundle_read(f->bundle, buf, size, offset);
+        return n < 0 ? -errno : n;
+    }
+    const HoleMap* holes = f->node->generated ? NULL : holes_get(f->index, f->node, false);
+    ssize_t n = f->node->generated ? generated_read(f->index, f->node, buf, size, offset) :
+                holes ? holes_read(f->index, f->node, holes, buf, size, offset) :
+                        index_read(f->index, f->node, buf, size, offset);
+    return n < 0 ? -errno : n;
+}
 
+/** Write data to an open file
+ *
+ * Write should return exactly the number of bytes requested except on error. An exception to this
+ * is when the 'direct_io' mount option is specified (see read operation).
+ */
+// This is emulating the system call pwrite: https://linux.die.net/man/2/pwrite
+//
+// Only the plan and swap files can be opened for writing, the lines written to the plan file are
+// added to the plan in order (no matter what the offset is) and the lines written to the swap file
+// are kept until it is flushed.
+int isofs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    LOG("write(path=\"%s\", buf=%p, size=%zu, offset=%lld, fi=%p)\n", path, buf, size, offset, fi);
+    isofs_file *f = (isofs_file*)(uintptr_t)fi->fh;
+    if (f->swap) { return text_append(&f->pending, buf, size) ? (int)size : -ENOMEM; }
+    if (!f->plan) { return -EBADF; }
+    if (!prefetch_write(f->image->prefetcher, &f->writer, &f->pending, buf, size)) { return -ENOMEM; }
     return size;
 }
 
+/** Change the size of a file
+ *
+ * This is called before open() when O_TRUNC is given, which only makes sense for the plan and swap
+ * files (which are never changed by writing them anyway).
+ */
+// This is emulating the system call truncate: https://linux.die.net/man/2/truncate
+int isofs_truncate(const char *path, off_t size)
+{
+    LOG("truncate(path=\"%s\", size=%lld)\n", path, size);
+    const Index* index = GET_INDEX();
+    const Node* node = index_lookup_cached(index, path);
+    if (!prefetch_is_plan(index, node) && !image_is_swap_file(index, node)) { return node || errno != ENOENT ? -EROFS : -ENOENT; }
+    if (!check_access(node, W_OK)) { return -EACCES; }
+    return 0;
+}
+
+/** Possibly flush cached data
+ *
+ * This is called on each close() of a file descriptor, so it is where the error of a swap that
+ * can't be started is given back. Closing the swap file after writing image files to it starts
+ * swapping them in, which happens in the background (see /.isofs/swap for how it went).
+ */
+// This is emulating the system call close: https://linux.die.net/man/2/close
+int isofs_flush(const char *path, struct fuse_file_info *fi)
+{
+    LOG("flush(path=\"%s\", fi=%p)\n", path, fi);
+    isofs_file *f = (isofs_file*)(uintptr_t)fi->fh;
+    if (!f->swap || !f->pending.length) { return 0; }
+    char* lines = strndup(f->pending.data, f->pending.length);
+    if (!lines) { return -ENOMEM; }
+    text_truncate(&f->pending, 0);
+    if (!images_start_swap(&images, swap_worker, lines)) { free(lines); return -errno; }
+    return 0;
+}
+
 /** Release an open file
  *
  * Release is called when there are no more references to an open file: all file descriptors are
@@ -573,12 +1226,50 @@ int isofs_release(const char *path, struct fuse_file_info *fi)
     // Get our file "handle"
     isofs_file *f = (isofs_file*)(uintptr_t)fi->fh;
 
+    if (f->plan) { prefetch_flush(f->image->prefetcher, &f->writer, &f->pending); }
+    free(f->pending.data);
+    free(f->results.data);
+    if (f->tar) { tar_close(f->tar); }
+    if (f->bundle) { bundle_close(f->bundle); }
+    put_image(f->image);
     free(f);
 
     return 0;
 }
 
 
+////////// Tracing /////////////////////////////////////////////////////////////////////////////////
+
+// When the probes are built in (see trace.h) each operation is wrapped so that the op__entry and
+// op__return probes fire around it, and TRACED() gives the wrapper instead of the operation itself
+#ifdef TRACE_ENABLED
+#define TRACE_OP(op, params, ...) \
+    static int traced_##op params { \
+        TRACE(op__entry, #op, path); \
+        int result = isofs_##op(__VA_ARGS__); \
+        TRACE(op__return, #op, path, result); \
+        return result; \
+    }
+TRACE_OP(statfs, (const char *path, struct statvfs *statv), path, statv)
+TRACE_OP(getattr, (const char *path, struct stat *statbuf), path, statbuf)
+TRACE_OP(access, (const char *path, int mask), path, mask)
+TRACE_OP(getxattr, (const char *path, const char *name, char *value, size_t size), path, name, value, size)
+TRACE_OP(listxattr, (const char *path, char *list, size_t size), path, list, size)
+TRACE_OP(opendir, (const char *path, struct fuse_file_info *fi), path, fi)
+TRACE_OP(readdir, (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi), path, buf, filler, offset, fi)
+TRACE_OP(releasedir, (const char *path, struct fuse_file_info *fi), path, fi)
+TRACE_OP(open, (const char *path, struct fuse_file_info *fi), path, fi)
+TRACE_OP(read, (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi), path, buf, size, offset, fi)
+TRACE_OP(flush, (const char *path, struct fuse_file_info *fi), path, fi)
+TRACE_OP(release, (const char *path, struct fuse_file_info *fi), path, fi)
+TRACE_OP(write, (const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi), path, buf, size, offset, fi)
+TRACE_OP(truncate, (const char *path, off_t size), path, size)
+#define TRACED(op) traced_##op
+#else
+#define TRACED(op) isofs_##op
+#endif
+
+
 ////////// Main Function ///////////////////////////////////////////////////////////////////////////
 
 // This sets up the set of operations to give to the FUSE library for our filesystem
@@ -588,26 +1279,81 @@ struct fuse_operations isofs_oper = {
     .destroy = isofs_destroy,
 
     // Basic Information Operations
-    .statfs = isofs_statfs,
-    .getattr = isofs_getattr,
-    .access = isofs_access,
+    .statfs = TRACED(statfs),
+    .getattr = TRACED(getattr),
+    .access = TRACED(access),
+    .getxattr = TRACED(getxattr),
+    .listxattr = TRACED(listxattr),
 
     // Directories
-    .opendir = isofs_opendir,
-    .readdir = isofs_readdir,
-    .releasedir = isofs_releasedir,
+    .opendir = TRACED(opendir),
+    .readdir = TRACED(readdir),
+    .releasedir = TRACED(releasedir),
 
     // Files
-    .open = isofs_open,
-    .read = isofs_read,
-    .release = isofs_release,
+    .open = TRACED(open),
+    .read = TRACED(read),
+    .flush = TRACED(flush),
+    .release = TRACED(release),
+
+    // Only the plan and swap files can be written
+    .write = TRACED(write),
+    .truncate = TRACED(truncate),
 
     // There are lots of other functions we aren't implementing since we are read-only...
-    //    create, write, flush, fsync, ftruncate, truncate, chmod, utime, rename, mkdir, unlink, rmdir
+    //    create, fsync, ftruncate, chmod, utime, rename, mkdir, unlink, rmdir
     // Skipping many other operations since they don't make sense for ISO files:
-    //    mknod, readlink, symlink, link, chown, {set,get,list,remove}xattr, lock, ...
+    //    mknod, readlink, symlink, link, chown, {set,remove}xattr, lock, ...
+};
+
+// Options specific to isofs, given with -o
+typedef struct _isofs_options {
+    char* cache_dir;   // directory to keep a persistent cache of the image in
+    char* hydrate;     // rate to fill in the cache in the background
+    char* window;      // size of the windows to map the image in
+    int noudf;         // use the ISO-9660 filesystem even if the image has a UDF filesystem
+    int trigrams;      // build the trigram index of the names of the files for queries
+    unsigned threads;  // number of threads serving requests, or 0 for one for each CPU
+    int data_threads;  // number of threads reading file data, 0 for none, or -1 for the default
+    int pin;           // keep each thread serving requests on its own CPU
+    int numa_replicas; // make a replica of the index for each NUMA node
+    char* mem_budget;  // most memory for the caches together
+    int swappable;     // allow the image to be swapped with /.isofs/swap
+    int fuse_loop;     // serve requests with the multithreaded libfuse loop instead of loop.h
+} isofs_options;
+
+// Keys of the isofs-specific options that are handled by isofs_opt_proc()
+enum { KEY_SHARE };
+
+static const struct fuse_opt isofs_opts[] = {
+    { "cache_dir=%s", offsetof(isofs_options, cache_dir), 0 },
+    { "hydrate=%s", offsetof(isofs_options, hydrate), 0 },
+    { "window=%s", offsetof(isofs_options, window), 0 },
+    { "noudf", offsetof(isofs_options, noudf), 1 },
+    { "trigrams", offsetof(isofs_options, trigrams), 1 },
+    { "threads=%u", offsetof(isofs_options, threads), 0 },
+    { "data_threads=%d", offsetof(isofs_options, data_threads), 0 },
+    { "pin", offsetof(isofs_options, pin), 1 },
+    { "numa_replicas", offsetof(isofs_options, numa_replicas), 1 },
+    { "mem_budget=%s", offsetof(isofs_options, mem_budget), 0 },
+    { "swappable", offsetof(isofs_options, swappable), 1 },
+    { "fuse_loop", offsetof(isofs_options, fuse_loop), 1 },
+    FUSE_OPT_KEY("share=", KEY_SHARE),
+    FUSE_OPT_END
 };
 
+/**
+ * Handles the options that can be given more than once. Returns 0 to remove the option from the
+ * arguments, 1 to keep it, or -1 if it is invalid.
+ */
+static int isofs_opt_proc(void* data, const char* arg, int key, struct fuse_args* outargs)
+{
+    if (key != KEY_SHARE) { return 1; }
+    if (fair_set(&fair_share, arg + strlen("share="))) { return 0; }
+    fprintf(stderr, "share must be like UID:WEIGHT or UID:WEIGHT:RATE (such as 1000:2:10M)\n");
+    return -1;
+}
+
 int main(int argc, char *argv[])
 {
     if ((getuid() == 0) || (geteuid() == 0)) {
@@ -625,20 +1371,69 @@ int main(int argc, char *argv[])
     // that neither of the last two start with a hyphen (this will break if you actually have a
     // root_dir or mount_point whose name starts with a hyphen... but enh)
     if ((argc < 3) || (argv[argc-2][0] == '-') || (argv[argc-1][0] == '-')) {
-        fprintf(stderr, "usage:  %s [FUSE and mount options] iso_file mount_point\n", argv[0]);
+        fprintf(stderr, "usage:  %s [FUSE and mount options] iso_file [more iso_files of the volume set] mount_point\n", argv[0]);
+        fprintf(stderr, "lookups are cached for an hour unless -o swappable is given (%s), attributes for FUSE's default of 1s\n", LOOP_CACHE_OPTIONS);
         return 1;
     }
 
-    // Get the ISO file path out of the argument list
-    const char* filename = argv[argc-2];
-    argv[argc-2] = argv[argc-1];
-    argv[argc-1] = NULL;
-    argc--;
-
-    // Load the ISO file
-    ISO* iso = load_iso(filename);
+    // Get the ISO file paths out of the argument list, they are all of the arguments before the
+    // mount point that aren't options or the values of -o options
+    int first = argc-2;
+    while (first > 1 && argv[first-1][0] != '-' && strcmp(argv[first-2], "-o") != 0) { first--; }
+    int nfiles = argc-1-first;
+    char** filenames = (char**)malloc(nfiles * sizeof(char*));
+    if (!filenames) { perror("isofs"); return 1; }
+    memcpy(filenames, argv + first, nfiles * sizeof(char*));
+    argv[first] = argv[argc-1];
+    argv[first+1] = NULL;
+    argc = first+1;
+
+    // Get the isofs-specific options out of the rest of the arguments
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    isofs_options options = { NULL, NULL, NULL, 0, 0, 0, -1, 0, 0, NULL, 0, 0 };
+    fair_init(&fair_share);
+    if (fuse_opt_parse(&args, &options, isofs_opts, isofs_opt_proc) == -1) { return 1; }
+    // The image never changes so the kernel can cache lookups, unless told otherwise (or unless it
+    // can be swapped, which the kernel wouldn't see for a long time), but not attributes since the
+    // st_blocks of a file changes when it is scanned for holes
+    if (!options.swappable && fuse_opt_insert_arg(&args, 1, LOOP_CACHE_OPTIONS) == -1) { perror("isofs"); return 1; }
+    if (options.hydrate && (!parse_size(options.hydrate, &hydrate_rate) || !options.cache_dir)) {
+        fprintf(stderr, "hydrate must be a rate like 10M and requires cache_dir\n");
+        return 1;
+    }
+    if (options.window && (!parse_size(options.window, &window_size) || window_size == 0)) {
+        fprintf(stderr, "window must be a size like 64M\n");
+        return 1;
+    }
+    size_t mem_budget = 0;
+    if (options.mem_budget && (!parse_size(options.mem_budget, &mem_budget) || mem_budget == 0)) {
+        fprintf(stderr, "mem_budget must be a size like 512M\n");
+        return 1;
+    }
+    pressure_init(&memory_budget, mem_budget);
+
+    // Load the ISO files, which are the image that is mounted (images swapped in later are loaded
+    // the same way)
+    cache_dir = options.cache_dir;
+    use_udf = !options.noudf;
+    use_trigrams = options.trigrams;
+    Image* image = load_image(filenames, nfiles);
+    free(filenames);
+    if (!image) { return 1; }
+    images_init(&images, image);
+    images.swappable = options.swappable && !options.fuse_loop; // the libfuse loop doesn't count requests
 
     // Turn over control to FUSE
     umask(0); // makes things a bit easier later
-    return fuse_main(argc, argv, &isofs_oper, iso);
+    char* mountpoint;
+    int multithreaded;
+    struct fuse* fuse = fuse_setup(args.argc, args.argv, &isofs_oper, sizeof(isofs_oper), &mountpoint, &multithreaded, image->index);
+    fuse_opt_free_args(&args);
+    if (!fuse) { return 1; }
+    int result = multithreaded && options.fuse_loop ? fuse_loop_mt(fuse) :
+        loop_run(fuse, multithreaded ? options.threads : 1, multithreaded ? options.data_threads : 0, &fair_share, options.pin, &images, options.numa_replicas);
+    fuse_teardown(fuse, mountpoint);
+    fair_free(&fair_share);
+    pressure_free(&memory_budget);
+    return result == -1 ? 1 : 0;
 }
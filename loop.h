@@ -0,0 +1,450 @@
+/**
+ * The loop that serves FUSE requests, used instead of fuse_main() so that isofs controls how
+ * requests are handled. A fixed set of worker threads (one for each CPU by default, or
+ * `-o threads=N`) each read requests from the kernel and process them, instead of the libfuse loop
+ * that starts and stops threads as the load changes. With -s there is just one worker, and if the
+ * workers can't be started the multithreaded libfuse loop is used (and the image can't be swapped).
+ * `-o fuse_loop` always uses the libfuse loop, so the two can be compared (tests/bench_metadata.py
+ * gives the throughput and CPU time of small requests with each one).
+ *
+ * On Linux each worker has its own clone of the /dev/fuse connection, so the workers don't all
+ * wait on and reply through the same file descriptor. With `-o pin` each worker is also kept on
+ * one CPU, with the workers spread evenly over the NUMA nodes (and grouped by node), so a request
+ * is handled start to finish on one CPU with its data in that CPU's caches. With
+ * `-o numa_replicas` each NUMA node also gets its own replica of the index (see replica.h) and
+ * each request uses the replica of the node that it is handled on. Each request is counted while it
+ * is in progress so that the image can be swapped safely (see image.h).
+ *
+ * Reads of file data are handed off to a separate set of data threads (as many as the workers by
+ * default, or `-o data_threads=N`), so the workers go right back to other requests. That way a few
+ * clients streaming large files can't keep every worker busy while stat() and other requests for
+ * metadata wait behind them. `-o data_threads=0` handles reads on the workers like everything else.
+ * The reads waiting for a data thread are shared fairly between users (see fairshare.h).
+ *
+ * Since the image never changes the kernel is also told to keep lookups and the contents of files
+ * for a long time (unless other timeouts are given or the image can be swapped), so that most path
+ * lookups never have to come to isofs at all. Attributes are only kept for the default second since
+ * st_blocks changes once a file has been scanned for holes (see holes.h).
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <fuse_lowlevel.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#endif
+
+#define LOOP_MAX_THREADS 64   // most worker threads
+#define LOOP_MAX_CPUS    1024 // most CPUs that workers are pinned to
+#define LOOP_MAX_NODES   64   // most NUMA nodes looked for
+#define LOOP_MIN_REQUEST 40   // size of the header of every request (struct fuse_in_header)
+#define LOOP_OP_READ     15   // the opcode of reads (FUSE_READ)
+#define LOOP_UID_OFFSET  24   // where the uid of the process is in the header of a request
+#define LOOP_READ_SIZE   56   // where the number of bytes to read is in a read request (in fuse_read_in)
+#define LOOP_CACHE_OPTIONS "-oentry_timeout=3600,negative_timeout=3600"
+
+#if defined(__linux__) && !defined(FUSE_DEV_IOC_CLONE)
+#define FUSE_DEV_IOC_CLONE _IOR(229, 0, uint32_t) // from linux/fuse.h
+#endif
+
+struct _Loop;
+
+/**
+ * A read waiting for a data thread.
+ */
+typedef struct _LoopRequest {
+    FairRequest fair;       // the user and size of the read, must be first
+    struct fuse_chan* chan; // the channel to reply through
+    size_t size;
+    char data[];            // the request as it was received
+} LoopRequest;
+
+typedef struct _LoopWorker {
+    struct _Loop* loop;
+    struct fuse_chan* chan; // the channel the worker reads requests from and replies through
+    bool cloned;            // if the channel is a clone that the worker owns
+    int cpu;                // the CPU the worker is kept on, or -1
+    pthread_t thread;
+} LoopWorker;
+
+typedef struct _Loop {
+    struct fuse_session* session;
+    LoopWorker workers[LOOP_MAX_THREADS]; // the first worker is the main thread
+    unsigned nworkers;                    // number of workers (including the main thread)
+    Images* images;                       // the image the requests are for
+    pthread_t data_threads[LOOP_MAX_THREADS]; // the threads handling reads
+    unsigned ndata;                       // number of data threads, 0 if the workers handle reads
+    FairShare* fair;                      // the reads waiting for a data thread, its lock is also used for stop
+    pthread_cond_t wake;                  // signalled when there are reads or the data threads should stop
+    bool stop;                            // tells the data threads to stop
+} Loop;
+
+/**
+ * Processes a request for the current image, using the replica of its index for the CPU this
+ * thread is on (or -1 to look it up) if there are replicas.
+ */
+static void loop_process(Loop* loop, const char* buf, size_t size, struct fuse_chan* chan, int cpu)
+{
+    unsigned phase = image_enter(loop->images);
+#ifdef __linux__
+    const Image* image = image_local;
+    if (image->nreplicas && cpu < 0) { cpu = sched_getcpu(); }
+    replica_local = image->nreplicas && cpu >= 0 && cpu < IMAGE_MAX_CPUS ? image->cpu_replicas[cpu] : NULL;
+#else
+    (void)cpu;
+#endif
+    fuse_session_process(loop->session, buf, size, chan);
+    image_exit(loop->images, phase);
+}
+
+/**
+ * Hands a read off to the data threads, copying the request. Returns false if out of memory, in
+ * which case the read should be handled right away.
+ */
+static bool loop_queue_read(Loop* loop, const char* buf, size_t size, struct fuse_chan* chan)
+{
+    LoopRequest* req = (LoopRequest*)malloc(sizeof(LoopRequest) + size);
+    if (!req) { return false; }
+    uint32_t uid, cost = 0;
+    memcpy(&uid, buf + LOOP_UID_OFFSET, sizeof(uint32_t));
+    if (size >= LOOP_READ_SIZE + sizeof(uint32_t)) { memcpy(&cost, buf + LOOP_READ_SIZE, sizeof(uint32_t)); }
+    req->fair.uid = (uid_t)uid;
+    req->fair.cost = cost;
+    req->chan = chan;
+    req->size = size;
+    memcpy(req->data, buf, size);
+    pthread_mutex_lock(&loop->fair->lock);
+    bool queued = fair_push(loop->fair, &req->fair);
+    if (queued) { pthread_cond_signal(&loop->wake); }
+    pthread_mutex_unlock(&loop->fair->lock);
+    if (!queued) { free(req); }
+    return queued;
+}
+
+/**
+ * A data thread: handles the reads handed off by the workers, in the order given by the fair share,
+ * until told to stop.
+ */
+static void* loop_data_worker(void* arg)
+{
+    Loop* loop = (Loop*)arg;
+    FairShare* fair = loop->fair;
+    pthread_mutex_lock(&fair->lock);
+    while (!loop->stop) {
+        uint64_t wait;
+        LoopRequest* req = (LoopRequest*)fair_pop(fair, &wait);
+        if (!req && !wait) { pthread_cond_wait(&loop->wake, &fair->lock); continue; }
+        if (!req) {
+            // Only users that are over their limit have reads waiting
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            wait += until.tv_nsec;
+            until.tv_sec += wait / 1000000000;
+            until.tv_nsec = wait % 1000000000;
+            pthread_cond_timedwait(&loop->wake, &fair->lock, &until);
+            continue;
+        }
+        pthread_mutex_unlock(&fair->lock);
+        loop_process(loop, req->data, req->size, req->chan, -1);
+        pthread_mutex_lock(&fair->lock);
+        fair_done(fair, &req->fair);
+        free(req);
+    }
+    pthread_mutex_unlock(&fair->lock);
+    return NULL;
+}
+
+/**
+ * Checks if a request is a read, which are handled by the data threads.
+ */
+static inline bool loop_is_read(const char* buf, size_t size)
+{
+    uint32_t opcode;
+    if (size < LOOP_MIN_REQUEST) { return false; }
+    memcpy(&opcode, buf + sizeof(uint32_t), sizeof(uint32_t)); // after the length
+    return opcode == LOOP_OP_READ;
+}
+
+/**
+ * A worker: reads requests and processes them until the filesystem is unmounted or told to exit.
+ * The main thread is also a worker, the others can be canceled while waiting for a request.
+ */
+static void* loop_worker(void* arg)
+{
+    LoopWorker* worker = (LoopWorker*)arg;
+    Loop* loop = worker->loop;
+    struct fuse_session* session = loop->session;
+#ifdef __linux__
+    if (worker->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set); // only a hint
+    }
+#endif
+    size_t size = fuse_chan_bufsize(worker->chan);
+    char* buf = (char*)malloc(size);
+    if (!buf) { perror("fuse worker"); fuse_session_exit(session); return NULL; }
+    pthread_cleanup_push(free, buf);
+    while (!fuse_session_exited(session)) {
+        struct fuse_chan* chan = worker->chan;
+        int res = fuse_chan_recv(&chan, buf, size);
+        if (res == -EINTR) { continue; } // a signal, which may be telling us to exit
+        if (res <= 0) { fuse_session_exit(session); break; } // unmounted or an error
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (!loop->ndata || !loop_is_read(buf, res) || !loop_queue_read(loop, buf, res, chan)) {
+            loop_process(loop, buf, res, chan, worker->cpu);
+        }
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+    pthread_cleanup_pop(1);
+    return NULL;
+}
+
+/**
+ * Gets the number of worker threads to use by default, one for each CPU.
+ */
+static unsigned loop_default_threads()
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return ncpus < 1 ? 1 : ncpus > LOOP_MAX_THREADS ? LOOP_MAX_THREADS : (unsigned)ncpus;
+}
+
+#ifdef __linux__
+/**
+ * Reads a request from a cloned channel, like the channels of libfuse do.
+ */
+static int loop_chan_receive(struct fuse_chan** chan, char* buf, size_t size)
+{
+    ssize_t res = read(fuse_chan_fd(*chan), buf, size);
+    if (res == -1 && errno == ENODEV) { return 0; } // unmounted
+    if (res == -1 && (errno == ENOENT || errno == EINTR || errno == EAGAIN)) { return -EINTR; } // try again
+    if (res == -1) { return -errno; }
+    return res < LOOP_MIN_REQUEST ? -EIO : (int)res;
+}
+
+/**
+ * Sends a reply through a cloned channel. Replies to requests that were interrupted are dropped by
+ * the kernel, which isn't a problem.
+ */
+static int loop_chan_send(struct fuse_chan* chan, const struct iovec iov[], size_t count)
+{
+    if (!iov) { return 0; }
+    ssize_t res = writev(fuse_chan_fd(chan), iov, count);
+    return res == -1 && errno != ENOENT ? -errno : 0;
+}
+
+static void loop_chan_destroy(struct fuse_chan* chan) { close(fuse_chan_fd(chan)); }
+
+/**
+ * Makes a clone of the connection of a channel, which gets requests from the same filesystem but
+ * has its own file descriptor. Returns NULL if it isn't supported by the kernel.
+ */
+static struct fuse_chan* loop_clone_chan(struct fuse_chan* chan)
+{
+    static struct fuse_chan_ops ops = { loop_chan_receive, loop_chan_send, loop_chan_destroy };
+    uint32_t fd = fuse_chan_fd(chan);
+    int clone_fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+    if (clone_fd == -1) { return NULL; }
+    if (ioctl(clone_fd, FUSE_DEV_IOC_CLONE, &fd) == -1) { close(clone_fd); return NULL; }
+    struct fuse_chan* clone = fuse_chan_new(&ops, clone_fd, fuse_chan_bufsize(chan), NULL);
+    if (!clone) { close(clone_fd); }
+    return clone;
+}
+
+/**
+ * Adds the CPUs in a list like "0-3,8-11" that this process can run on and that aren't in the
+ * list yet, all on the given NUMA node. Returns the new number of CPUs in the list.
+ */
+static unsigned loop_add_cpus(const char* list, int node, const cpu_set_t* allowed, cpu_set_t* added, int* cpus, int* nodes, unsigned count)
+{
+    while (*list >= '0' && *list <= '9') {
+        char* end;
+        unsigned long first = strtoul(list, &end, 10), last = first;
+        if (*end == '-') { last = strtoul(end + 1, &end, 10); }
+        for (unsigned long cpu = first; cpu <= last && cpu < CPU_SETSIZE && count < LOOP_MAX_CPUS; cpu++) {
+            if (CPU_ISSET(cpu, allowed) && !CPU_ISSET(cpu, added)) { CPU_SET(cpu, added); nodes[count] = node; cpus[count++] = (int)cpu; }
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+/**
+ * Gets the CPUs this process can run on, with the CPUs of each NUMA node together and the nodes in
+ * order, along with the node of each (-1 if not known). Returns the number of CPUs.
+ */
+static unsigned loop_numa_cpus(int* cpus, int* nodes)
+{
+    cpu_set_t allowed, added;
+    CPU_ZERO(&added);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) { return 0; }
+    unsigned count = 0;
+    char path[64], list[4096];
+    for (int node = 0; node < LOOP_MAX_NODES; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* file = fopen(path, "r");
+        if (!file) { continue; }
+        if (fgets(list, sizeof(list), file)) { count = loop_add_cpus(list, node, &allowed, &added, cpus, nodes, count); }
+        fclose(file);
+    }
+    // Any CPUs without a node (or all of them without NUMA information) go at the end
+    for (int cpu = 0; cpu < CPU_SETSIZE && count < LOOP_MAX_CPUS; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && !CPU_ISSET(cpu, &added)) { nodes[count] = -1; cpus[count++] = cpu; }
+    }
+    return count;
+}
+
+/**
+ * Making the replica of the index for one NUMA node.
+ */
+typedef struct _LoopReplica {
+    const Index* index;
+    Index* replica;      // the replica, or NULL if it couldn't be made
+    int node;
+    cpu_set_t cpus;      // the CPUs of the node
+    pthread_t thread;
+} LoopReplica;
+
+static void* loop_replicate(void* arg)
+{
+    // Move to the node first so that all of the memory of the replica is on that node
+    LoopReplica* work = (LoopReplica*)arg;
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &work->cpus) == 0) { work->replica = index_replicate(work->index); }
+    return NULL;
+}
+
+/**
+ * Makes a replica of the index of an image for each NUMA node with CPUs that this process can run
+ * on (if there is more than one), all at the same time, and sets which replica is used on each CPU.
+ * Nodes that don't get a replica use the original index. This is also used for the images swapped
+ * in later.
+ */
+static void loop_make_replicas(Image* image)
+{
+    int cpus[LOOP_MAX_CPUS], nodes[LOOP_MAX_CPUS];
+    unsigned ncpus = loop_numa_cpus(cpus, nodes);
+    LoopReplica work[LOOP_MAX_NODES];
+    unsigned nnodes = 0;
+    for (unsigned i = 0; i < ncpus; i++) {
+        if (nodes[i] < 0) { continue; }
+        if (nnodes == 0 || work[nnodes-1].node != nodes[i]) {
+            work[nnodes].index = image->index;
+            work[nnodes].replica = NULL;
+            work[nnodes].node = nodes[i];
+            CPU_ZERO(&work[nnodes++].cpus);
+        }
+        CPU_SET(cpus[i], &work[nnodes-1].cpus);
+    }
+    if (nnodes < 2) { return; }
+    bool started[LOOP_MAX_NODES];
+    for (unsigned n = 0; n < nnodes; n++) { started[n] = pthread_create(&work[n].thread, NULL, loop_replicate, &work[n]) == 0; }
+    for (unsigned n = 0; n < nnodes; n++) {
+        if (started[n]) { pthread_join(work[n].thread, NULL); }
+        if (!work[n].replica) { fprintf(stderr, "no index replica for NUMA node %d\n", work[n].node); continue; }
+        image->replicas[image->nreplicas++] = work[n].replica;
+        for (int cpu = 0; cpu < IMAGE_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &work[n].cpus)) { image->cpu_replicas[cpu] = work[n].replica; }
+        }
+    }
+}
+#endif
+
+/**
+ * Stops the data threads. Any reads that are still waiting are dropped when the fair share is freed.
+ */
+static void loop_stop_data(Loop* loop)
+{
+    pthread_mutex_lock(&loop->fair->lock);
+    loop->stop = true;
+    pthread_cond_broadcast(&loop->wake);
+    pthread_mutex_unlock(&loop->fair->lock);
+    for (unsigned i = 0; i < loop->ndata; i++) { pthread_join(loop->data_threads[i], NULL); }
+    loop->ndata = 0;
+}
+
+/**
+ * Serves the requests of a filesystem for the current image with the given number of worker
+ * threads (including this one, or 0 for the default), until it is unmounted or told to exit. Reads
+ * are handled by the given number of data threads (-1 for as many as the workers, 0 to have the
+ * workers handle them), shared between users with the given fair share. If pin is true then each
+ * worker is kept on its own CPU. If replicate is true then the index of each image gets a replica
+ * for each NUMA node. Returns -1 if there is a problem.
+ */
+int loop_run(struct fuse* fuse, unsigned nthreads, int ndata, FairShare* fair, bool pin, Images* images, bool replicate)
+{
+    Loop loop;
+    memset(&loop, 0, sizeof(Loop));
+    loop.fair = fair;
+    loop.images = images;
+    pthread_cond_init(&loop.wake, NULL);
+    loop.session = fuse_get_session(fuse);
+    struct fuse_chan* chan = fuse_session_next_chan(loop.session, NULL);
+    if (nthreads == 0) { nthreads = loop_default_threads(); }
+    if (nthreads > LOOP_MAX_THREADS) { nthreads = LOOP_MAX_THREADS; }
+
+    // Pick the CPU of each worker, spread over the nodes, and make the replicas for the nodes
+    for (unsigned i = 0; i < nthreads; i++) { loop.workers[i].cpu = -1; }
+#ifdef __linux__
+    int cpus[LOOP_MAX_CPUS], nodes[LOOP_MAX_CPUS];
+    unsigned ncpus = pin ? loop_numa_cpus(cpus, nodes) : 0;
+    for (unsigned i = 0; i < nthreads && ncpus > 0 && pin; i++) { loop.workers[i].cpu = cpus[(size_t)i * ncpus / nthreads]; }
+    if (replicate) {
+        images->replicate = loop_make_replicas;
+        loop_make_replicas(images->current);
+    }
+#else
+    (void)pin;
+    (void)replicate;
+#endif
+
+    // Give each worker its own channel if possible, otherwise they all share the one from libfuse
+    for (unsigned i = 0; i < nthreads; i++) {
+        LoopWorker* worker = &loop.workers[i];
+        worker->loop = &loop;
+        worker->chan = chan;
+#ifdef __linux__
+        struct fuse_chan* clone = i > 0 ? loop_clone_chan(chan) : NULL;
+        if (clone) { worker->chan = clone; worker->cloned = true; }
+#endif
+    }
+
+    // The other threads don't take signals, so they wake up this thread which checks for exiting
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    unsigned ndata_wanted = ndata < 0 ? nthreads : ndata > LOOP_MAX_THREADS ? LOOP_MAX_THREADS : (unsigned)ndata;
+    while (loop.ndata < ndata_wanted && pthread_create(&loop.data_threads[loop.ndata], NULL, loop_data_worker, &loop) == 0) {
+        loop.ndata++;
+    }
+    loop.nworkers = 1;
+    while (loop.nworkers < nthreads && pthread_create(&loop.workers[loop.nworkers].thread, NULL, loop_worker, &loop.workers[loop.nworkers]) == 0) {
+        loop.nworkers++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    for (unsigned i = loop.nworkers; i < nthreads; i++) {
+        if (loop.workers[i].cloned) { fuse_chan_destroy(loop.workers[i].chan); }
+    }
+    int result = 0;
+    if (loop.nworkers == 1 && nthreads > 1) {
+        // The libfuse loop doesn't count the requests, so the image can't be swapped
+        loop_stop_data(&loop);
+        images->swappable = false;
+        images->replicate = NULL;
+        image_free_replicas(images->current);
+        result = fuse_loop_mt(fuse);
+    } else {
+        loop_worker(&loop.workers[0]);
+        for (unsigned i = 1; i < loop.nworkers; i++) { pthread_cancel(loop.workers[i].thread); }
+        for (unsigned i = 1; i < loop.nworkers; i++) { pthread_join(loop.workers[i].thread, NULL); }
+        loop_stop_data(&loop); // they may still be replying through the channels of the workers
+        for (unsigned i = 1; i < loop.nworkers; i++) {
+            if (loop.workers[i].cloned) { fuse_chan_destroy(loop.workers[i].chan); }
+        }
+        fuse_session_reset(loop.session);
+    }
+    pthread_cond_destroy(&loop.wake);
+    return result;
+}
@@ -27,6 +27,7 @@
 
 // Tons of includes...
 #include "iso.h"
+#include "trace.h"
 #include "util.h"
 #include <errno.h>
 #include <stdio.h>
@@ -54,6 +55,13 @@ ISO* load_iso(const char* filename)
     ISO* iso = (ISO*) malloc(sizeof(ISO));
     if (!iso) { return NULL; }
     iso->pvd = NULL;
+    iso->evd = NULL;
+    iso->sector_size = ISO_SECTOR_SIZE;
+    iso->sector_offset = 0;
+    iso->track_start = 0;
+    iso->fetch = NULL;
+    iso->map = NULL;
+    iso->release = NULL;
 
     // Open the ISO file
     // Setup the fd, size, and data fields in iso
@@ -64,7 +72,7 @@ ISO* load_iso(const char* filename)
     if ((iso->raw = mmap(NULL, iso->size, PROT_READ, MAP_PRIVATE, iso->fd, 0)) == (void *) -1) { close(iso->fd); free(iso); return NULL; }
 
     // Setup fields based on ISO data
-    int offset = 0x8000;
+    size_t offset = 0x8000;
     bool terminated = false;
     while(offset < iso->size) {
         VolumeDescriptor* curr_descr = (VolumeDescriptor*) &iso->raw[offset]; // The current volume descriptor
@@ -94,6 +102,7 @@ ISO* load_iso(const char* filename)
         free(iso);
         return NULL;
     }
+    detect_rock_ridge(iso);
 
     // Return the setup iso variable
     return iso;
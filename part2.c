@@ -27,6 +27,7 @@
 
 // Tons of includes...
 #include "iso.h"
+#include "trace.h"
 #include "util.h"
 #include <errno.h>
 #include <stdio.h>
@@ -54,6 +55,13 @@ ISO* load_iso(const char* filename)
     ISO* iso = (ISO*) malloc(sizeof(ISO));
     if (!iso) { return NULL; }
     iso->pvd = NULL;
+    iso->evd = NULL;
+    iso->sector_size = ISO_SECTOR_SIZE;
+    iso->sector_offset = 0;
+    iso->track_start = 0;
+    iso->fetch = NULL;
+    iso->map = NULL;
+    iso->release = NULL;
 
     // Open the ISO file
     // Setup the fd, size, and data fields in iso
@@ -64,7 +72,7 @@ ISO* load_iso(const char* filename)
     if ((iso->raw = mmap(NULL, iso->size, PROT_READ, MAP_PRIVATE, iso->fd, 0)) == (void *) -1) { close(iso->fd); free(iso); return NULL; }
 
     // Setup fields based on ISO data
-    int offset = 0x8000;
+    size_t offset = 0x8000;
     bool terminated = false;
     while(offset < iso->size) {
         VolumeDescriptor* curr_descr = (VolumeDescriptor*) &iso->raw[offset]; // The current volume descriptor
@@ -94,6 +102,7 @@ ISO* load_iso(const char* filename)
         free(iso);
         return NULL;
     }
+    detect_rock_ridge(iso);
 
     // Return the setup iso variable
     return iso;
@@ -135,8 +144,8 @@ const Record* get_record(const ISO* iso, const char* path)
     // Go through each name in the set of path names
     for (int i = 0; i < path_parts->count; i++) {
         // Check that the end of the extent is within the ISO file raw data
-        uint32_t start_pos = curr_dir->extent_location*iso->pvd->logical_block_size; // Start of directory
-        if (start_pos + curr_dir->extent_length > iso->size) {
+        uint64_t start_pos; // Start of directory
+        if (!iso_block_offset(iso, curr_dir->extent_location, curr_dir->extent_length, &start_pos)) {
             errno = EINVAL;
             free_path_names(path_parts);
             return NULL;
@@ -164,6 +173,7 @@ const Record* get_record(const ISO* iso, const char* path)
         }
 
         // Check if we failed to find a match - file/directory does not exist
+        TRACE(lookup__part, path, path_parts->names[i], strlen(path_parts->names[i]), found_path_part ? curr_record : NULL);
         if (!found_path_part) {
             errno = ENOENT;
             free_path_names(path_parts);
@@ -0,0 +1,269 @@
+/**
+ * Prefetching files in an order given by the client. Some workloads (like training on a shuffled
+ * dataset) read every file in an order that is known ahead of time but jumps all over the disc, so
+ * the readahead of the kernel doesn't help at all. Instead the client writes its read plan to
+ * /.isofs/plan, one file per line as either a path or an inode number (as in the manifest), and a
+ * few worker threads read the data of the planned files in order ahead of the client. Opening the
+ * plan for writing again (such as with `>`) starts a new plan, like for the next epoch. There is
+ * one plan for the whole mount, so only the user that mounted the image can write it, and files
+ * that the writer can't read are left out of it.
+ *
+ * The workers only stay a bounded window ahead of the last planned file that the client opened, so
+ * they don't push data that is still needed out of memory, and the window gets smaller when memory
+ * is short (see pressure.h). For images with a local cache (see cache.h) the data is fetched into
+ * the cache, otherwise the kernel is asked to read it into the page cache.
+ */
+
+#define PREFETCH_THREADS      4                   // workers reading files ahead of the client
+#define PREFETCH_WINDOW       64                  // most planned files prefetched ahead of the client
+#define PREFETCH_WINDOW_BYTES (256*1024*1024)     // most bytes prefetched ahead of the client
+#define PREFETCH_SEARCH       (2*PREFETCH_WINDOW) // how far into the plan an opened file is looked for
+
+typedef struct _Prefetcher {
+    const Index* index;
+    const Node** plan;     // the files of the plan in order
+    uint64_t* starts;      // total size of the files in the plan before each one (and after the last)
+    size_t count, capacity;
+    size_t next;           // the next file of the plan to prefetch
+    size_t opened;         // the files of the plan before this have been opened by the client
+    uint64_t window_bytes; // most bytes prefetched ahead of the client right now
+    const Node** inodes;   // all of the files sorted by inode number, made when first needed
+    size_t ninodes;
+    pthread_mutex_t lock;  // held while using any of the above
+    pthread_cond_t wake;   // signalled when there may be more to prefetch or to stop
+    pthread_t threads[PREFETCH_THREADS];
+    unsigned nthreads;
+    bool stop;             // tells the workers to stop
+} Prefetcher;
+
+/**
+ * Checks if a node is the plan file.
+ */
+static inline bool prefetch_is_plan(const Index* index, const Node* node)
+{
+    return node && index->generated && node->parent == index->generated && strcmp(node->name, PLAN_FILE) == 0;
+}
+
+/**
+ * Checks if the next file of the plan is within the window. The lock must be held.
+ */
+static inline bool prefetch_ready(const Prefetcher* pf)
+{
+    return pf->next < pf->count && (pf->next == pf->opened ||
+           (pf->next - pf->opened < PREFETCH_WINDOW && pf->starts[pf->next] - pf->starts[pf->opened] < pf->window_bytes));
+}
+
+/**
+ * A worker thread: prefetches the files of the plan in order as long as they are in the window.
+ */
+static void* prefetch_worker(void* arg)
+{
+    Prefetcher* pf = (Prefetcher*)arg;
+    pthread_mutex_lock(&pf->lock);
+    while (!pf->stop) {
+        if (!prefetch_ready(pf)) { pthread_cond_wait(&pf->wake, &pf->lock); continue; }
+        const Node* node = pf->plan[pf->next++];
+        pthread_mutex_unlock(&pf->lock);
+        index_prefetch(pf->index, node); // only a hint, problems show up when the file is read
+        pthread_mutex_lock(&pf->lock);
+    }
+    pthread_mutex_unlock(&pf->lock);
+    return NULL;
+}
+
+/**
+ * Stops the workers and frees a prefetcher.
+ */
+void prefetch_stop(Prefetcher* pf)
+{
+    pthread_mutex_lock(&pf->lock);
+    pf->stop = true;
+    pthread_cond_broadcast(&pf->wake);
+    pthread_mutex_unlock(&pf->lock);
+    for (unsigned i = 0; i < pf->nthreads; i++) { pthread_join(pf->threads[i], NULL); }
+    pthread_cond_destroy(&pf->wake);
+    pthread_mutex_destroy(&pf->lock);
+    free(pf->plan);
+    free(pf->starts);
+    free(pf->inodes);
+    free(pf);
+}
+
+/**
+ * Starts the workers of a prefetcher for an index. This must be called after FUSE has moved to the
+ * background since threads do not survive the fork. Returns NULL if there is a problem, with errno
+ * set.
+ */
+Prefetcher* prefetch_start(const Index* index)
+{
+    Prefetcher* pf = (Prefetcher*)calloc(1, sizeof(Prefetcher));
+    if (!pf) { return NULL; }
+    pf->index = index;
+    pf->window_bytes = PREFETCH_WINDOW_BYTES;
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->wake, NULL);
+    int error = 0;
+    while (pf->nthreads < PREFETCH_THREADS && (error = pthread_create(&pf->threads[pf->nthreads], NULL, prefetch_worker, pf)) == 0) {
+        pf->nthreads++;
+    }
+    if (pf->nthreads == 0) { prefetch_stop(pf); errno = error; return NULL; }
+    return pf;
+}
+
+/**
+ * Changes how many bytes are prefetched ahead of the client. This is the resize function of the
+ * prefetcher as a cache (see pressure.h).
+ */
+void prefetch_resize(void* data, size_t limit)
+{
+    Prefetcher* pf = (Prefetcher*)data;
+    pthread_mutex_lock(&pf->lock);
+    pf->window_bytes = limit;
+    pthread_cond_broadcast(&pf->wake);
+    pthread_mutex_unlock(&pf->lock);
+}
+
+/**
+ * Forgets the current plan, the files written to the plan after this make up a new one.
+ */
+void prefetch_new_plan(Prefetcher* pf)
+{
+    pthread_mutex_lock(&pf->lock);
+    __atomic_store_n(&pf->count, 0, __ATOMIC_RELAXED);
+    pf->next = pf->opened = 0;
+    pthread_mutex_unlock(&pf->lock);
+}
+
+/**
+ * Adds all of the regular files at or below a node to the list, skipping the generated files.
+ */
+static bool prefetch_collect(const Index* index, Node* node, NodeList* list)
+{
+    if (S_ISREG(node->mode) && !node_list_add(list, node)) { return false; }
+    for (uint32_t i = 0; i < node->nchildren; i++) {
+        if (node->children[i] != index->generated && !prefetch_collect(index, node->children[i], list)) { return false; }
+    }
+    return true;
+}
+
+static int compare_inodes(const void* a, const void* b)
+{
+    ino_t x = (*(const Node* const*)a)->ino, y = (*(const Node* const*)b)->ino;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Finds a file by its inode number, sorting all of the files by inode number the first time. The
+ * lock must be held. Returns NULL if there is no such file or if out of memory.
+ */
+static const Node* prefetch_find_inode(Prefetcher* pf, ino_t ino)
+{
+    if (!pf->inodes) {
+        NodeList list = { NULL, 0, 0 };
+        if (!prefetch_collect(pf->index, pf->index->root, &list)) { free(list.nodes); return NULL; }
+        qsort(list.nodes, list.count, sizeof(Node*), compare_inodes);
+        pf->inodes = (const Node**)list.nodes;
+        pf->ninodes = list.count;
+    }
+    size_t low = 0, high = pf->ninodes;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (pf->inodes[mid]->ino < ino) { low = mid + 1; } else { high = mid; }
+    }
+    return low < pf->ninodes && pf->inodes[low]->ino == ino ? pf->inodes[low] : NULL;
+}
+
+/**
+ * Who is writing a plan: files that `permits` says they can't read (given `user`) are skipped. This
+ * has to check the directories above the file as well.
+ */
+typedef struct _PlanWriter {
+    bool (*permits)(const Node* node, int mask, const void* user);
+    const void* user;
+} PlanWriter;
+
+/**
+ * Adds the file on one line of a plan to the end of the plan. Lines that aren't the path or inode
+ * number of a regular file in the image that the writer can read are skipped. Returns false if out
+ * of memory.
+ */
+static bool prefetch_add_line(Prefetcher* pf, const PlanWriter* writer, char* line)
+{
+    size_t length = strlen(line);
+    if (length > 0 && line[length-1] == '\r') { line[--length] = 0; }
+    if (length == 0) { return true; }
+    const Node* node = NULL;
+    if (line[0] == '/') { node = index_lookup(pf->index, line); }
+    pthread_mutex_lock(&pf->lock);
+    if (line[0] != '/' && strspn(line, "0123456789") == length) { node = prefetch_find_inode(pf, (ino_t)strtoull(line, NULL, 10)); }
+    if (!node || !S_ISREG(node->mode) || node->generated || !writer->permits(node, R_OK, writer->user)) {
+        pthread_mutex_unlock(&pf->lock);
+        return true;
+    }
+    if (pf->count + 1 >= pf->capacity) {
+        size_t capacity = pf->capacity ? pf->capacity * 2 : 1024;
+        const Node** plan = (const Node**)realloc(pf->plan, capacity * sizeof(Node*));
+        if (plan) { pf->plan = plan; }
+        uint64_t* starts = (uint64_t*)realloc(pf->starts, (capacity + 1) * sizeof(uint64_t));
+        if (starts) { pf->starts = starts; }
+        if (!plan || !starts) { pthread_mutex_unlock(&pf->lock); return false; }
+        pf->capacity = capacity;
+    }
+    if (pf->count == 0) { pf->starts[0] = 0; }
+    pf->plan[pf->count] = node;
+    pf->starts[pf->count+1] = pf->starts[pf->count] + node->size;
+    __atomic_store_n(&pf->count, pf->count + 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&pf->wake);
+    pthread_mutex_unlock(&pf->lock);
+    return true;
+}
+
+/**
+ * Adds the files of the complete lines written to the plan, keeping the last partial line in the
+ * pending buffer for the next write. Returns false if out of memory.
+ */
+bool prefetch_write(Prefetcher* pf, const PlanWriter* writer, TextBuffer* pending, const char* buf, size_t size)
+{
+    if (!text_append(pending, buf, size)) { return false; }
+    char *line = pending->data, *end;
+    while (line && (end = (char*)memchr(line, '\n', pending->length - (line - pending->data)))) {
+        *end = 0;
+        if (!prefetch_add_line(pf, writer, line)) { return false; }
+        line = end + 1;
+    }
+    if (line && line != pending->data) {
+        size_t left = pending->length - (line - pending->data);
+        memmove(pending->data, line, left);
+        text_truncate(pending, left);
+    }
+    return true;
+}
+
+/**
+ * Adds the file of the last line written to the plan if it didn't end with a newline.
+ */
+void prefetch_flush(Prefetcher* pf, const PlanWriter* writer, TextBuffer* pending)
+{
+    if (pending->length) { prefetch_add_line(pf, writer, pending->data); }
+    text_truncate(pending, 0);
+}
+
+/**
+ * Tells the prefetcher that the client opened a file. If it is one of the next files of the plan
+ * then the window moves past it. The node can be from a replica of the index.
+ */
+void prefetch_opened(Prefetcher* pf, const Node* node)
+{
+    node = index_original(node);
+    if (__atomic_load_n(&pf->count, __ATOMIC_RELAXED) == 0) { return; }
+    pthread_mutex_lock(&pf->lock);
+    size_t end = pf->count - pf->opened < PREFETCH_SEARCH ? pf->count : pf->opened + PREFETCH_SEARCH;
+    for (size_t i = pf->opened; i < end; i++) {
+        if (pf->plan[i] != node) { continue; }
+        pf->opened = i + 1;
+        if (pf->next < pf->opened) { pf->next = pf->opened; }
+        pthread_cond_broadcast(&pf->wake);
+        break;
+    }
+    pthread_mutex_unlock(&pf->lock);
+}
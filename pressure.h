@@ -0,0 +1,295 @@
+/**
+ * Shrinking the caches when the host is short on memory. The caches of isofs that hold on to memory
+ * (the windows of the image that stay mapped, see window.h, the data prefetched ahead of the
+ * client, see prefetch.h, and the contents of the generated files, see virtual.h) register how much
+ * they would use at most, and are told how much they can use now whenever that changes:
+ *
+ *   - `-o mem_budget=SIZE` gives a budget for all of them together, and when they would use more
+ *     than that each one gets the same fraction of what it would use
+ *   - a thread watches the memory pressure of the cgroup isofs is in (or of the whole system) from
+ *     the Linux pressure stall information (PSI), and shrinks the caches in proportion to how much
+ *     time tasks are stalled waiting for memory, then grows them back a step at a time once the
+ *     pressure has gone away
+ *
+ * A PSI trigger is used so that the thread wakes up as soon as tasks start stalling, but where
+ * triggers can't be made (such as on older kernels) the pressure is checked every few seconds
+ * instead. Without PSI at all (or on other systems) only the budget is used.
+ *
+ * The budget, the current pressure, and the size of each cache are at the start of /.isofs/stats.
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define PRESSURE_SCALE      1024                // scale of the caches when there is no pressure
+#define PRESSURE_MIN_SCALE  (PRESSURE_SCALE/16) // smallest the caches are shrunk to
+#define PRESSURE_GROW_STEP  (PRESSURE_SCALE/8)  // most the caches grow by at each check
+#define PRESSURE_HEAVY      20.0                // percent of time stalled at which caches are smallest
+#define PRESSURE_CALM       1.0                 // percent of time stalled below which caches grow back
+#define PRESSURE_STALL_US   100000              // microseconds stalled in a window that wake the thread
+#define PRESSURE_WINDOW_US  2000000             // window of the trigger (a multiple of 2s so it works unprivileged)
+#define PRESSURE_CHECK_MS   2000                // how often the pressure is checked while nothing triggers
+
+/**
+ * A cache that is shrunk under pressure.
+ */
+typedef struct _PressureCache {
+    const char* name;
+    size_t full;    // most bytes the cache would use
+    size_t limit;   // bytes the cache is allowed to use now
+    void (*resize)(void* data, size_t limit); // tells the cache its new limit
+    void* data;
+} PressureCache;
+
+typedef struct _MemoryBudget {
+    pthread_mutex_t lock;    // held while using anything in here
+    size_t budget;           // most bytes for all caches together, or 0 for no budget
+    size_t wanted;           // total bytes the caches would use at most
+    unsigned scale;          // how much of their share the caches get, out of PRESSURE_SCALE
+    double pressure;         // percent of the last 10 seconds that some tasks were stalled for memory
+    uint64_t shrinks;        // number of times the caches were shrunk
+    PressureCache* caches;
+    size_t ncaches, capacity;
+
+    // The thread watching the pressure
+    char path[PATH_MAX];     // the pressure file being watched, empty if there isn't one
+    int wake[2];             // pipe written to to stop the thread
+    pthread_t thread;
+    bool running;            // if the thread was started
+} MemoryBudget;
+
+/**
+ * Sets up a memory budget, 0 meaning no budget.
+ */
+void pressure_init(MemoryBudget* mem, size_t budget)
+{
+    memset(mem, 0, sizeof(MemoryBudget));
+    pthread_mutex_init(&mem->lock, NULL);
+    mem->budget = budget;
+    mem->scale = PRESSURE_SCALE;
+}
+
+/**
+ * Works out how much a cache can use now. The lock must be held.
+ */
+static size_t pressure_cache_limit(const MemoryBudget* mem, const PressureCache* cache)
+{
+    double fraction = (double)mem->scale / PRESSURE_SCALE;
+    if (mem->budget && mem->wanted > mem->budget) { fraction *= (double)mem->budget / mem->wanted; }
+    return (size_t)(cache->full * fraction);
+}
+
+/**
+ * Gives every cache its limit again, calling the ones whose limit changed. The lock must be held.
+ */
+static void pressure_apply(MemoryBudget* mem)
+{
+    for (size_t i = 0; i < mem->ncaches; i++) {
+        PressureCache* cache = &mem->caches[i];
+        size_t limit = pressure_cache_limit(mem, cache);
+        if (limit == cache->limit) { continue; }
+        cache->limit = limit;
+        cache->resize(cache->data, limit);
+    }
+}
+
+/**
+ * Adds a cache that uses at most `full` bytes, which is told its limit right away (and whenever it
+ * changes after that) by calling `resize`. Returns false if out of memory.
+ */
+bool pressure_register(MemoryBudget* mem, const char* name, size_t full, void (*resize)(void* data, size_t limit), void* data)
+{
+    pthread_mutex_lock(&mem->lock);
+    if (mem->ncaches == mem->capacity) {
+        size_t capacity = mem->capacity ? mem->capacity * 2 : 8;
+        PressureCache* caches = (PressureCache*)realloc(mem->caches, capacity * sizeof(PressureCache));
+        if (!caches) { pthread_mutex_unlock(&mem->lock); return false; }
+        mem->caches = caches;
+        mem->capacity = capacity;
+    }
+    PressureCache cache = { name, full, 0, resize, data };
+    mem->wanted += full;
+    pressure_apply(mem); // the budget is shared with one more cache now
+    cache.limit = pressure_cache_limit(mem, &cache);
+    mem->caches[mem->ncaches++] = cache;
+    resize(data, cache.limit);
+    pthread_mutex_unlock(&mem->lock);
+    return true;
+}
+
+/**
+ * Removes a cache, after which it is never called again.
+ */
+void pressure_unregister(MemoryBudget* mem, void* data)
+{
+    pthread_mutex_lock(&mem->lock);
+    for (size_t i = 0; i < mem->ncaches; i++) {
+        if (mem->caches[i].data != data) { continue; }
+        mem->wanted -= mem->caches[i].full;
+        memmove(mem->caches + i, mem->caches + i + 1, (mem->ncaches - i - 1) * sizeof(PressureCache));
+        mem->ncaches--;
+        pressure_apply(mem);
+        break;
+    }
+    pthread_mutex_unlock(&mem->lock);
+}
+
+/**
+ * Finds the pressure file of the cgroup (v2) that this process is in, or of the whole system if
+ * that doesn't have one. Returns false if there isn't one.
+ */
+static bool pressure_find_file(char* path, size_t size)
+{
+    char line[PATH_MAX];
+    FILE* file = fopen("/proc/self/cgroup", "r");
+    bool found = false;
+    while (file && !found && fgets(line, sizeof(line), file)) {
+        // The v2 hierarchy is the line "0::/PATH"
+        if (strncmp(line, "0::/", 4) != 0) { continue; }
+        line[strcspn(line, "\n")] = 0;
+        found = snprintf(path, size, "/sys/fs/cgroup%s/memory.pressure", line + 3) < (int)size && access(path, R_OK) == 0;
+    }
+    if (file) { fclose(file); }
+    if (!found) {
+        snprintf(path, size, "/proc/pressure/memory");
+        found = access(path, R_OK) == 0;
+    }
+    return found;
+}
+
+/**
+ * Reads the percent of the last 10 seconds that some tasks were stalled for memory from a pressure
+ * file. Returns a negative number if it can't be read.
+ */
+static double pressure_read(const char* path)
+{
+    char buf[256];
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) { return -1; }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) { return -1; }
+    buf[n] = 0;
+    double avg10;
+    return sscanf(buf, "some avg10=%lf", &avg10) == 1 ? avg10 : -1;
+}
+
+/**
+ * Changes the scale of the caches to fit the current pressure: shrinking right away (at least by
+ * half if the trigger went off) or growing back a step at a time.
+ */
+static void pressure_update(MemoryBudget* mem, double pressure, bool triggered)
+{
+    pthread_mutex_lock(&mem->lock);
+    if (pressure >= 0) { mem->pressure = pressure; }
+    double stalled = pressure < 0 ? 0 : pressure > PRESSURE_HEAVY ? PRESSURE_HEAVY : pressure;
+    unsigned target = PRESSURE_SCALE - (unsigned)((PRESSURE_SCALE - PRESSURE_MIN_SCALE) * stalled / PRESSURE_HEAVY);
+    if (triggered && target > mem->scale / 2) { target = mem->scale / 2; }
+    if (target < PRESSURE_MIN_SCALE) { target = PRESSURE_MIN_SCALE; }
+    if (target < mem->scale) {
+        mem->scale = target;
+        mem->shrinks++;
+    } else if (pressure >= 0 && pressure < PRESSURE_CALM && mem->scale < PRESSURE_SCALE) {
+        mem->scale = mem->scale + PRESSURE_GROW_STEP < PRESSURE_SCALE ? mem->scale + PRESSURE_GROW_STEP : PRESSURE_SCALE;
+    }
+    pressure_apply(mem);
+    pthread_mutex_unlock(&mem->lock);
+}
+
+/**
+ * The thread watching the pressure: waits for the trigger (or the next check) and updates the
+ * scale of the caches, until something is written to the wake pipe.
+ */
+static void* pressure_worker(void* arg)
+{
+    MemoryBudget* mem = (MemoryBudget*)arg;
+
+    // Set up the trigger, if that can't be done the pressure is just checked every so often
+    char trigger[64];
+    int length = snprintf(trigger, sizeof(trigger), "some %d %d", PRESSURE_STALL_US, PRESSURE_WINDOW_US);
+    int fd = open(mem->path, O_RDWR | O_NONBLOCK);
+    if (fd != -1 && write(fd, trigger, length + 1) == -1) { close(fd); fd = -1; }
+
+    struct pollfd fds[2] = { { mem->wake[0], POLLIN, 0 }, { fd, POLLPRI, 0 } };
+    for (;;) {
+        int n = poll(fds, fd == -1 ? 1 : 2, PRESSURE_CHECK_MS);
+        if (n == -1 && errno != EINTR) { break; }
+        if (fds[0].revents) { break; }
+        bool triggered = n > 0 && (fds[1].revents & POLLPRI);
+        if (n > 0 && (fds[1].revents & (POLLERR | POLLNVAL))) {
+            // The cgroup went away, keep checking the file in case it shows up again
+            close(fd);
+            fds[1].fd = fd = -1;
+        }
+        pressure_update(mem, pressure_read(mem->path), triggered);
+    }
+    if (fd != -1) { close(fd); }
+    return NULL;
+}
+
+/**
+ * Starts the thread that watches the pressure, if there is pressure information. This must be
+ * called after FUSE has moved to the background since threads do not survive the fork. Returns
+ * false if there is a problem, with errno set.
+ */
+bool pressure_start(MemoryBudget* mem)
+{
+    if (!pressure_find_file(mem->path, sizeof(mem->path))) { mem->path[0] = 0; return true; }
+    if (pipe(mem->wake) == -1) { return false; }
+    int error = pthread_create(&mem->thread, NULL, pressure_worker, mem);
+    if (error) { close(mem->wake[0]); close(mem->wake[1]); errno = error; return false; }
+    mem->running = true;
+    return true;
+}
+
+/**
+ * Stops the thread that watches the pressure, if it was started.
+ */
+void pressure_stop(MemoryBudget* mem)
+{
+    if (!mem->running) { return; }
+    char c = 0;
+    while (write(mem->wake[1], &c, 1) == -1 && errno == EINTR) { }
+    pthread_join(mem->thread, NULL);
+    close(mem->wake[0]);
+    close(mem->wake[1]);
+    mem->running = false;
+}
+
+/**
+ * Frees a memory budget, after the thread has been stopped.
+ */
+void pressure_free(MemoryBudget* mem)
+{
+    free(mem->caches);
+    pthread_mutex_destroy(&mem->lock);
+}
+
+/**
+ * Writes the budget, the pressure, and the size of each cache as the lines starting with # at the
+ * start of /.isofs/stats. Returns false if out of memory.
+ */
+bool pressure_report(MemoryBudget* mem, TextBuffer* text)
+{
+    pthread_mutex_lock(&mem->lock);
+    bool ok = (mem->budget ? text_printf(text, "# memory budget: %zu bytes\n", mem->budget) : text_printf(text, "# memory budget: none\n")) &&
+              (mem->path[0] ? text_printf(text, "# memory pressure: %.2f%% (%s)\n", mem->pressure, mem->path) :
+                              text_printf(text, "# memory pressure: unknown\n")) &&
+              text_printf(text, "# cache scale: %u/%u (shrunk %" PRIu64 " times)\n", mem->scale, PRESSURE_SCALE, mem->shrinks);
+    for (size_t i = 0; i < mem->ncaches && ok; i++) {
+        ok = text_printf(text, "# cache %s: %zu of %zu bytes\n", mem->caches[i].name, mem->caches[i].limit, mem->caches[i].full);
+    }
+    pthread_mutex_unlock(&mem->lock);
+    return ok;
+}
+
+/**
+ * Checks if a node is the stats file.
+ */
+static inline bool pressure_is_stats_file(const Index* index, const Node* node)
+{
+    return node && index->generated && node->parent == index->generated && strcmp(node->name, STATS_FILE) == 0;
+}
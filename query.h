@@ -0,0 +1,323 @@
+/**
+ * Queries that find files in the index without walking the tree through the kernel. Opening
+ * /.isofs/query/QUERY gives the paths of all matching files and directories, one per line. The
+ * query is made up of conditions separated by &, all of which must match, and each condition can
+ * be URL-encoded (so %2F is a / and %26 is a &):
+ *
+ *   name=GLOB   the name of the file matches the shell pattern (like `find -name`)
+ *   path=GLOB   the whole path of the file matches the shell pattern (like `find -path`)
+ *   regex=RE    the whole path of the file matches the extended regular expression
+ *   type=T      the type of the file is T, one of the letters used by `find -type`
+ *   size=[+-]N  the size of the file is more than (+), less than (-), or exactly N bytes, where N
+ *               can have a K, M, or G suffix
+ *   contains=S  the name of the file has S in it
+ *   dir=PATH    only look in the directory PATH instead of the whole image
+ *   first=N     skip the first N matching files (in the order of the index)
+ *   count=N     only give up to N matching files
+ *
+ * A condition without an = is a name pattern, so `cat /mnt/.isofs/query/'*.rpm'` lists all RPMs.
+ * The subtrees of the directory are searched on several threads for large indexes. If there is a
+ * trigram index (see trigram.h) then queries with a contains condition of at least 3 characters
+ * only look at the files that it gives instead. Queries only give the files that the user could
+ * have found by listing directories: the directory a file is in has to be readable and all of the
+ * directories above it searchable.
+ */
+
+#include <ctype.h>
+#include <fnmatch.h>
+#include <regex.h>
+
+typedef struct _Query {
+    const char* name;     // pattern for the names of files, or NULL
+    const char* path;     // pattern for the paths of files, or NULL
+    const char* contains; // string that the names of files have in them, or NULL
+    regex_t regex;        // regular expression for the paths of files
+    bool has_regex;       // if regex is used
+    char type;            // type of the files (as in find -type), or 0
+    int size_cmp;         // how to compare the sizes of files: 1 for more, -1 for less, 0 for exactly
+    size_t size;          // size to compare to, or SIZE_MAX to not compare sizes
+    const Node* dir;      // directory to look in
+    char* dir_path;       // path of that directory ("" for the root)
+    size_t first;         // number of matching files to skip
+    size_t count;         // most matching files to give, or SIZE_MAX
+    char* strings;        // the decoded query that the patterns point into
+    // Checks if the user running the query has the access in mask (R_OK, W_OK, X_OK) to a node,
+    // only going by the node itself and not the directories above it. NULL allows everything.
+    bool (*permits)(const Node* node, int mask, const void* user);
+    const void* user;     // passed to permits
+} Query;
+
+/**
+ * Decodes %XX sequences in a string in place.
+ */
+static void query_decode(char* str)
+{
+    char* out = str;
+    for (; *str; str++) {
+        unsigned value;
+        if (str[0] == '%' && isxdigit((unsigned char)str[1]) && isxdigit((unsigned char)str[2]) && sscanf(str + 1, "%2x", &value) == 1) {
+            *out++ = (char)value;
+            str += 2;
+        } else {
+            *out++ = *str;
+        }
+    }
+    *out = 0;
+}
+
+/**
+ * Frees the memory used by a query.
+ */
+void query_free(Query* query)
+{
+    if (query->has_regex) { regfree(&query->regex); }
+    free(query->dir_path);
+    free(query->strings);
+}
+
+/**
+ * Parses a query, which is the name of a file in the query directory. Returns false if it isn't a
+ * valid query (with errno set to EINVAL, or ENOENT if the directory to look in doesn't exist).
+ */
+bool query_parse(const Index* index, const char* str, Query* query)
+{
+    memset(query, 0, sizeof(Query));
+    query->size = SIZE_MAX;
+    query->count = SIZE_MAX;
+    query->dir = index->root;
+    if (!(query->strings = strdup(str))) { return false; }
+    char* next = query->strings;
+    bool valid = true;
+    while (next && valid) {
+        const char* condition = next;
+        if ((next = strchr(next, '&'))) { *next++ = 0; }
+        char* value = strchr(condition, '=');
+        if (value) { *value++ = 0; } else { value = (char*)condition; condition = "name"; }
+        query_decode(value);
+
+        if (strcmp(condition, "name") == 0) { query->name = value; }
+        else if (strcmp(condition, "path") == 0) { query->path = value; }
+        else if (strcmp(condition, "contains") == 0) { query->contains = value; }
+        else if (strcmp(condition, "regex") == 0 && !query->has_regex) {
+            query->has_regex = regcomp(&query->regex, value, REG_EXTENDED | REG_NOSUB) == 0;
+            valid = query->has_regex;
+        }
+        else if (strcmp(condition, "type") == 0 && strlen(value) == 1 && strchr("dlcbpsf", value[0])) { query->type = value[0]; }
+        else if (strcmp(condition, "size") == 0) {
+            query->size_cmp = value[0] == '+' ? 1 : value[0] == '-' ? -1 : 0;
+            valid = parse_size(value + (query->size_cmp != 0), &query->size);
+        }
+        else if (strcmp(condition, "first") == 0 || strcmp(condition, "count") == 0) {
+            char* end;
+            unsigned long long n = strtoull(value, &end, 10);
+            valid = end != value && !*end && value[0] != '-';
+            *(condition[0] == 'f' ? &query->first : &query->count) = n;
+        }
+        else if (strcmp(condition, "dir") == 0 && !query->dir_path) {
+            if (!(query->dir = index_lookup(index, value))) { query_free(query); return false; }
+            if (!S_ISDIR(query->dir->mode)) { query_free(query); errno = ENOTDIR; return false; }
+            size_t length = strlen(value);
+            while (length > 0 && value[length-1] == '/') { length--; }
+            if (!(query->dir_path = strndup(value, length))) { query_free(query); return false; }
+        }
+        else { valid = false; }
+    }
+    if (!valid) { query_free(query); errno = EINVAL; return false; }
+    if (!query->dir_path && !(query->dir_path = strdup(""))) { query_free(query); return false; }
+    return true;
+}
+
+/**
+ * Checks if a file matches a query.
+ */
+static bool query_matches(const Query* query, const Node* node, const char* path)
+{
+    if (query->type && virtual_type(node->mode) != query->type) { return false; }
+    if (query->size != SIZE_MAX) {
+        if (query->size_cmp > 0 ? node->size <= query->size :
+            query->size_cmp < 0 ? node->size >= query->size : node->size != query->size) { return false; }
+    }
+    if (query->contains && !strstr(node->name, query->contains)) { return false; }
+    if (query->name && fnmatch(query->name, node->name, 0) != 0) { return false; }
+    if (query->path && fnmatch(query->path, path, 0) != 0) { return false; }
+    if (query->has_regex && regexec(&query->regex, path, 0, NULL, 0) != 0) { return false; }
+    return true;
+}
+
+/**
+ * Checks if the user running a query has the given access to a node (not checking the directories
+ * above it).
+ */
+static inline bool query_permits(const Query* query, const Node* node, int mask)
+{
+    return !query->permits || query->permits(node, mask, query->user);
+}
+
+/**
+ * Adds the paths of all files at or below a node that match a query. The path of the node is what
+ * is in the path buffer, which is used for the paths of the children as well. The directories above
+ * the node must already be searchable. Returns false if out of memory.
+ */
+static bool query_walk(const Index* index, const Query* query, const Node* node, TextBuffer* path, TextBuffer* results)
+{
+    if (query_permits(query, node->parent, R_OK) && query_matches(query, node, path->data) &&
+        !text_printf(results, "%s\n", path->data)) { return false; }
+    if (!query_permits(query, node, X_OK)) { return true; } // nothing below it can be found
+    size_t length = path->length;
+    for (uint32_t i = 0; i < node->nchildren; i++) {
+        const Node* child = node->children[i];
+        if (child == index->generated) { continue; }
+        if (!text_printf(path, "/%s", child->name) || !query_walk(index, query, child, path, results)) { return false; }
+        text_truncate(path, length);
+    }
+    return true;
+}
+
+/**
+ * The children of the directory being searched that threads take turns searching. Each child has
+ * its own results so they stay in order.
+ */
+typedef struct _QueryWork {
+    const Index* index;
+    const Query* query;
+    TextBuffer* results; // the results for each child
+    uint32_t next;       // the next child to do
+    bool failed;         // if any thread ran out of memory
+} QueryWork;
+
+static void* query_worker(void* arg)
+{
+    QueryWork* work = (QueryWork*)arg;
+    const Node* dir = work->query->dir;
+    TextBuffer path = { NULL, 0, 0 };
+    uint32_t i;
+    while ((i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) < dir->nchildren) {
+        const Node* child = dir->children[i];
+        if (child == work->index->generated) { continue; }
+        text_truncate(&path, 0);
+        if (!text_printf(&path, "%s/%s", work->query->dir_path, child->name) ||
+            !query_walk(work->index, work->query, child, &path, &work->results[i])) {
+            __atomic_store_n(&work->failed, true, __ATOMIC_RELAXED);
+        }
+    }
+    free(path.data);
+    return NULL;
+}
+
+/**
+ * Writes the path of a node into the path buffer (which is empty for the root).
+ */
+static bool query_node_path(const Node* node, TextBuffer* path)
+{
+    if (node->parent == node) { return true; }
+    return query_node_path(node->parent, path) && text_printf(path, "/%s", node->name);
+}
+
+/**
+ * Checks if a node is the given directory or below it and could be found by listing directories
+ * from there (see query_walk()).
+ */
+static bool query_in_dir(const Query* query, const Node* node, const Node* dir)
+{
+    if (node != dir && !query_permits(query, node->parent, R_OK)) { return false; }
+    while (node != dir && node->parent != node) {
+        node = node->parent;
+        if (!query_permits(query, node, X_OK)) { return false; }
+    }
+    return node == dir;
+}
+
+/**
+ * Runs a query with a contains condition by only checking the files that the trigram index says
+ * might contain it. Returns false if out of memory.
+ */
+static bool query_run_trigrams(const Index* index, const Query* query, TextBuffer* results)
+{
+    uint32_t count;
+    uint32_t* candidates = trigram_candidates(index->trigrams, query->contains, &count);
+    if (!candidates) { return false; }
+    TextBuffer path = { NULL, 0, 0 };
+    bool ok = true;
+    for (uint32_t i = 0; i < count && ok; i++) {
+        const Node* node = index->trigrams->nodes[candidates[i]];
+        if (!query_in_dir(query, node, query->dir)) { continue; }
+        text_truncate(&path, 0);
+        if (!(ok = query_node_path(node, &path))) { break; }
+        const char* p = path.length ? path.data : "/";
+        if (query_matches(query, node, p)) { ok = text_printf(results, "%s\n", p); }
+    }
+    free(path.data);
+    free(candidates);
+    return ok;
+}
+
+/**
+ * Runs a query without the first and count conditions. Returns false if out of memory.
+ */
+static bool query_run_all(const Index* index, const Query* query, TextBuffer* results)
+{
+    if (index->trigrams && query->contains && strlen(query->contains) >= 3) { return query_run_trigrams(index, query, results); }
+    const Node* dir = query->dir;
+    if (query_matches(query, dir, query->dir_path[0] ? query->dir_path : "/") &&
+        !text_printf(results, "%s\n", query->dir_path[0] ? query->dir_path : "/")) { return false; }
+    if (dir->nchildren == 0 || !query_permits(query, dir, X_OK)) { return true; }
+    QueryWork work = { index, query, (TextBuffer*)calloc(dir->nchildren, sizeof(TextBuffer)), 0, false };
+    if (!work.results) { return false; }
+    index_parallel(index, dir->nchildren, query_worker, &work);
+    bool ok = !work.failed;
+    for (uint32_t i = 0; i < dir->nchildren; i++) {
+        if (ok) { ok = text_append(results, work.results[i].data, work.results[i].length); }
+        free(work.results[i].data);
+    }
+    free(work.results);
+    return ok;
+}
+
+/**
+ * Removes the results before the first one and after the count that the query asked for.
+ */
+static void query_limit(const Query* query, TextBuffer* results)
+{
+    if (query->first == 0 && query->count == SIZE_MAX) { return; }
+    size_t start = 0, end, line = 0;
+    for (end = 0; end < results->length && (line < query->first || line - query->first < query->count); end++) {
+        if (results->data[end] == '\n' && ++line == query->first) { start = end + 1; }
+    }
+    if (line < query->first) { start = end; }
+    memmove(results->data, results->data + start, end - start);
+    text_truncate(results, end - start);
+}
+
+/**
+ * Runs a query, writing the paths of the matching files into the results. Returns false if out of
+ * memory.
+ */
+bool query_run(const Index* index, const Query* query, TextBuffer* results)
+{
+    bool ok = query_run_all(index, query, results);
+    if (ok) { query_limit(query, results); }
+    return ok;
+}
+
+/**
+ * Checks if a path is a query in one of the directories of generated files that take queries as
+ * file names (QUERY_DIR or BUNDLE_DIR). If it is the node of that directory is returned and the
+ * query is the rest of the path, otherwise NULL is returned with errno set to ENOENT.
+ */
+const Node* query_lookup(const Index* index, const char* path, const char* dir_name, const char** query)
+{
+    size_t length = strlen(dir_name);
+    const Node* dir;
+    if (!index->generated || path[0] != '/' || strncmp(path + 1, VIRTUAL_DIR "/", sizeof(VIRTUAL_DIR)) != 0 ||
+        strncmp(path + 1 + sizeof(VIRTUAL_DIR), dir_name, length) != 0) {
+        errno = ENOENT;
+        return NULL;
+    }
+    path += 1 + sizeof(VIRTUAL_DIR) + length;
+    if (path[0] != '/' || !path[1] || strchr(path + 1, '/') || !(dir = index_find_child(index->generated, dir_name, length))) {
+        errno = ENOENT;
+        return NULL;
+    }
+    *query = path + 1;
+    return dir;
+}
@@ -0,0 +1,120 @@
+/**
+ * Readers for the different ways a CD image can be laid out in a file. Plain ISO images only have
+ * the 2048 bytes of user data for each sector. Raw CD images (like the BIN of a BIN/CUE pair) also
+ * keep the sync pattern, header, and error correction data of each sector, so the user data is at
+ * an offset within larger sectors. Adding a format only requires adding it to image_formats.
+ *
+ * Only the layout of the sectors is described here, the ISO memory itself is still mapped directly
+ * and iso_offset() uses the layout to find the user data of a sector without copying it.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+typedef struct _ImageFormat {
+    const char* name;     // name of the format, the same as the CUE sheet track mode if there is one
+    size_t sector_size;   // bytes per sector in the file
+    size_t sector_offset; // bytes in each sector before the user data
+} ImageFormat;
+
+// The supported formats, in the order they are checked for
+static const ImageFormat image_formats[] = {
+    { "MODE1/2048", 2048, 0 },  // plain ISO image
+    { "MODE1/2352", 2352, 16 }, // 12 byte sync pattern and 4 byte header, 288 bytes of EDC/ECC at the end
+    { "MODE2/2352", 2352, 24 }, // sync pattern, header, and 8 byte XA subheader (form 1 sectors)
+    { "MODE2/2336", 2336, 8 },  // only the XA subheader (form 1 sectors)
+};
+#define NUM_IMAGE_FORMATS (sizeof(image_formats) / sizeof(image_formats[0]))
+
+/**
+ * Sets the sector layout of the ISO to the given format.
+ */
+static inline void set_image_format(ISO* iso, const ImageFormat* format)
+{
+    iso->sector_size = format->sector_size;
+    iso->sector_offset = format->sector_offset;
+}
+
+/**
+ * Checks if the ISO could have the given format by looking for the CD001 identifier of the first
+ * volume descriptor where that format would put it.
+ */
+static bool probe_image_format(ISO* iso, const ImageFormat* format)
+{
+    set_image_format(iso, format);
+    size_t offset = iso_offset(iso, ISO_DESCRIPTORS_START);
+    if (!iso_fetch_raw(iso, offset, sizeof(VolumeDescriptor))) { return false; }
+    const VolumeDescriptor* descr = (const VolumeDescriptor*)iso_ptr(iso, ISO_DESCRIPTORS_START);
+    return memcmp(descr->id, CD001, 5) == 0;
+}
+
+/**
+ * Detects the format of the ISO and sets up its sector layout. If a format name is given (such as
+ * from a CUE sheet) then only that format is checked. Returns the format or NULL if the ISO does
+ * not look like any supported format.
+ */
+const ImageFormat* detect_image_format(ISO* iso, const char* name)
+{
+    for (size_t i = 0; i < NUM_IMAGE_FORMATS; i++) {
+        const ImageFormat* format = &image_formats[i];
+        if (name && strcasecmp(name, format->name) != 0) { continue; }
+        if (probe_image_format(iso, format)) { return format; }
+    }
+    set_image_format(iso, &image_formats[0]);
+    return NULL;
+}
+
+/**
+ * Reads a CUE sheet, getting the path of the file with the first data track, the mode of that
+ * track, and the sector of the file where the track starts (its INDEX 01, since a file can have
+ * other tracks before it, like audio tracks). The path is relative to the directory of the CUE
+ * sheet. Returns false if the CUE sheet cannot be read or does not have a data track, with errno
+ * set.
+ */
+bool read_cue_sheet(const char* filename, char path[PATH_MAX], char mode[16], uint32_t* start)
+{
+    FILE* cue = fopen(filename, "r");
+    if (!cue) { return false; }
+    char file[PATH_MAX] = "";  // the file of the tracks being read
+    bool in_track = false;     // if the lines being read are for the data track
+    path[0] = mode[0] = 0;
+    *start = 0;
+    char line[PATH_MAX + 32];
+    while (fgets(line, sizeof(line), cue)) {
+        char* word = line;
+        while (isspace((unsigned char)*word)) { word++; }
+        if (strncasecmp(word, "FILE ", 5) == 0) {
+            // FILE "name.bin" BINARY (the quotes are optional if there are no spaces)
+            if (in_track) { break; } // the data track didn't have an INDEX 01, so it starts the file
+            char* name = word + 5;
+            while (isspace((unsigned char)*name)) { name++; }
+            char* end = *name == '"' ? strchr(++name, '"') : strpbrk(name, " \t\r\n");
+            if (!end) { file[0] = 0; continue; }
+            *end = 0;
+            const char* slash = strrchr(filename, '/');
+            int dir_length = (name[0] == '/' || !slash) ? 0 : (int)(slash - filename + 1);
+            snprintf(file, PATH_MAX, "%.*s%s", dir_length, filename, name);
+        } else if (strncasecmp(word, "TRACK ", 6) == 0) {
+            // TRACK 01 MODE1/2352, the first one that isn't audio is the data track
+            char type[16];
+            if (in_track) { break; }
+            if (file[0] && sscanf(word + 6, "%*s %15s", type) == 1 && strcasecmp(type, "AUDIO") != 0) {
+                strcpy(mode, type);
+                strcpy(path, file);
+                in_track = true;
+            }
+        } else if (in_track && strncasecmp(word, "INDEX ", 6) == 0) {
+            // INDEX 01 MM:SS:FF is where the track starts in the file, with 75 frames (sectors) a second
+            unsigned number, minutes, seconds, frames;
+            if (sscanf(word + 6, "%u %u:%u:%u", &number, &minutes, &seconds, &frames) == 4 && number == 1) {
+                *start = (minutes * 60 + seconds) * 75 + frames;
+                break;
+            }
+        }
+    }
+    fclose(cue);
+    if (!path[0] || !mode[0]) { errno = EINVAL; return false; }
+    return true;
+}
@@ -0,0 +1,79 @@
+/**
+ * Replicas of the index, so that threads on different NUMA nodes don't all read the memory of one
+ * node. With `-o numa_replicas` a copy of the whole index (the nodes, names, extents, and trigram
+ * index) is made for each NUMA node by a thread running on that node, so that its memory is local
+ * to that node, and each thread serving requests uses the replica of the node it is running on
+ * (see loop.h). Since the index never changes the replicas never need to be updated.
+ *
+ * Each node of a replica points to the node of the original index it is a copy of. The hole maps
+ * are only kept with the original nodes and the generated files are shared, so all replicas see
+ * the same thing no matter which thread handles a request.
+ */
+
+// The replica used by this thread, or NULL to use the original index
+static __thread const Index* replica_local;
+
+/**
+ * Copies some data into the memory of an index. Returns NULL if out of memory.
+ */
+static void* replica_dup(Index* replica, const void* data, size_t size)
+{
+    void* copy = index_alloc(replica, size ? size : 1);
+    if (copy) { memcpy(copy, data, size); }
+    return copy;
+}
+
+/**
+ * Copies a node and everything below it into a replica. Returns NULL if out of memory.
+ */
+static Node* replica_copy_node(Index* replica, const Index* index, Node* node, Node* parent)
+{
+    Node* copy = (Node*)replica_dup(replica, node, sizeof(Node));
+    if (!copy) { return NULL; }
+    copy->parent = parent ? parent : copy;
+    copy->original = node;
+    copy->holes = NULL;
+    if (node == index->generated) { replica->generated = copy; }
+    if (!(copy->name = index_strdup(replica, node->name)) ||
+        (node->nextents && !(copy->extents = (Extent*)replica_dup(replica, node->extents, node->nextents * sizeof(Extent)))) ||
+        (node->nchildren && !(copy->children = (Node**)index_alloc(replica, node->nchildren * sizeof(Node*))))) { return NULL; }
+    for (uint32_t i = 0; i < node->nchildren; i++) {
+        if (!(copy->children[i] = replica_copy_node(replica, index, node->children[i], copy))) { return NULL; }
+    }
+    return copy;
+}
+
+/**
+ * Copies the trigram index of an index into a replica, after the nodes have been copied. The nodes
+ * are collected again from the replica, which gives them in the same order as in the original.
+ */
+static bool replica_copy_trigrams(Index* replica, const TrigramIndex* tri)
+{
+    NodeList list = { NULL, 0, 0 };
+    TrigramIndex* copy = (TrigramIndex*)replica_dup(replica, tri, sizeof(TrigramIndex));
+    if (!copy || !trigram_collect(replica, replica->root, &list)) { free(list.nodes); return false; }
+    copy->nodes = (const Node**)replica_dup(replica, list.nodes, list.count * sizeof(Node*));
+    free(list.nodes);
+    if (!copy->nodes ||
+        !(copy->trigrams = (uint32_t*)replica_dup(replica, tri->trigrams, tri->ntrigrams * sizeof(uint32_t))) ||
+        !(copy->starts = (uint32_t*)replica_dup(replica, tri->starts, (tri->ntrigrams + 1) * sizeof(uint32_t))) ||
+        !(copy->postings = (uint32_t*)replica_dup(replica, tri->postings, tri->starts[tri->ntrigrams] * sizeof(uint32_t)))) { return false; }
+    replica->trigrams = copy;
+    return true;
+}
+
+/**
+ * Makes a replica of an index, with all of its memory allocated (and first touched) by the calling
+ * thread. Returns NULL if out of memory.
+ */
+Index* index_replicate(const Index* index)
+{
+    Index* replica = new_index(index->iso, index->format);
+    if (!replica) { return NULL; }
+    replica->volumes = index->volumes;
+    replica->nvolumes = index->nvolumes;
+    replica->nnodes = index->nnodes;
+    if (!(replica->root = replica_copy_node(replica, index, index->root, NULL)) ||
+        (index->trigrams && !replica_copy_trigrams(replica, index->trigrams))) { free_index(replica); return NULL; }
+    return replica;
+}
@@ -0,0 +1,281 @@
+/**
+ * Tar archives of any directory in the image, made on the fly. The /.isofs/tar directory mirrors
+ * the directories of the image and next to each directory DIR is a DIR.tar file with everything
+ * below it (and /.isofs/tar/.tar has the whole image). The mirrored directories and archives are
+ * only found by looking them up, the directories list as empty so that tools walking the mount
+ * don't copy the whole image once for each level of directories. The headers are made from the index and the
+ * data of the files is read directly from the image as the archive is read, so copying a directory
+ * to another host is a single file read instead of opening and reading every file.
+ *
+ * The archives are in the GNU tar format so that long names work. Only files and directories are
+ * included, other types of files (like symbolic links) are skipped.
+ */
+
+#define TAR_BLOCK_SIZE 512   // size of each tar block, headers and data are padded to this
+#define TAR_NAME_SIZE  100   // names longer than this need an extra long name header
+#define TAR_SUFFIX     ".tar"
+
+/**
+ * Where each file starts in an archive.
+ */
+typedef struct _TarEntry {
+    uint64_t offset;    // where the headers of the file start in the archive
+    const Node* node;   // the file
+} TarEntry;
+
+typedef struct _TarFile {
+    const Index* index;
+    const Node* dir;    // the directory in the archive
+    TarEntry* entries;  // the files in the archive in order
+    size_t nentries, capacity;
+    uint64_t size;      // total size of the archive
+} TarFile;
+
+static inline uint64_t tar_round(uint64_t size) { return (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE; }
+
+/**
+ * Gets the size of the headers of a file in an archive, given the length of its name.
+ */
+static inline uint64_t tar_header_size(size_t name_length)
+{
+    return TAR_BLOCK_SIZE + (name_length > TAR_NAME_SIZE ? TAR_BLOCK_SIZE + tar_round(name_length + 1) : 0);
+}
+
+/**
+ * Writes the name of a file in the archive of a directory, which starts with the name of the
+ * directory (unless it is the root) and ends with a / for directories.
+ */
+static bool tar_name(const TarFile* tar, const Node* node, TextBuffer* name)
+{
+    if (node != tar->dir && !tar_name(tar, node->parent, name)) { return false; }
+    if (node == tar->dir && node->parent == node) { return true; } // the root isn't in the names
+    return text_printf(name, S_ISDIR(node->mode) ? "%s/" : "%s", node->name);
+}
+
+/**
+ * Adds a file or directory and everything below it to an archive. The name buffer has the name of
+ * the node in the archive, and is used for the names of the children as well.
+ */
+static bool tar_add(TarFile* tar, const Node* node, TextBuffer* name)
+{
+    if (!S_ISDIR(node->mode) && !S_ISREG(node->mode)) { return true; }
+    if (name->length) {
+        if (tar->nentries == tar->capacity) {
+            size_t capacity = tar->capacity ? tar->capacity * 2 : 64;
+            TarEntry* entries = (TarEntry*)realloc(tar->entries, capacity * sizeof(TarEntry));
+            if (!entries) { return false; }
+            tar->entries = entries;
+            tar->capacity = capacity;
+        }
+        tar->entries[tar->nentries].offset = tar->size;
+        tar->entries[tar->nentries++].node = node;
+        tar->size += tar_header_size(name->length) + (S_ISREG(node->mode) ? tar_round(node->size) : 0);
+    }
+    size_t length = name->length;
+    for (uint32_t i = 0; i < node->nchildren; i++) {
+        const Node* child = node->children[i];
+        if (child == tar->index->generated) { continue; }
+        if (!text_printf(name, S_ISDIR(child->mode) ? "%s/" : "%s", child->name) || !tar_add(tar, child, name)) { return false; }
+        text_truncate(name, length);
+    }
+    return true;
+}
+
+/**
+ * Gets the size of the headers and data of a file or directory and everything below it in an
+ * archive, the same as tar_add() adds for it, given the length of its name in the archive.
+ */
+static uint64_t tar_add_size(const Index* index, const Node* node, size_t name_length)
+{
+    if (!S_ISDIR(node->mode) && !S_ISREG(node->mode)) { return 0; }
+    uint64_t size = name_length ? tar_header_size(name_length) + (S_ISREG(node->mode) ? tar_round(node->size) : 0) : 0;
+    for (uint32_t i = 0; i < node->nchildren; i++) {
+        const Node* child = node->children[i];
+        if (child == index->generated) { continue; }
+        size += tar_add_size(index, child, name_length + strlen(child->name) + (S_ISDIR(child->mode) ? 1 : 0));
+    }
+    return size;
+}
+
+/**
+ * Gets the size of the archive of a directory without working out where everything in it goes.
+ * The size is kept with the directory since getattr needs it for every archive that is listed.
+ */
+uint64_t tar_size(const Index* index, const Node* dir)
+{
+    uint64_t size = __atomic_load_n(&dir->tar_size, __ATOMIC_RELAXED);
+    if (size) { return size; }
+    size_t name_length = dir->parent != dir ? strlen(dir->name) + 1 : 0; // same as tar_name() gives
+    size = tar_add_size(index, dir, name_length) + 2 * TAR_BLOCK_SIZE; // the end of the archive
+    __atomic_store_n(&((Node*)dir)->tar_size, size, __ATOMIC_RELAXED);
+    return size;
+}
+
+/**
+ * Frees an archive.
+ */
+void tar_close(TarFile* tar)
+{
+    free(tar->entries);
+    free(tar);
+}
+
+/**
+ * Works out everything that is in the archive of a directory. Returns NULL if out of memory.
+ */
+TarFile* tar_open(const Index* index, const Node* dir)
+{
+    TarFile* tar = (TarFile*)calloc(1, sizeof(TarFile));
+    if (!tar) { return NULL; }
+    tar->index = index;
+    tar->dir = dir;
+    TextBuffer name = { NULL, 0, 0 };
+    bool ok = tar_name(tar, dir, &name) && tar_add(tar, dir, &name);
+    free(name.data);
+    if (!ok) { tar_close(tar); errno = ENOMEM; return NULL; }
+    tar->size += 2 * TAR_BLOCK_SIZE; // the end of the archive
+    return tar;
+}
+
+/**
+ * Writes a number into a header field in octal, or in base-256 if it is too large (a GNU extension).
+ */
+static void tar_number(char* field, size_t size, uint64_t value)
+{
+    if (size - 1 >= 22 || value < (UINT64_C(1) << (3 * (size - 1)))) {
+        snprintf(field, size, "%0*" PRIo64, (int)(size - 1), value);
+        return;
+    }
+    memset(field, 0, size);
+    field[0] = (char)0x80;
+    for (size_t i = size - 1; i > 0 && value; i--, value >>= 8) { field[i] = (char)(value & 0xFF); }
+}
+
+/**
+ * Writes one header block into the 512 bytes at out.
+ */
+static void tar_block(uint8_t* out, const char* name, size_t name_length, char type, const Node* node, uint64_t size)
+{
+    char* h = (char*)out;
+    memset(h, 0, TAR_BLOCK_SIZE);
+    memcpy(h, name, name_length < TAR_NAME_SIZE ? name_length : TAR_NAME_SIZE); // name
+    tar_number(h + 100, 8, node->mode & 07777);                                  // mode
+    tar_number(h + 108, 8, node->uid);                                           // uid
+    tar_number(h + 116, 8, node->gid);                                           // gid
+    tar_number(h + 124, 12, size);                                               // size
+    tar_number(h + 136, 12, node->mtime > 0 ? (uint64_t)node->mtime : 0);        // mtime
+    h[156] = type;                                                               // typeflag
+    memcpy(h + 257, "ustar  ", 8);                                               // GNU magic and version
+    memset(h + 148, ' ', 8);                                                     // checksum
+    unsigned checksum = 0;
+    for (size_t i = 0; i < TAR_BLOCK_SIZE; i++) { checksum += out[i]; }
+    snprintf(h + 148, 8, "%06o", checksum);
+}
+
+/**
+ * Writes the headers of a file into out, which must have room for tar_header_size() bytes.
+ */
+static void tar_headers(uint8_t* out, const Node* node, const char* name, size_t name_length)
+{
+    if (name_length > TAR_NAME_SIZE) {
+        tar_block(out, "././@LongLink", 13, 'L', node, name_length + 1);
+        memset(out + TAR_BLOCK_SIZE, 0, tar_round(name_length + 1));
+        memcpy(out + TAR_BLOCK_SIZE, name, name_length);
+        out += TAR_BLOCK_SIZE + tar_round(name_length + 1);
+    }
+    tar_block(out, name, name_length, S_ISDIR(node->mode) ? '5' : '0', node, S_ISDIR(node->mode) ? 0 : node->size);
+}
+
+/**
+ * Reads part of an archive, making the headers as needed and reading the data of the files from
+ * the image. Returns the number of bytes read or -1 if there is a problem, with errno set.
+ */
+ssize_t tar_read(const TarFile* tar, void* buf, size_t size, uint64_t offset)
+{
+    if (offset >= tar->size) { return 0; }
+    if (tar->size - offset < size) { size = tar->size - offset; }
+    uint8_t* out = (uint8_t*)buf;
+
+    // Find the file that the offset is in
+    size_t low = 0, high = tar->nentries;
+    while (high - low > 1) {
+        size_t mid = (low + high) / 2;
+        if (tar->entries[mid].offset <= offset) { low = mid; } else { high = mid; }
+    }
+
+    TextBuffer name = { NULL, 0, 0 };
+    uint8_t* headers = NULL;
+    size_t done = 0;
+    for (size_t i = low; done < size && i < tar->nentries; i++) {
+        const TarEntry* entry = &tar->entries[i];
+        uint64_t end = i + 1 < tar->nentries ? tar->entries[i+1].offset : tar->size - 2 * TAR_BLOCK_SIZE;
+        uint64_t pos = offset + done;
+        if (pos >= end) { continue; }
+
+        // The headers
+        text_truncate(&name, 0);
+        if (!tar_name(tar, entry->node, &name)) { free(name.data); errno = ENOMEM; return -1; }
+        uint64_t header_size = tar_header_size(name.length);
+        if (pos < entry->offset + header_size) {
+            uint8_t* h = (uint8_t*)realloc(headers, header_size);
+            if (!h) { free(headers); free(name.data); errno = ENOMEM; return -1; }
+            headers = h;
+            tar_headers(headers, entry->node, name.data, name.length);
+            size_t n = entry->offset + header_size - pos < size - done ? entry->offset + header_size - pos : size - done;
+            memcpy(out + done, headers + (pos - entry->offset), n);
+            done += n;
+            pos += n;
+        }
+
+        // The data and the padding after it
+        uint64_t data = entry->offset + header_size;
+        if (done < size && pos < data + entry->node->size && S_ISREG(entry->node->mode)) {
+            size_t n = data + entry->node->size - pos < size - done ? data + entry->node->size - pos : size - done;
+            if (index_read(tar->index, entry->node, out + done, n, pos - data) < 0) { free(headers); free(name.data); return -1; }
+            done += n;
+            pos += n;
+        }
+        if (done < size && pos < end) {
+            size_t n = end - pos < size - done ? end - pos : size - done;
+            memset(out + done, 0, n);
+            done += n;
+        }
+    }
+    free(headers);
+    free(name.data);
+
+    // The end of the archive is all zeros
+    if (done < size) { memset(out + done, 0, size - done); }
+    return size;
+}
+
+/**
+ * Checks if a path is in the tar directory. If it is a directory (that mirrors a directory of the
+ * image) then TAR_DIR_MIRROR is returned, if it is an archive then TAR_DIR_ARCHIVE is returned,
+ * and the directory of the image is given in both cases. Otherwise 0 is returned with errno set.
+ */
+#define TAR_DIR_MIRROR  1
+#define TAR_DIR_ARCHIVE 2
+int tar_lookup(const Index* index, const char* path, const Node** dir)
+{
+    static const char prefix[] = "/" VIRTUAL_DIR "/" TAR_DIR;
+    *dir = NULL;
+    if (!index->generated || strncmp(path, prefix, sizeof(prefix) - 1) != 0 ||
+        (path[sizeof(prefix) - 1] != '/' && path[sizeof(prefix) - 1] != 0) ||
+        !index_find_child(index->generated, TAR_DIR, strlen(TAR_DIR))) {
+        errno = ENOENT;
+        return 0;
+    }
+    const char* rest = path + sizeof(prefix) - 1;
+    size_t length = strlen(rest);
+    if (length > 4 && strcmp(rest + length - 4, TAR_SUFFIX) == 0) {
+        char image_path[PATH_MAX];
+        if (length - 4 >= sizeof(image_path)) { errno = ENAMETOOLONG; return 0; }
+        memcpy(image_path, rest, length - 4);
+        image_path[length - 4] = 0;
+        if ((*dir = index_lookup(index, image_path)) && S_ISDIR((*dir)->mode) && *dir != index->generated) { return TAR_DIR_ARCHIVE; }
+    }
+    if (!(*dir = index_lookup(index, rest[0] ? rest : "/"))) { return 0; }
+    if (!S_ISDIR((*dir)->mode) || *dir == index->generated) { *dir = NULL; errno = ENOENT; return 0; }
+    return TAR_DIR_MIRROR;
+}
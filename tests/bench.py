@@ -0,0 +1,187 @@
+"""
+Helpers for the benchmark scripts in this directory: making ISO-9660 images with many files,
+mounting them with isofs, and working out the numbers. The benchmarks mount the image themselves,
+with each set of options they compare, and unmount it afterwards. isofs refuses to run as root, so
+they have to be run as a normal user that can mount FUSE filesystems (with fusermount).
+"""
+
+import contextlib
+import multiprocessing
+import os
+import random
+import struct
+import subprocess
+import tempfile
+import time
+
+BLOCK = 2048
+CHUNK = 1024*1024  # file data is written from (twice) a random buffer of this size
+
+
+def both16(value): return struct.pack("<H", value) + struct.pack(">H", value)
+def both32(value): return struct.pack("<I", value) + struct.pack(">I", value)
+
+
+def record(name, block, size, directory=False):
+    """A directory record."""
+    body = (b"\0" + both32(block) + both32(size) + bytes([120, 1, 2, 3, 4, 5, 0]) +
+            bytes([2 if directory else 0, 0, 0]) + both16(1) + bytes([len(name)]) + name)
+    if len(name) % 2 == 0:
+        body += b"\0"
+    return bytes([len(body) + 1]) + body
+
+
+def pack_records(records):
+    """Puts records one after another without letting any of them cross into the next block."""
+    data = b""
+    for rec in records:
+        if len(data) // BLOCK != (len(data) + len(rec) - 1) // BLOCK:
+            data += b"\0" * (-len(data) % BLOCK)
+        data += rec
+    return data + b"\0" * (-len(data) % BLOCK)
+
+
+def make_image(path, files, seed=1):
+    """
+    Writes an image with the given files, a list of (path, size) where the path has / between the
+    directories (which are made as needed). Names should be uppercase ISO-9660 names like
+    D001/F00001.BIN. The data of the files comes after all of the directories, in the order given.
+    """
+    # The directories and what is in each of them
+    children = {"": set()}
+    for file_path, size in files:
+        parts = file_path.split("/")
+        for i in range(1, len(parts)):
+            children.setdefault("/".join(parts[:i]), set())
+            children["/".join(parts[:i-1])].add(("/".join(parts[:i]), True))
+        children["/".join(parts[:-1])].add((file_path, False))
+    sizes = dict(files)
+    dirs = sorted(children, key=lambda d: (d.count("/") if d else -1, d))
+
+    # Where everything goes, working out the sizes of the directories from the lengths of the names
+    def name_of(child, is_dir): return child.rpartition("/")[2].encode() + (b"" if is_dir else b";1")
+    dir_sizes = {d: len(pack_records([record(b"\0", 0, 0), record(b"\1", 0, 0)] +
+                                     [record(name_of(c, is_dir), 0, 0) for c, is_dir in sorted(children[d])]))
+                 for d in dirs}
+    blocks, block = {}, 18
+    for d in dirs:
+        blocks[d] = block
+        block += dir_sizes[d] // BLOCK
+    for file_path, size in files:
+        blocks[file_path] = block
+        block += (size + BLOCK - 1) // BLOCK
+
+    rng = random.Random(seed)
+    chunk = rng.randbytes(CHUNK) * 2
+    with open(path, "wb") as out:
+        out.truncate(block * BLOCK)
+
+        # The directories
+        for d in dirs:
+            parent = d.rpartition("/")[0]
+            records = [record(b"\0", blocks[d], dir_sizes[d], True),
+                       record(b"\1", blocks[parent], dir_sizes[parent], True)]
+            for child, is_dir in sorted(children[d]):
+                records.append(record(name_of(child, is_dir), blocks[child],
+                                      dir_sizes[child] if is_dir else sizes[child], is_dir))
+            out.seek(blocks[d] * BLOCK)
+            out.write(pack_records(records))
+
+        # The files, each starting at a different place in the random data
+        for file_path, size in files:
+            out.seek(blocks[file_path] * BLOCK)
+            start = rng.randrange(CHUNK)
+            for offset in range(0, size, CHUNK):
+                out.write(chunk[start:start + min(CHUNK, size - offset)])
+
+        # The primary volume descriptor and the terminator
+        pvd = bytearray(BLOCK)
+        pvd[0:7] = b"\1CD001\1"
+        pvd[8:40] = b"LINUX".ljust(32)
+        pvd[40:72] = b"BENCH".ljust(32)
+        pvd[80:88] = both32(block)
+        pvd[120:124] = both16(1)
+        pvd[124:128] = both16(1)
+        pvd[128:132] = both16(BLOCK)
+        root_record = record(b"\0", blocks[""], dir_sizes[""], True)
+        pvd[156:156 + len(root_record)] = root_record
+        pvd[881] = 1
+        out.seek(16*BLOCK)
+        out.write(pvd)
+        out.write(b"\xffCD001\1")
+
+
+def small_files(count, dirs=100, low=4*1024, high=64*1024, seed=1):
+    """A list of (path, size) for many small files spread over some directories."""
+    rng = random.Random(seed)
+    return [(f"D{i % dirs:03d}/F{i:05d}.BIN", rng.randint(low, high)) for i in range(count)]
+
+
+def evict(path):
+    """Drops a file from the page cache so it is read from its storage again (if it is on a disk)."""
+    fd = os.open(path, os.O_RDONLY)
+    try:
+        os.fsync(fd)
+        os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+    finally:
+        os.close(fd)
+
+
+@contextlib.contextmanager
+def mounted(isofs, image, args=()):
+    """
+    Mounts an image with isofs in the foreground with the given extra arguments (like
+    ["-o", "threads=4"]) on a new directory, giving the directory and the process of isofs.
+    """
+    mount = tempfile.mkdtemp(prefix="isofs-bench-")
+    process = subprocess.Popen([isofs, "-f", *args, image, mount], stderr=subprocess.DEVNULL)
+    try:
+        deadline = time.monotonic() + 60
+        while not os.path.ismount(mount):
+            if process.poll() is not None:
+                raise RuntimeError(f"isofs {' '.join(args)} exited with {process.returncode}")
+            if time.monotonic() > deadline:
+                raise RuntimeError(f"isofs {' '.join(args)} didn't mount the image")
+            time.sleep(0.05)
+        yield mount, process
+    finally:
+        if os.path.ismount(mount):
+            subprocess.run(["fusermount", "-u", mount], check=False)
+        process.wait()
+        os.rmdir(mount)
+
+
+def cpu_seconds(pid):
+    """The user and system CPU time that a process has used so far."""
+    with open(f"/proc/{pid}/stat") as stat:
+        fields = stat.read().rpartition(")")[2].split()
+    return (int(fields[11]) + int(fields[12])) / os.sysconf("SC_CLK_TCK")
+
+
+def percentile(samples, p):
+    """The p-th percentile of some samples (by the nearest rank)."""
+    ordered = sorted(samples)
+    return ordered[min(len(ordered) - 1, max(0, int(len(ordered) * p / 100 + 0.5) - 1))] if ordered else 0.0
+
+
+def _stat_worker(args):
+    paths, seconds, seed = args
+    rng = random.Random(seed)
+    latencies = []
+    end = time.monotonic() + seconds
+    while True:
+        start = time.monotonic()
+        if start >= end:
+            return latencies
+        os.stat(rng.choice(paths))
+        latencies.append(time.monotonic() - start)
+
+
+def stat_load(paths, processes, seconds):
+    """
+    Runs stat() on random paths from several processes at once (so Python's lock between threads
+    doesn't get in the way) for some seconds. Gives the number of seconds each stat() took.
+    """
+    with multiprocessing.Pool(processes) as pool:
+        results = pool.map(_stat_worker, [(paths, seconds, i) for i in range(processes)])
+    return [latency for latencies in results for latency in latencies]
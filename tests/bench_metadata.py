@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+"""
+Benchmarks small requests: several processes run stat() on random files of an image of many small
+files, which makes isofs handle a lookup and a getattr for each one, and this gives how many were
+done each second along with the CPU time isofs used for each one. It is run with isofs's own
+worker loop (see loop.h), with the multithreaded libfuse loop (-o fuse_loop), and with a single
+thread (-s).
+
+With --threads it instead shows how the loops scale with the number of threads: for each number of
+threads N it is run with N clients and N workers (-o threads=N), with the workers also kept on
+their own CPUs (-o pin), and with the libfuse loop for comparison. Each worker other than the
+first reads requests from its own clone of /dev/fuse.
+
+The kernel would answer almost all of them itself with the timeouts that isofs normally gives it,
+so the image is mounted with entry_timeout=0, negative_timeout=0, and attr_timeout=0 unless
+--kernel-cache is given.
+
+Usage:
+    python3 tests/bench_metadata.py ISOFS IMAGE [--files N] [--clients N] [--seconds N] [-o OPTIONS]
+    python3 tests/bench_metadata.py ISOFS IMAGE --threads 1,2,4,8,16,32,64 [...]
+
+IMAGE is made (with N small files, 20000 by default) if it doesn't exist yet, and later runs have
+to give the same --files. For example:
+    python3 tests/bench_metadata.py ./isofs /tmp/bench-small.iso --clients 16
+    python3 tests/bench_metadata.py ./isofs /tmp/bench-small.iso --threads 1,2,4,8,16,32,64
+"""
+
+import argparse
+import os
+import sys
+
+import bench
+
+NO_CACHE = "entry_timeout=0,negative_timeout=0,attr_timeout=0"
+LOOPS = [
+    ("isofs loop", []),
+    ("libfuse loop", ["-o", "fuse_loop"]),
+    ("single thread", ["-s"]),
+]
+SCALING = [
+    ("isofs loop", lambda threads: ["-o", f"threads={threads}"]),
+    ("isofs loop, pinned", lambda threads: ["-o", f"threads={threads},pin"]),
+    ("libfuse loop", lambda threads: ["-o", "fuse_loop"]),
+]
+
+
+def measure(isofs, image, files, clients, seconds, args):
+    """Runs the stat() load on a new mount with the given arguments, giving the results as text."""
+    with bench.mounted(isofs, image, args) as (mount, process):
+        paths = [os.path.join(mount, path) for path, size in files]
+        bench.stat_load(paths, clients, 0.5)  # warm up the index and the dentries
+        cpu = bench.cpu_seconds(process.pid)
+        latencies = bench.stat_load(paths, clients, seconds)
+        cpu = bench.cpu_seconds(process.pid) - cpu
+    ops = len(latencies)
+    return (f"{ops / seconds:10.0f} stat/s {cpu / ops * 1e6:8.1f} us CPU/stat "
+            f"p50 {bench.percentile(latencies, 50) * 1e6:8.1f} us p99 {bench.percentile(latencies, 99) * 1e6:8.1f} us")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("isofs", help="the isofs program")
+    parser.add_argument("image", help="the image to use (made if it doesn't exist)")
+    parser.add_argument("--files", type=int, default=20000, help="number of files when making the image")
+    parser.add_argument("--clients", type=int, default=os.cpu_count(), help="processes running stat()")
+    parser.add_argument("--seconds", type=float, default=5, help="how long each run is")
+    parser.add_argument("--kernel-cache", action="store_true", help="keep the timeouts that isofs gives the kernel")
+    parser.add_argument("--threads", help="numbers of threads to show the scaling for, like 1,2,4,8")
+    parser.add_argument("-o", dest="options", help="more options for isofs")
+    args = parser.parse_args()
+    if not os.path.exists(args.image):
+        bench.make_image(args.image, bench.small_files(args.files))
+    files = bench.small_files(args.files)
+    options = [option for option in (args.options, None if args.kernel_cache else NO_CACHE) if option]
+    more = ["-o", ",".join(options)] if options else []
+
+    if args.threads:
+        print(f"{len(files)} files, {args.seconds} s each, as many clients as threads")
+        for threads in [int(n) for n in args.threads.split(",")]:
+            for name, loop_args in SCALING:
+                result = measure(args.isofs, args.image, files, threads, args.seconds, loop_args(threads) + more)
+                print(f"{threads:3} threads {name:18} {result}")
+                sys.stdout.flush()
+        return
+
+    print(f"{len(files)} files, {args.clients} clients, {args.seconds} s each")
+    for name, loop_args in LOOPS:
+        result = measure(args.isofs, args.image, files, args.clients, args.seconds, loop_args + more)
+        print(f"{name:14} {result}")
+        sys.stdout.flush()
+
+
+if __name__ == "__main__":
+    main()
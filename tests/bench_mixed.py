@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+"""
+Benchmarks requests for metadata while large files are being read: some processes run stat() on
+random small files of an image while other processes stream its large files, and this gives the
+p50 and p99 time of a stat() with nothing else going on and with the streams going, along with
+how fast the streams read. It is run with the reads handled by separate data threads (the default,
+see loop.h) and with them handled by the workers like everything else (-o data_threads=0).
+
+The streams drop what they have read from the page cache each time they get to the end of a file
+so that their reads keep going to isofs, and the image is mounted with attr_timeout=0 and
+entry_timeout=0 so that every stat() does too.
+
+Usage:
+    python3 tests/bench_mixed.py ISOFS IMAGE [--files N] [--big-files N] [--big-size SIZE]
+                                 [--clients N] [--streams N] [--seconds N] [-o OPTIONS]
+
+IMAGE is made if it doesn't exist yet, and later runs have to give the same --files, --big-files,
+and --big-size. For example:
+    python3 tests/bench_mixed.py ./isofs /tmp/bench-mixed.iso --streams 16
+"""
+
+import argparse
+import multiprocessing
+import os
+import sys
+import time
+
+import bench
+
+NO_CACHE = "entry_timeout=0,attr_timeout=0"
+MODES = [
+    ("data threads", []),
+    ("data_threads=0", ["-o", "data_threads=0"]),
+]
+
+
+def stream(path, stop, total):
+    """Reads a file over and over until told to stop, adding up how many bytes were read."""
+    with open(path, "rb", buffering=0) as f:
+        while not stop.is_set():
+            data = f.read(1024*1024)
+            if not data:
+                os.posix_fadvise(f.fileno(), 0, 0, os.POSIX_FADV_DONTNEED)
+                f.seek(0)
+                continue
+            with total.get_lock():
+                total.value += len(data)
+
+
+def measure(isofs, image, small, big, clients, streams, seconds, args):
+    """Runs the stat() load without and with the streams on a new mount, giving the results as text."""
+    with bench.mounted(isofs, image, args) as (mount, process):
+        paths = [os.path.join(mount, path) for path, size in small]
+        bench.stat_load(paths, clients, 0.5)  # warm up the index and the dentries
+        idle = bench.stat_load(paths, clients, seconds)
+
+        stop, total = multiprocessing.Event(), multiprocessing.Value("Q", 0)
+        streamers = [multiprocessing.Process(target=stream, args=(os.path.join(mount, path), stop, total))
+                     for path in [big[i % len(big)][0] for i in range(streams)]]
+        for streamer in streamers:
+            streamer.start()
+        time.sleep(1)  # let the streams get going
+        start, read = time.monotonic(), total.value
+        loaded = bench.stat_load(paths, clients, seconds)
+        rate = (total.value - read) / (time.monotonic() - start)
+        stop.set()
+        for streamer in streamers:
+            streamer.join()
+
+    def latency(samples): return (f"p50 {bench.percentile(samples, 50) * 1e6:8.1f} us "
+                                  f"p99 {bench.percentile(samples, 99) * 1e6:9.1f} us")
+    return f"idle {latency(idle)} | streaming {latency(loaded)} {rate / 1e6:8.1f} MB/s read"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("isofs", help="the isofs program")
+    parser.add_argument("image", help="the image to use (made if it doesn't exist)")
+    parser.add_argument("--files", type=int, default=20000, help="number of small files when making the image")
+    parser.add_argument("--big-files", type=int, default=4, help="number of large files when making the image")
+    parser.add_argument("--big-size", type=int, default=256, help="size of each large file in MiB")
+    parser.add_argument("--clients", type=int, default=4, help="processes running stat()")
+    parser.add_argument("--streams", type=int, default=2*os.cpu_count(), help="processes reading the large files")
+    parser.add_argument("--seconds", type=float, default=5, help="how long each stat() load is")
+    parser.add_argument("-o", dest="options", help="more options for isofs")
+    args = parser.parse_args()
+    small = bench.small_files(args.files)
+    big = [(f"BIG/F{i:05d}.BIN", args.big_size * 1024*1024) for i in range(args.big_files)]
+    if not os.path.exists(args.image):
+        bench.make_image(args.image, small + big)
+    more = ["-o", ",".join(option for option in (args.options, NO_CACHE) if option)]
+
+    print(f"{len(small)} small files, {len(big)} x {args.big_size} MiB files, {args.clients} clients, "
+          f"{args.streams} streams, {args.seconds} s each")
+    for name, mode_args in MODES:
+        result = measure(args.isofs, args.image, small, big, args.clients, args.streams, args.seconds, mode_args + more)
+        print(f"{name:14} {result}")
+        sys.stdout.flush()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+"""
+Benchmarks prefetching with a read plan (see prefetch.h): reads every file of an image of many
+small files in a shuffled order, like an epoch of training on a shuffled dataset, and gives how
+long each epoch took without a plan and with the order written to /.isofs/plan first. The image is
+dropped from the page cache and mounted again before every epoch so each one starts cold, which
+only means something if the image is on a disk (or network filesystem) and not in tmpfs.
+
+Usage:
+    python3 tests/bench_plan.py ISOFS IMAGE [--files N] [--epochs N] [--readers N] [-o OPTIONS]
+
+IMAGE is made (with N small files, 20000 by default) if it doesn't exist yet, and later runs have
+to give the same --files. For example:
+    python3 tests/bench_plan.py ./isofs /data/bench-small.iso --epochs 3
+"""
+
+import argparse
+import os
+import random
+import sys
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+import bench
+
+
+def read_file(path):
+    with open(path, "rb") as f:
+        while f.read(1024*1024):
+            pass
+
+
+def epoch(isofs, image, order, plan, readers, options):
+    """Reads the files in the given order in a new mount, returning the seconds it took."""
+    bench.evict(image)
+    with bench.mounted(isofs, image, options) as (mount, process):
+        start = time.monotonic()
+        if plan:
+            with open(os.path.join(mount, ".isofs", "plan"), "w") as f:
+                f.write("".join(f"/{path}\n" for path in order))
+        paths = [os.path.join(mount, path) for path in order]
+        if readers == 1:
+            for path in paths:
+                read_file(path)
+        else:
+            # Several readers that each take the next file in order, like the workers of a data loader
+            with ThreadPoolExecutor(readers) as pool:
+                list(pool.map(read_file, paths))
+        return time.monotonic() - start
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("isofs", help="the isofs program")
+    parser.add_argument("image", help="the image to read (made if it doesn't exist)")
+    parser.add_argument("--files", type=int, default=20000, help="number of files when making the image")
+    parser.add_argument("--epochs", type=int, default=3, help="epochs with and without a plan")
+    parser.add_argument("--readers", type=int, default=1, help="threads reading the files of an epoch")
+    parser.add_argument("-o", dest="options", help="more options for isofs, like cache_dir=DIR")
+    args = parser.parse_args()
+    if not os.path.exists(args.image):
+        bench.make_image(args.image, bench.small_files(args.files))
+    files = bench.small_files(args.files)
+    total = sum(size for path, size in files)
+    options = ["-o", args.options] if args.options else []
+
+    print(f"{len(files)} files, {total / 1e6:.1f} MB, {args.readers} reader(s)")
+    for run in range(args.epochs):
+        order = [path for path, size in files]
+        random.Random(run).shuffle(order)
+        for plan in (False, True):
+            seconds = epoch(args.isofs, args.image, order, plan, args.readers, options)
+            print(f"epoch {run + 1} {'with plan   ' if plan else 'without plan'} {seconds:8.2f} s "
+                  f"{total / seconds / 1e6:8.1f} MB/s")
+            sys.stdout.flush()
+
+
+if __name__ == "__main__":
+    main()
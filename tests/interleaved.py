@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+"""
+Makes a small ISO-9660 image with interleaved files, and checks that they read correctly through
+isofs. Interleaved files have their data in units of some number of blocks with a gap of other
+blocks between each unit, which index_read() has to skip (see the unit and stride of Extent in
+index.h). The gap blocks are filled with 0xEE so reading them shows up as wrong data.
+
+Usage:
+    python3 tests/interleaved.py interleaved.iso          # only makes the image
+    python3 tests/interleaved.py interleaved.iso MOUNT    # also checks the files in a mount of it
+
+For example:
+    python3 tests/interleaved.py /tmp/interleaved.iso
+    mkdir -p /tmp/mnt && ./isofs /tmp/interleaved.iso /tmp/mnt
+    python3 tests/interleaved.py /tmp/interleaved.iso /tmp/mnt
+    umount /tmp/mnt
+"""
+
+import os
+import struct
+import sys
+
+BLOCK = 2048
+GAP_BYTE = 0xEE
+
+# name, interleaved unit size and gap size (in blocks), size in bytes
+FILES = [
+    ("PLAIN.BIN", 0, 0, 3*BLOCK + 100),
+    ("INTER1.BIN", 1, 1, 5*BLOCK + 1000),  # ends partway into a unit
+    ("INTER2.BIN", 2, 3, 6*BLOCK),         # ends exactly at the end of a unit
+    ("INTER3.BIN", 3, 1, 2*BLOCK + 1),     # smaller than one unit
+]
+
+
+def both16(value): return struct.pack("<H", value) + struct.pack(">H", value)
+def both32(value): return struct.pack("<I", value) + struct.pack(">I", value)
+
+
+def contents(index, size):
+    """The data of a file, different for every file and position."""
+    return bytes((i * 7 + index * 13 + i // 251) % 251 for i in range(size))
+
+
+def record(name, block, size, directory=False, unit=0, gap=0):
+    """A directory record."""
+    body = (b"\0" + both32(block) + both32(size) + bytes([120, 1, 2, 3, 4, 5, 0]) +
+            bytes([2 if directory else 0, unit, gap]) + both16(1) + bytes([len(name)]) + name)
+    if len(name) % 2 == 0:
+        body += b"\0"
+    return bytes([len(body) + 1]) + body
+
+
+def make_image(path):
+    # Blocks 16 and 17 are the volume descriptors, 18 is the root directory, then the files
+    root = 18
+    block = root + 1
+    layout = []
+    for index, (name, unit, gap, size) in enumerate(FILES):
+        if unit:
+            units = (size + unit*BLOCK - 1) // (unit*BLOCK)
+            nblocks = units * (unit + gap)
+        else:
+            nblocks = (size + BLOCK - 1) // BLOCK
+        layout.append((index, name, unit, gap, size, block))
+        block += nblocks
+    image = bytearray(block * BLOCK)
+
+    # The files, with the gaps filled in with GAP_BYTE
+    for index, name, unit, gap, size, start in layout:
+        data = contents(index, size)
+        if not unit:
+            image[start*BLOCK:start*BLOCK + size] = data
+            continue
+        at = start
+        for offset in range(0, size, unit*BLOCK):
+            chunk = data[offset:offset + unit*BLOCK]
+            image[at*BLOCK:at*BLOCK + len(chunk)] = chunk
+            image[(at + unit)*BLOCK:(at + unit + gap)*BLOCK] = bytes([GAP_BYTE]) * (gap*BLOCK)
+            at += unit + gap
+
+    # The root directory
+    records = record(b"\0", root, BLOCK, True) + record(b"\1", root, BLOCK, True)
+    for index, name, unit, gap, size, start in layout:
+        records += record(name.encode() + b";1", start, size, unit=unit, gap=gap)
+    assert len(records) <= BLOCK
+    image[root*BLOCK:root*BLOCK + len(records)] = records
+
+    # The primary volume descriptor and the terminator
+    pvd = bytearray(BLOCK)
+    pvd[0:7] = b"\1CD001\1"
+    pvd[8:40] = b"LINUX".ljust(32)
+    pvd[40:72] = b"INTERLEAVED".ljust(32)
+    pvd[80:88] = both32(block)
+    pvd[120:124] = both16(1)
+    pvd[124:128] = both16(1)
+    pvd[128:132] = both16(BLOCK)
+    root_record = record(b"\0", root, BLOCK, True)
+    pvd[156:156 + len(root_record)] = root_record
+    pvd[881] = 1
+    image[16*BLOCK:17*BLOCK] = pvd
+    image[17*BLOCK:17*BLOCK + 7] = b"\xffCD001\1"
+    with open(path, "wb") as out:
+        out.write(image)
+
+
+def check_mount(mount):
+    """Reads each file whole and in pieces that start and end in different units and gaps."""
+    problems = 0
+    for index, (name, unit, gap, size) in enumerate(FILES):
+        expected = contents(index, size)
+        wrong = 0
+        with open(os.path.join(mount, name), "rb") as f:
+            if f.read() != expected:
+                print(f"{name}: reading the whole file gave the wrong data")
+                wrong += 1
+            for offset in sorted({0, 1, BLOCK - 1, BLOCK, BLOCK + 1, 3*BLOCK - 7, size // 2, size - 1}):
+                for length in (1, 100, BLOCK, 2*BLOCK + 3, size):
+                    f.seek(offset)
+                    if f.read(length) != expected[offset:offset + length]:
+                        print(f"{name}: reading {length} bytes at {offset} gave the wrong data")
+                        wrong += 1
+        print(f"{name}: {'FAILED' if wrong else 'ok'}")
+        problems += wrong
+    return problems == 0
+
+
+if __name__ == "__main__":
+    if len(sys.argv) not in (2, 3):
+        sys.exit(__doc__.strip())
+    make_image(sys.argv[1])
+    if len(sys.argv) == 3 and not check_mount(sys.argv[2]):
+        sys.exit(1)
@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+"""
+Makes a sparse ISO-9660 image larger than 4 GiB with its directories and files past the 4 GiB
+mark, and checks that they can be looked up and read correctly through isofs. Byte offsets of
+blocks that far into an image don't fit in 32 bits, so any block to byte offset math that wraps
+around shows up as missing files or wrong data. Only the blocks that are used are written, so the
+image takes up a few megabytes on disk.
+
+The image has:
+    /CROSS.BIN                 starts before 4 GiB and ends after it
+    /FAR/                      a directory at 6 GiB
+    /FAR/MIDDLE.BIN
+    /FAR/DEEP/                 a directory past 8 GiB
+    /FAR/DEEP/END.BIN          ends a few bytes before the end of the 9 GiB image
+The root directory itself is just past 4 GiB.
+
+Usage:
+    python3 tests/large.py large.iso          # only makes the image
+    python3 tests/large.py large.iso MOUNT    # also checks the files in a mount of it
+
+For example (also try mounting with -o window=64M and with -o cache_dir=DIR):
+    python3 tests/large.py /tmp/large.iso
+    mkdir -p /tmp/mnt && ./isofs /tmp/large.iso /tmp/mnt
+    python3 tests/large.py /tmp/large.iso /tmp/mnt
+    umount /tmp/mnt
+"""
+
+import os
+import struct
+import sys
+
+BLOCK = 2048
+MiB = 1 << 20
+GiB = 1 << 30
+IMAGE_SIZE = 9*GiB
+
+# path, byte offset in the image, size in bytes (None for directories, which are one block)
+LAYOUT = [
+    ("", 4*GiB + 2*MiB, None),
+    ("CROSS.BIN", 4*GiB - 1*MiB, 2*MiB + 123),
+    ("FAR", 6*GiB, None),
+    ("FAR/MIDDLE.BIN", 6*GiB + 16*BLOCK, 300*1000),
+    ("FAR/DEEP", 8*GiB + 4*BLOCK, None),
+    ("FAR/DEEP/END.BIN", IMAGE_SIZE - 1*MiB, 1*MiB - 5),
+]
+FILES = [(index, path, size) for index, (path, offset, size) in enumerate(LAYOUT) if size is not None]
+
+
+def both16(value): return struct.pack("<H", value) + struct.pack(">H", value)
+def both32(value): return struct.pack("<I", value) + struct.pack(">I", value)
+
+
+def contents(index, size):
+    """The data of a file, different for every file and position."""
+    return bytes((i * 7 + index * 13 + i // 251) % 251 for i in range(size))
+
+
+def record(name, block, size, directory=False):
+    """A directory record."""
+    body = (b"\0" + both32(block) + both32(size) + bytes([120, 1, 2, 3, 4, 5, 0]) +
+            bytes([2 if directory else 0, 0, 0]) + both16(1) + bytes([len(name)]) + name)
+    if len(name) % 2 == 0:
+        body += b"\0"
+    return bytes([len(body) + 1]) + body
+
+
+def parent_of(path):
+    return path.rpartition("/")[0]
+
+
+def make_image(path):
+    blocks = {path: offset // BLOCK for path, offset, size in LAYOUT}
+    with open(path, "wb") as out:
+        out.truncate(IMAGE_SIZE)
+
+        # The directories, each listing its children in order
+        for dir_path, offset, size in LAYOUT:
+            if size is not None:
+                continue
+            records = (record(b"\0", blocks[dir_path], BLOCK, True) +
+                       record(b"\1", blocks[parent_of(dir_path)], BLOCK, True))
+            children = sorted((child, child_size) for child, _, child_size in LAYOUT
+                              if child and parent_of(child) == dir_path)
+            for child, child_size in children:
+                name = child.rpartition("/")[2].encode()
+                if child_size is None:
+                    records += record(name, blocks[child], BLOCK, True)
+                else:
+                    records += record(name + b";1", blocks[child], child_size)
+            assert len(records) <= BLOCK
+            out.seek(offset)
+            out.write(records)
+
+        # The files
+        for index, file_path, size in FILES:
+            out.seek(LAYOUT[index][1])
+            out.write(contents(index, size))
+
+        # The primary volume descriptor and the terminator
+        pvd = bytearray(BLOCK)
+        pvd[0:7] = b"\1CD001\1"
+        pvd[8:40] = b"LINUX".ljust(32)
+        pvd[40:72] = b"LARGE".ljust(32)
+        pvd[80:88] = both32(IMAGE_SIZE // BLOCK)
+        pvd[120:124] = both16(1)
+        pvd[124:128] = both16(1)
+        pvd[128:132] = both16(BLOCK)
+        root_record = record(b"\0", blocks[""], BLOCK, True)
+        pvd[156:156 + len(root_record)] = root_record
+        pvd[881] = 1
+        out.seek(16*BLOCK)
+        out.write(pvd)
+        out.write(b"\xffCD001\1")
+
+
+def check_mount(mount):
+    """Lists every directory, then reads each file whole and in pieces, including across 4 GiB."""
+    problems = 0
+    for dir_path, offset, size in LAYOUT:
+        if size is not None:
+            continue
+        expected = sorted(child.rpartition("/")[2] for child, _, _ in LAYOUT
+                          if child and parent_of(child) == dir_path)
+        names = sorted(os.listdir(os.path.join(mount, dir_path)))
+        if names != expected:
+            print(f"/{dir_path}: listed {names} instead of {expected}")
+            problems += 1
+    for index, file_path, size in FILES:
+        expected = contents(index, size)
+        wrong = 0
+        path = os.path.join(mount, file_path)
+        if os.stat(path).st_size != size:
+            print(f"{file_path}: has size {os.stat(path).st_size} instead of {size}")
+            wrong += 1
+        with open(path, "rb") as f:
+            if f.read() != expected:
+                print(f"{file_path}: reading the whole file gave the wrong data")
+                wrong += 1
+            four_gib = 4*GiB - LAYOUT[index][1]  # where 4 GiB is in the file, if it is in it
+            offsets = {0, 1, BLOCK - 1, BLOCK, size // 2, size - BLOCK - 1, size - 1}
+            if 0 < four_gib < size:
+                offsets |= {four_gib - BLOCK - 1, four_gib - 1, four_gib, four_gib + 1}
+            for offset in sorted(offsets):
+                for length in (1, 100, BLOCK, 2*BLOCK + 3, 64*1024 + 5):
+                    f.seek(offset)
+                    if f.read(length) != expected[offset:offset + length]:
+                        print(f"{file_path}: reading {length} bytes at {offset} gave the wrong data")
+                        wrong += 1
+        print(f"{file_path}: {'FAILED' if wrong else 'ok'}")
+        problems += wrong
+    return problems == 0
+
+
+if __name__ == "__main__":
+    if len(sys.argv) not in (2, 3):
+        sys.exit(__doc__.strip())
+    make_image(sys.argv[1])
+    if len(sys.argv) == 3 and not check_mount(sys.argv[2]):
+        sys.exit(1)
@@ -0,0 +1,54 @@
+/**
+ * Static probe points (USDT) for tracing isofs with tools like bpftrace while it is running,
+ * without restarting it or attaching to functions that may have been inlined. Each probe is a
+ * single nop in the code plus a note in the binary saying where it is and where its arguments are,
+ * so they cost next to nothing until something attaches to them. They are built in on Linux when
+ * <sys/sdt.h> is available (from systemtap-sdt-dev or systemtap-sdt-devel), and compile to nothing
+ * otherwise or with -DNO_TRACE. `bpftrace -l 'usdt:./isofs:*'` lists them, and the bpftrace/
+ * directory has example scripts.
+ *
+ * Each probe also has a semaphore (isofs_NAME_semaphore) that tracers increment while they are
+ * attached to it, and TRACE() only evaluates the arguments of a probe when its semaphore is set,
+ * so arguments that take work to get (like the length of a name) cost nothing the rest of the time.
+ * bpftrace only sets the semaphores of the process given with -p (or of every running isofs with
+ * --usdt-file-activation), and tools that don't set semaphores at all (like perf) never see the
+ * probes fire.
+ *
+ * The probes (all in the isofs provider) and their arguments:
+ *   op__entry        name of the operation, path
+ *   op__return       name of the operation, path, result (0 or more, or -errno)
+ *   lookup__part     path, part being looked up, length of the part, node found (0 if not found),
+ *                    also fired by get_record() in part2.c with the record found
+ *   lookup__hit      index id, path, node (the path was in the lookup cache of the thread)
+ *   lookup__miss     index id, path
+ *   rr__continue     block, offset, and length of a SUSP continuation area (CE) being followed
+ *   cache__hit       offset, length (all of the blocks were already in the local cache)
+ *   cache__miss      offset, length (some of the blocks have to be fetched)
+ *   cache__fetch     offset, length of a run of blocks copied from the image to the cache
+ *   window__map      offset, length of a window of the image being mapped
+ */
+
+#if defined(__linux__) && !defined(NO_TRACE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define TRACE(name, ...) do { if (__builtin_expect(isofs_##name##_semaphore, 0)) { STAP_PROBEV(isofs, name, __VA_ARGS__); } } while (0)
+#define TRACE_ENABLED
+
+// The semaphores of the probes, in the section that tracers look for them in
+#define TRACE_SEMAPHORE(name) __extension__ unsigned short isofs_##name##_semaphore __attribute__((unused)) __attribute__((section(".probes")))
+TRACE_SEMAPHORE(op__entry);
+TRACE_SEMAPHORE(op__return);
+TRACE_SEMAPHORE(lookup__part);
+TRACE_SEMAPHORE(lookup__hit);
+TRACE_SEMAPHORE(lookup__miss);
+TRACE_SEMAPHORE(rr__continue);
+TRACE_SEMAPHORE(cache__hit);
+TRACE_SEMAPHORE(cache__miss);
+TRACE_SEMAPHORE(cache__fetch);
+TRACE_SEMAPHORE(window__map);
+#endif
+#endif
+#ifndef TRACE
+#define TRACE(...) do { } while (0)
+#endif
@@ -0,0 +1,169 @@
+/**
+ * An optional index of the trigrams (every 3 bytes in a row) in the names of all files, so that
+ * finding the names that contain a string only has to look at the files that have all of the
+ * trigrams of that string instead of every file. For each trigram there is a sorted list of the
+ * files whose names have it, and the lists for the trigrams of the string are intersected.
+ *
+ * It is built from the finished index when the filesystem is mounted with `-o trigrams`, with the
+ * sorting (which takes most of the time) split between threads, and uses the index memory.
+ */
+
+#define TRIGRAM_BUCKETS 256 // the trigrams are split by their first byte to be sorted separately
+
+typedef struct _TrigramIndex {
+    const Node** nodes;  // all of the files and directories in the order they are in the tree
+    uint32_t nnodes;     // number of nodes
+    uint32_t ntrigrams;  // number of different trigrams in all of the names
+    uint32_t* trigrams;  // the trigrams, sorted
+    uint32_t* starts;    // where the nodes with each trigram start in postings (and where they end)
+    uint32_t* postings;  // positions in nodes of the names with each trigram, sorted
+    size_t memory;       // bytes used by the trigram index
+} TrigramIndex;
+
+static inline uint32_t trigram_at(const char* str)
+{
+    return ((uint32_t)(uint8_t)str[0] << 16) | ((uint32_t)(uint8_t)str[1] << 8) | (uint8_t)str[2];
+}
+
+/**
+ * Adds all nodes at or below the given one to the list, skipping the generated files.
+ */
+static bool trigram_collect(const Index* index, Node* node, NodeList* list)
+{
+    if (!node_list_add(list, node)) { return false; }
+    for (uint32_t i = 0; i < node->nchildren; i++) {
+        if (node->children[i] != index->generated && !trigram_collect(index, node->children[i], list)) { return false; }
+    }
+    return true;
+}
+
+/**
+ * The buckets of trigram and position pairs that threads take turns sorting.
+ */
+typedef struct _TrigramWork {
+    uint64_t* pairs;                        // trigram << 32 | position of the node for each trigram
+    uint64_t starts[TRIGRAM_BUCKETS + 1];   // where each bucket starts in pairs
+    uint32_t next;                          // the next bucket to sort
+} TrigramWork;
+
+static int compare_pairs(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void* trigram_worker(void* arg)
+{
+    TrigramWork* work = (TrigramWork*)arg;
+    uint32_t i;
+    while ((i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) < TRIGRAM_BUCKETS) {
+        qsort(work->pairs + work->starts[i], work->starts[i+1] - work->starts[i], sizeof(uint64_t), compare_pairs);
+    }
+    return NULL;
+}
+
+/**
+ * Builds the trigram index of the names of all files in an index. Returns false if out of memory.
+ */
+bool index_build_trigrams(Index* index)
+{
+    TrigramIndex* tri = (TrigramIndex*)index_alloc(index, sizeof(TrigramIndex));
+    if (!tri) { return false; }
+    memset(tri, 0, sizeof(TrigramIndex));
+
+    // Put all of the nodes in order and count the trigrams of each bucket
+    NodeList list = { NULL, 0, 0 };
+    if (!trigram_collect(index, index->root, &list)) { free(list.nodes); return false; }
+    TrigramWork work;
+    memset(&work, 0, sizeof(TrigramWork));
+    for (uint32_t i = 0; i < list.count; i++) {
+        const char* name = list.nodes[i]->name;
+        for (size_t j = 0; name[j] && name[j+1] && name[j+2]; j++) { work.starts[(uint8_t)name[j] + 1]++; }
+    }
+    for (size_t b = 0; b < TRIGRAM_BUCKETS; b++) { work.starts[b+1] += work.starts[b]; }
+
+    // Fill in the buckets then sort them on several threads
+    uint64_t npairs = work.starts[TRIGRAM_BUCKETS];
+    uint64_t fill[TRIGRAM_BUCKETS];
+    memcpy(fill, work.starts, sizeof(fill));
+    if (!(work.pairs = (uint64_t*)malloc((npairs ? npairs : 1) * sizeof(uint64_t)))) { free(list.nodes); return false; }
+    for (uint32_t i = 0; i < list.count; i++) {
+        const char* name = list.nodes[i]->name;
+        for (size_t j = 0; name[j] && name[j+1] && name[j+2]; j++) {
+            work.pairs[fill[(uint8_t)name[j]]++] = ((uint64_t)trigram_at(name + j) << 32) | i;
+        }
+    }
+    index_parallel(index, TRIGRAM_BUCKETS, trigram_worker, &work);
+
+    // Count the different trigrams and postings (names with the same trigram twice are only listed once)
+    uint64_t npostings = 0;
+    for (uint64_t i = 0; i < npairs; i++) {
+        if (i > 0 && work.pairs[i] == work.pairs[i-1]) { continue; }
+        if (i == 0 || (work.pairs[i] >> 32) != (work.pairs[i-1] >> 32)) { tri->ntrigrams++; }
+        npostings++;
+    }
+
+    // Copy everything into the index memory
+    tri->nnodes = list.count;
+    tri->nodes = (const Node**)index_alloc(index, (list.count ? list.count : 1) * sizeof(Node*));
+    tri->trigrams = (uint32_t*)index_alloc(index, (tri->ntrigrams ? tri->ntrigrams : 1) * sizeof(uint32_t));
+    tri->starts = (uint32_t*)index_alloc(index, (tri->ntrigrams + 1) * sizeof(uint32_t));
+    tri->postings = (uint32_t*)index_alloc(index, (npostings ? npostings : 1) * sizeof(uint32_t));
+    if (!tri->nodes || !tri->trigrams || !tri->starts || !tri->postings) { free(work.pairs); free(list.nodes); return false; }
+    memcpy(tri->nodes, list.nodes, list.count * sizeof(Node*));
+    uint32_t t = 0, p = 0;
+    for (uint64_t i = 0; i < npairs; i++) {
+        if (i > 0 && work.pairs[i] == work.pairs[i-1]) { continue; }
+        if (i == 0 || (work.pairs[i] >> 32) != (work.pairs[i-1] >> 32)) {
+            tri->trigrams[t] = (uint32_t)(work.pairs[i] >> 32);
+            tri->starts[t++] = p;
+        }
+        tri->postings[p++] = (uint32_t)work.pairs[i];
+    }
+    tri->starts[t] = p;
+    free(work.pairs);
+    free(list.nodes);
+
+    tri->memory = sizeof(TrigramIndex) + list.count * sizeof(Node*) + (2 * tri->ntrigrams + 1 + npostings) * sizeof(uint32_t);
+    index->trigrams = tri;
+    return true;
+}
+
+/**
+ * Finds the positions of the nodes whose names have all of the trigrams of a string (which must be
+ * at least 3 characters long), in order. These are the ones that might contain the string, they
+ * still need to be checked. Returns a list that must be freed, or NULL if out of memory.
+ */
+uint32_t* trigram_candidates(const TrigramIndex* tri, const char* str, uint32_t* count)
+{
+    uint32_t* candidates = NULL;
+    *count = 0;
+    for (size_t i = 0; str[i] && str[i+1] && str[i+2]; i++) {
+        // Find the nodes with this trigram
+        uint32_t trigram = trigram_at(str + i), low = 0, high = tri->ntrigrams;
+        while (low < high) {
+            uint32_t mid = (low + high) / 2;
+            if (tri->trigrams[mid] < trigram) { low = mid + 1; } else { high = mid; }
+        }
+        if (low == tri->ntrigrams || tri->trigrams[low] != trigram) { *count = 0; break; }
+        const uint32_t* postings = tri->postings + tri->starts[low];
+        uint32_t npostings = tri->starts[low+1] - tri->starts[low];
+
+        // Keep the candidates that are in both lists
+        if (!candidates) {
+            if (!(candidates = (uint32_t*)malloc((npostings ? npostings : 1) * sizeof(uint32_t)))) { return NULL; }
+            memcpy(candidates, postings, npostings * sizeof(uint32_t));
+            *count = npostings;
+            continue;
+        }
+        uint32_t kept = 0;
+        for (uint32_t a = 0, b = 0; a < *count && b < npostings; ) {
+            if (candidates[a] < postings[b]) { a++; }
+            else if (candidates[a] > postings[b]) { b++; }
+            else { candidates[kept++] = candidates[a]; a++; b++; }
+        }
+        if ((*count = kept) == 0) { break; }
+    }
+    if (!candidates) { candidates = (uint32_t*)malloc(sizeof(uint32_t)); }
+    return candidates;
+}
@@ -0,0 +1,582 @@
+/**
+ * Read-only support for the UDF filesystem (ECMA-167 as profiled by OSTA UDF 1.02 through 2.60)
+ * that is stored alongside ISO-9660 on bridge images like DVDs. The UDF structures have the real
+ * sizes of files larger than 4 GiB and their full Unicode names, so when they are present they are
+ * used to build the index instead of the ISO-9660 records.
+ *
+ * Physical (type 1), sparable, and metadata (UDF 2.50+) partitions are supported. Sparing tables
+ * are not applied since they only matter for rewritable discs that have had sectors remapped.
+ * Virtual (VAT) partitions used by multi-session CD-Rs are not supported and such images fall back
+ * to ISO-9660.
+ *
+ * All structures are read through the same iso_ptr()/iso_fetch()/iso_read() functions as ISO-9660
+ * so they work with every image format, with the block cache, and with windowed mapping.
+ */
+
+#include <stddef.h>
+#include <unistd.h>
+
+// Descriptor tag identifiers
+#define UDF_TAG_PVD   1   // Primary Volume Descriptor
+#define UDF_TAG_AVDP  2   // Anchor Volume Descriptor Pointer
+#define UDF_TAG_VDP   3   // Volume Descriptor Pointer
+#define UDF_TAG_PD    5   // Partition Descriptor
+#define UDF_TAG_LVD   6   // Logical Volume Descriptor
+#define UDF_TAG_TD    8   // Terminating Descriptor
+#define UDF_TAG_FSD   256 // File Set Descriptor
+#define UDF_TAG_FID   257 // File Identifier Descriptor
+#define UDF_TAG_AED   258 // Allocation Extent Descriptor
+#define UDF_TAG_FE    261 // File Entry
+#define UDF_TAG_EFE   266 // Extended File Entry
+
+// ICB file types
+#define UDF_FILE_TYPE_DIRECTORY 4
+#define UDF_FILE_TYPE_REGULAR   5
+#define UDF_FILE_TYPE_BLOCK     6
+#define UDF_FILE_TYPE_CHAR      7
+#define UDF_FILE_TYPE_FIFO      9
+#define UDF_FILE_TYPE_SOCKET    10
+#define UDF_FILE_TYPE_SYMLINK   12
+
+// ICB allocation descriptor types (the low 3 bits of the ICB tag flags)
+#define UDF_AD_SHORT  0
+#define UDF_AD_LONG   1
+#define UDF_AD_EXT    2
+#define UDF_AD_IN_ICB 3
+
+// Extent types (the high 2 bits of the extent length)
+#define UDF_EXTENT_RECORDED     0
+#define UDF_EXTENT_ALLOCATED    1 // allocated but not recorded, reads as zeros
+#define UDF_EXTENT_UNALLOCATED  2 // reads as zeros
+#define UDF_EXTENT_CONTINUATION 3 // the next extent of allocation descriptors
+
+// File characteristics of a File Identifier Descriptor
+#define UDF_FID_HIDDEN    0x01
+#define UDF_FID_DIRECTORY 0x02
+#define UDF_FID_DELETED   0x04
+#define UDF_FID_PARENT    0x08
+
+#define UDF_MAX_PARTITION_MAPS 8
+#define UDF_MAX_EXTENTS        (1<<20) // stops reading extents of corrupt files with loops
+
+typedef struct PACKED _udf_tag {
+    uint16_t id;
+    uint16_t version;
+    uint8_t checksum; // sum of all other bytes in the tag
+    uint8_t _reserved;
+    uint16_t serial;
+    uint16_t crc;
+    uint16_t crc_length;
+    uint32_t location;
+} udf_tag;
+
+typedef struct PACKED _udf_extent_ad {
+    uint32_t length;
+    uint32_t location;
+} udf_extent_ad;
+
+typedef struct PACKED _udf_short_ad {
+    uint32_t length; // high 2 bits are the extent type
+    uint32_t position;
+} udf_short_ad;
+
+typedef struct PACKED _udf_long_ad {
+    uint32_t length; // high 2 bits are the extent type
+    uint32_t block;
+    uint16_t partition;
+    uint8_t _impl_use[6];
+} udf_long_ad;
+
+typedef struct PACKED _udf_timestamp {
+    uint16_t type_and_timezone;
+    int16_t year;
+    uint8_t month, day, hour, minute, second;
+    uint8_t centiseconds, hundreds_of_microseconds, microseconds;
+} udf_timestamp;
+
+typedef struct PACKED _udf_icbtag {
+    uint32_t prior_entries;
+    uint16_t strategy_type;
+    uint16_t strategy_parameter;
+    uint16_t max_entries;
+    uint8_t _reserved;
+    uint8_t file_type; // one of UDF_FILE_TYPE_*
+    uint8_t parent[6];
+    uint16_t flags; // low 3 bits are one of UDF_AD_*
+} udf_icbtag;
+
+typedef struct PACKED _udf_file_entry { // File Entry and the start of an Extended File Entry
+    udf_tag tag;
+    udf_icbtag icbtag;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t permissions;
+    uint16_t link_count;
+    uint8_t record_format;
+    uint8_t record_display_attributes;
+    uint32_t record_length;
+    uint64_t information_length;
+    union {
+        struct PACKED { // UDF_TAG_FE
+            uint64_t blocks_recorded;
+            udf_timestamp access, modification, attribute;
+            uint32_t checkpoint;
+            udf_long_ad ea_icb;
+            uint8_t impl_id[32];
+            uint64_t unique_id;
+            uint32_t ea_length;
+            uint32_t ad_length;
+            uint8_t data[0]; // extended attributes then allocation descriptors
+        } fe;
+        struct PACKED { // UDF_TAG_EFE
+            uint64_t object_size;
+            uint64_t blocks_recorded;
+            udf_timestamp access, modification, creation, attribute;
+            uint32_t checkpoint;
+            uint32_t _reserved;
+            udf_long_ad ea_icb;
+            udf_long_ad stream_icb;
+            uint8_t impl_id[32];
+            uint64_t unique_id;
+            uint32_t ea_length;
+            uint32_t ad_length;
+            uint8_t data[0]; // extended attributes then allocation descriptors
+        } efe;
+    };
+} udf_file_entry;
+
+typedef struct PACKED _udf_fid {
+    udf_tag tag;
+    uint16_t version;
+    uint8_t characteristics; // combination of UDF_FID_*
+    uint8_t name_length;
+    udf_long_ad icb;
+    uint16_t impl_use_length;
+    uint8_t data[0]; // implementation use then the name, padded to a multiple of 4 bytes
+} udf_fid;
+
+typedef struct _UDFMap {
+    bool metadata;        // if this is a metadata partition (otherwise it is a physical partition)
+    uint16_t number;      // partition number
+    uint32_t start;       // first sector of the partition
+    Extent* extents;      // for metadata partitions, the extents of the metadata file
+    uint32_t nextents;
+} UDFMap;
+
+typedef struct _UDF {
+    Index* index;
+    const ISO* iso;
+    uint32_t nmaps;
+    UDFMap maps[UDF_MAX_PARTITION_MAPS];
+} UDF;
+
+/**
+ * Read little-endian numbers from descriptors where they are not necessarily aligned.
+ */
+static inline uint16_t udf_u16(const uint8_t* data) { uint16_t value; memcpy(&value, data, 2); return value; }
+static inline uint32_t udf_u32(const uint8_t* data) { uint32_t value; memcpy(&value, data, 4); return value; }
+
+/**
+ * Gets a descriptor with a valid tag at the given logical byte offset, returning NULL if there
+ * isn't one there.
+ */
+static const udf_tag* udf_get_tag(const ISO* iso, uint64_t offset, uint16_t id)
+{
+    if (!iso_fetch(iso, offset, ISO_SECTOR_SIZE)) { return NULL; }
+    const uint8_t* data = iso_ptr(iso, offset);
+    uint8_t sum = 0;
+    for (int i = 0; i < 16; i++) { if (i != 4) { sum += data[i]; } }
+    const udf_tag* tag = (const udf_tag*)data;
+    return (sum == tag->checksum && tag->id == id) ? tag : NULL;
+}
+
+/**
+ * Checks if the ISO has a UDF Volume Recognition Sequence (with an NSR02 or NSR03 descriptor).
+ */
+bool udf_detect(const ISO* iso)
+{
+    for (size_t sector = 16; sector < 16 + 64; sector++) {
+        size_t offset = sector * ISO_SECTOR_SIZE;
+        if (!iso_fetch(iso, offset, sizeof(VolumeDescriptor))) { return false; }
+        const VolumeDescriptor* descr = (const VolumeDescriptor*)iso_ptr(iso, offset);
+        if (memcmp(descr->id, "NSR02", 5) == 0 || memcmp(descr->id, "NSR03", 5) == 0) { return true; }
+        if (memcmp(descr->id, "TEA01", 5) == 0) { break; }
+    }
+    return false;
+}
+
+/**
+ * Gets the logical byte offset of a logical block in a partition.
+ */
+static bool udf_block_offset(const UDF* udf, uint16_t partition, uint32_t block, uint64_t* offset)
+{
+    if (partition >= udf->nmaps) { return false; }
+    const UDFMap* map = &udf->maps[partition];
+    if (map->metadata) {
+        // Find the block in the metadata file, its extents are in the physical partition
+        uint64_t position = (uint64_t)block * ISO_SECTOR_SIZE;
+        for (uint32_t i = 0; i < map->nextents; i++) {
+            if (position < map->extents[i].length) {
+                if (map->extents[i].start == EXTENT_HOLE) { return false; }
+                *offset = map->extents[i].start + position;
+                return true;
+            }
+            position -= map->extents[i].length;
+        }
+        return false;
+    }
+    *offset = ((uint64_t)map->start + block) * ISO_SECTOR_SIZE;
+    return true;
+}
+
+/**
+ * Converts a UDF timestamp to a POSIX time_t value. The low 12 bits of type_and_timezone are the
+ * offset of the time from UTC in minutes (signed), or -2047 if it isn't known (taken as UTC).
+ */
+static time_t udf_convert_timestamp(const udf_timestamp* ts)
+{
+    struct tm time = {
+        .tm_year=ts->year-1900,
+        .tm_mon=ts->month-1,
+        .tm_mday=ts->day,
+        .tm_hour=ts->hour,
+        .tm_min=ts->minute,
+        .tm_sec=ts->second,
+    };
+    int offset = ts->type_and_timezone & 0xFFF;
+    if (offset & 0x800) { offset -= 0x1000; }
+    if (offset < -1440 || offset > 1440) { offset = 0; }
+    return timegm(&time) - (time_t)offset * 60;
+}
+
+/**
+ * Converts an OSTA Compressed Unicode string (d-characters) to UTF-8. The result is truncated to
+ * 255 bytes (without splitting a character) since that is the longest filename allowed.
+ */
+static void udf_decode_name(const uint8_t* data, size_t length, char name[256])
+{
+    size_t out = 0;
+    if (length > 0) {
+        uint8_t compression = data[0];
+        bool wide = compression == 16 || compression == 255;
+        for (size_t i = 1; i + (wide ? 1 : 0) < length; i += wide ? 2 : 1) {
+            uint32_t c = wide ? (data[i] << 8 | data[i+1]) : data[i];
+            if (wide && c >= 0xD800 && c < 0xDC00 && i + 3 < length) {
+                // UTF-16 surrogate pair
+                uint32_t low = data[i+2] << 8 | data[i+3];
+                if (low >= 0xDC00 && low < 0xE000) { c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00); i += 2; }
+            }
+            char utf8[4];
+            size_t n;
+            if (c < 0x80) { utf8[0] = c; n = 1; }
+            else if (c < 0x800) { utf8[0] = 0xC0 | c >> 6; utf8[1] = 0x80 | (c & 0x3F); n = 2; }
+            else if (c < 0x10000) { utf8[0] = 0xE0 | c >> 12; utf8[1] = 0x80 | ((c >> 6) & 0x3F); utf8[2] = 0x80 | (c & 0x3F); n = 3; }
+            else { utf8[0] = 0xF0 | c >> 18; utf8[1] = 0x80 | ((c >> 12) & 0x3F); utf8[2] = 0x80 | ((c >> 6) & 0x3F); utf8[3] = 0x80 | (c & 0x3F); n = 4; }
+            if (c == 0 || c == '/' || out + n > 255) { break; }
+            memcpy(name + out, utf8, n);
+            out += n;
+        }
+    }
+    name[out] = 0;
+}
+
+/**
+ * A growable array of extents used while reading allocation descriptors.
+ */
+typedef struct _ExtentList {
+    Extent* extents;
+    uint32_t count, capacity;
+} ExtentList;
+
+static bool extent_list_add(ExtentList* list, uint64_t start, uint64_t length)
+{
+    if (list->count == list->capacity) {
+        if (list->capacity >= UDF_MAX_EXTENTS) { errno = EINVAL; return false; }
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 4;
+        Extent* extents = (Extent*)realloc(list->extents, capacity * sizeof(Extent));
+        if (!extents) { return false; }
+        list->extents = extents;
+        list->capacity = capacity;
+    }
+    list->extents[list->count].start = start;
+    list->extents[list->count].length = length;
+    list->extents[list->count].unit = list->extents[list->count].stride = 0;
+    list->extents[list->count].volume = 0;
+    list->count++;
+    return true;
+}
+
+/**
+ * Reads the allocation descriptors of a file entry into a list of extents, following allocation
+ * extent descriptors as needed. The file entry is at the logical byte `offset` and is in the given
+ * partition (which short allocation descriptors are relative to). The extents are cut off at the
+ * size of the file.
+ */
+static bool udf_read_extents(const UDF* udf, const udf_file_entry* fe, uint64_t offset, uint16_t partition, ExtentList* list)
+{
+    bool extended = fe->tag.id == UDF_TAG_EFE;
+    uint32_t ea_length = extended ? fe->efe.ea_length : fe->fe.ea_length;
+    uint32_t ad_length = extended ? fe->efe.ad_length : fe->fe.ad_length;
+    size_t header = extended ? offsetof(udf_file_entry, efe.data) : offsetof(udf_file_entry, fe.data);
+    if (header + ea_length + ad_length > ISO_SECTOR_SIZE) { errno = EINVAL; return false; }
+    uint64_t ad_offset = offset + header + ea_length;
+    uint64_t remaining = fe->information_length;
+    int type = fe->icbtag.flags & 7;
+
+    // The data is right in the file entry
+    if (type == UDF_AD_IN_ICB) {
+        if (ad_length < remaining) { errno = EINVAL; return false; }
+        return remaining == 0 || extent_list_add(list, ad_offset, remaining);
+    }
+    if (type != UDF_AD_SHORT && type != UDF_AD_LONG) { errno = ENOTSUP; return false; }
+    size_t ad_size = type == UDF_AD_SHORT ? sizeof(udf_short_ad) : sizeof(udf_long_ad);
+
+    const uint8_t* ads = (const uint8_t*)fe + header + ea_length;
+    size_t pos = 0;
+    while (remaining > 0 && pos + ad_size <= ad_length) {
+        uint32_t length, block;
+        uint16_t ad_partition = partition;
+        if (type == UDF_AD_SHORT) {
+            const udf_short_ad* ad = (const udf_short_ad*)(ads + pos);
+            length = ad->length; block = ad->position;
+        } else {
+            const udf_long_ad* ad = (const udf_long_ad*)(ads + pos);
+            length = ad->length; block = ad->block; ad_partition = ad->partition;
+        }
+        pos += ad_size;
+        uint32_t extent_type = length >> 30;
+        length &= 0x3FFFFFFF;
+        if (length == 0) { break; }
+
+        uint64_t start;
+        if (extent_type == UDF_EXTENT_CONTINUATION) {
+            // Continue with the descriptors in an Allocation Extent Descriptor
+            const udf_tag* aed;
+            if (!udf_block_offset(udf, ad_partition, block, &start) || !(aed = udf_get_tag(udf->iso, start, UDF_TAG_AED))) { errno = EINVAL; return false; }
+            ads = (const uint8_t*)aed + sizeof(udf_tag) + 8;
+            ad_length = udf_u32((const uint8_t*)aed + sizeof(udf_tag) + 4);
+            if (ad_length > ISO_SECTOR_SIZE - sizeof(udf_tag) - 8) { errno = EINVAL; return false; }
+            pos = 0;
+            continue;
+        }
+        if (length > remaining) { length = remaining; }
+        if (extent_type == UDF_EXTENT_RECORDED) {
+            if (!udf_block_offset(udf, ad_partition, block, &start)) { errno = EINVAL; return false; }
+        } else { start = EXTENT_HOLE; }
+        if (!extent_list_add(list, start, length)) { return false; }
+        remaining -= length;
+    }
+    return true;
+}
+
+/**
+ * Gets the file entry (or extended file entry) described by a long allocation descriptor, also
+ * giving its logical byte offset.
+ */
+static const udf_file_entry* udf_get_file_entry(const UDF* udf, const udf_long_ad* icb, uint64_t* offset)
+{
+    if (!udf_block_offset(udf, icb->partition, icb->block, offset)) { return NULL; }
+    const udf_tag* tag = udf_get_tag(udf->iso, *offset, UDF_TAG_FE);
+    if (!tag) { tag = udf_get_tag(udf->iso, *offset, UDF_TAG_EFE); }
+    return (const udf_file_entry*)tag;
+}
+
+/**
+ * Fills in the attributes of a node from a file entry.
+ */
+static void udf_attributes(Node* node, const udf_file_entry* fe)
+{
+    bool extended = fe->tag.id == UDF_TAG_EFE;
+    uint32_t p = fe->permissions;
+    node->mode = (p & 7) | ((p >> 5) & 7) << 3 | ((p >> 10) & 7) << 6; // other, group, and owner rwx
+    switch (fe->icbtag.file_type) {
+        case UDF_FILE_TYPE_DIRECTORY: node->mode |= S_IFDIR; break;
+        case UDF_FILE_TYPE_SYMLINK: node->mode |= S_IFLNK; break;
+        case UDF_FILE_TYPE_BLOCK: node->mode |= S_IFBLK; break;
+        case UDF_FILE_TYPE_CHAR: node->mode |= S_IFCHR; break;
+        case UDF_FILE_TYPE_FIFO: node->mode |= S_IFIFO; break;
+        case UDF_FILE_TYPE_SOCKET: node->mode |= S_IFSOCK; break;
+        default: node->mode |= S_IFREG; break;
+    }
+    node->nlink = fe->link_count ? fe->link_count : 1;
+    node->uid = fe->uid == UINT32_MAX ? getuid() : fe->uid;
+    node->gid = fe->gid == UINT32_MAX ? getgid() : fe->gid;
+    node->size = fe->information_length;
+    node->mtime = udf_convert_timestamp(extended ? &fe->efe.modification : &fe->fe.modification);
+    node->atime = udf_convert_timestamp(extended ? &fe->efe.access : &fe->fe.access);
+    node->ctime = udf_convert_timestamp(extended ? &fe->efe.attribute : &fe->fe.attribute);
+}
+
+/**
+ * Adds all of the files in a directory to the index as children of the directory node, recursing
+ * into subdirectories. The directory's data is given as its list of extents.
+ */
+static bool udf_index_directory(UDF* udf, Node* dir, const Extent* extents, uint32_t nextents, int depth)
+{
+    if (depth > 255) { errno = ELOOP; return false; }
+
+    // File Identifier Descriptors can cross sector boundaries so the directory is read into memory
+    size_t size = 0;
+    for (uint32_t i = 0; i < nextents; i++) { size += extents[i].length; }
+    uint8_t* data = (uint8_t*)malloc(size ? size : 1);
+    if (!data) { return false; }
+    size_t pos = 0;
+    for (uint32_t i = 0; i < nextents; i++) {
+        if (extents[i].start == EXTENT_HOLE) { memset(data + pos, 0, extents[i].length); }
+        else if (!iso_read(udf->iso, data + pos, extents[i].start, extents[i].length)) { free(data); return false; }
+        pos += extents[i].length;
+    }
+
+    NodeList children = { NULL, 0, 0 };
+    ExtentList list = { NULL, 0, 0 };
+    bool okay = true;
+    pos = 0;
+    while (okay && pos + sizeof(udf_fid) <= size) {
+        iso_unpin(udf->iso); // nothing from the previous file entry (or subdirectories) is used anymore
+        const udf_fid* fid = (const udf_fid*)(data + pos);
+        size_t length = (sizeof(udf_fid) + fid->impl_use_length + fid->name_length + 3) & ~3;
+        if (fid->tag.id != UDF_TAG_FID || pos + length > size) { break; }
+        pos += length;
+        if (fid->characteristics & (UDF_FID_DELETED | UDF_FID_PARENT)) { continue; }
+
+        // Get the file entry of the file
+        char name[256];
+        udf_decode_name(fid->data + fid->impl_use_length, fid->name_length, name);
+        uint64_t offset;
+        const udf_file_entry* fe = udf_get_file_entry(udf, &fid->icb, &offset);
+        if (!name[0] || !fe) { continue; } // skip files we can't make sense of
+
+        // Add the file and its extents
+        Node* node = index_new_node(udf->index, dir, name);
+        if (!node || !node_list_add(&children, node)) { okay = false; break; }
+        udf_attributes(node, fe);
+        list.count = 0;
+        okay = udf_read_extents(udf, fe, offset, fid->icb.partition, &list);
+        if (okay && S_ISDIR(node->mode)) {
+            okay = udf_index_directory(udf, node, list.extents, list.count, depth + 1);
+        } else if (okay) {
+            okay = index_set_extents(udf->index, node, list.extents, list.count);
+        }
+    }
+
+    okay = okay && index_set_children(udf->index, dir, children.nodes, children.count);
+    free(children.nodes);
+    free(list.extents);
+    free(data);
+    return okay;
+}
+
+/**
+ * Reads the partition maps from a Logical Volume Descriptor, using the given partition descriptors
+ * to find where the partitions start.
+ */
+static bool udf_read_partition_maps(UDF* udf, const uint8_t* lvd, const uint8_t* pds[], int npds)
+{
+    uint32_t table_length = udf_u32(lvd + 264);
+    uint32_t count = udf_u32(lvd + 268);
+    if (440 + table_length > ISO_SECTOR_SIZE || count > UDF_MAX_PARTITION_MAPS) { return false; }
+    const uint8_t* map = lvd + 440;
+    const uint8_t* end = map + table_length;
+    uint32_t metadata_locations[UDF_MAX_PARTITION_MAPS];
+    for (udf->nmaps = 0; udf->nmaps < count && map + 2 <= end && map[1] >= 2 && map + map[1] <= end; udf->nmaps++, map += map[1]) {
+        UDFMap* m = &udf->maps[udf->nmaps];
+        m->metadata = false;
+        if (map[0] == 1 && map[1] == 6) {
+            m->number = udf_u16(map + 4);
+        } else if (map[0] == 2 && map[1] == 64) {
+            const char* id = (const char*)map + 5;
+            m->number = udf_u16(map + 38);
+            if (strncmp(id, "*UDF Metadata Partition", 23) == 0) {
+                m->metadata = true;
+                metadata_locations[udf->nmaps] = udf_u32(map + 40);
+            } else if (strncmp(id, "*UDF Sparable Partition", 23) != 0) { return false; } // VAT or unknown
+        } else { return false; }
+
+        // Find where the partition starts
+        int i;
+        for (i = 0; i < npds && udf_u16(pds[i] + 22) != m->number; i++) { }
+        if (i == npds) { return false; }
+        m->start = udf_u32(pds[i] + 188);
+    }
+
+    // The metadata file of a metadata partition is in the physical partition with the same number
+    for (uint32_t i = 0; i < udf->nmaps; i++) {
+        if (!udf->maps[i].metadata) { continue; }
+        uint32_t physical;
+        for (physical = 0; physical < udf->nmaps && (udf->maps[physical].metadata || udf->maps[physical].number != udf->maps[i].number); physical++) { }
+        if (physical == udf->nmaps) { return false; }
+        udf_long_ad icb = { 0, metadata_locations[i], (uint16_t)physical, { 0 } };
+        uint64_t offset;
+        const udf_file_entry* fe = udf_get_file_entry(udf, &icb, &offset);
+        ExtentList list = { NULL, 0, 0 };
+        if (!fe || !udf_read_extents(udf, fe, offset, physical, &list)) { free(list.extents); return false; }
+        udf->maps[i].extents = list.extents;
+        udf->maps[i].nextents = list.count;
+    }
+    return udf->nmaps > 0;
+}
+
+/**
+ * Builds the index from the UDF filesystem of the ISO. Returns NULL if there is a problem or the
+ * UDF filesystem uses features that aren't supported, with errno set.
+ */
+Index* build_udf_index(const ISO* iso)
+{
+    UDF udf = { NULL, iso, 0, { { 0 } } };
+    Index* index = NULL;
+    errno = EINVAL;
+
+    // Find the Anchor Volume Descriptor Pointer, it is usually at sector 256 but could be at the end
+    size_t nsectors = iso_data_size(iso) / ISO_SECTOR_SIZE;
+    size_t anchors[] = { 256, nsectors - 1, nsectors - 257 };
+    const udf_tag* avdp = NULL;
+    for (int i = 0; i < 3 && !avdp; i++) {
+        if (anchors[i] < nsectors) { avdp = udf_get_tag(iso, (uint64_t)anchors[i] * ISO_SECTOR_SIZE, UDF_TAG_AVDP); }
+    }
+    if (!avdp) { return NULL; }
+
+    // Go through the Main Volume Descriptor Sequence getting the Partition Descriptors and the
+    // Logical Volume Descriptor
+    const udf_extent_ad* vds = (const udf_extent_ad*)((const uint8_t*)avdp + 16);
+    const uint8_t* pds[UDF_MAX_PARTITION_MAPS];
+    const uint8_t* lvd = NULL;
+    int npds = 0;
+    for (uint32_t i = 0; i < vds->length / ISO_SECTOR_SIZE; i++) {
+        uint64_t offset = ((uint64_t)vds->location + i) * ISO_SECTOR_SIZE;
+        const udf_tag* tag = udf_get_tag(iso, offset, UDF_TAG_PD);
+        if (tag && npds < UDF_MAX_PARTITION_MAPS) { pds[npds++] = (const uint8_t*)tag; continue; }
+        if (!lvd && (tag = udf_get_tag(iso, offset, UDF_TAG_LVD))) { lvd = (const uint8_t*)tag; continue; }
+        if (udf_get_tag(iso, offset, UDF_TAG_TD)) { break; }
+    }
+    if (!lvd || npds == 0 || udf_u32(lvd + 212) != ISO_SECTOR_SIZE) { return NULL; }
+    if (!udf_read_partition_maps(&udf, lvd, pds, npds)) { errno = ENOTSUP; goto done; }
+
+    // The File Set Descriptor is given in the Logical Volume Descriptor and has the root directory
+    const udf_long_ad* fsd_ad = (const udf_long_ad*)(lvd + 248);
+    uint64_t offset;
+    const udf_tag* fsd;
+    if (!udf_block_offset(&udf, fsd_ad->partition, fsd_ad->block, &offset) || !(fsd = udf_get_tag(iso, offset, UDF_TAG_FSD))) { errno = EINVAL; goto done; }
+    const udf_long_ad* root_icb = (const udf_long_ad*)((const uint8_t*)fsd + 400);
+    const udf_file_entry* root_fe = udf_get_file_entry(&udf, root_icb, &offset);
+    if (!root_fe || root_fe->icbtag.file_type != UDF_FILE_TYPE_DIRECTORY) { errno = EINVAL; goto done; }
+
+    // Build the index starting from the root directory
+    if (!(udf.index = index = new_index(iso, "UDF")) || !(index->root = index_new_node(index, NULL, ""))) { goto fail; }
+    udf_attributes(index->root, root_fe);
+    ExtentList list = { NULL, 0, 0 };
+    bool okay = udf_read_extents(&udf, root_fe, offset, root_icb->partition, &list) &&
+                udf_index_directory(&udf, index->root, list.extents, list.count, 0);
+    free(list.extents);
+    if (okay) { goto done; }
+
+fail:
+    if (index) {
+        int error = errno;
+        free_index(index);
+        errno = error;
+        index = NULL;
+    }
+done:
+    for (uint32_t i = 0; i < udf.nmaps; i++) { free(udf.maps[i].extents); }
+    return index;
+}
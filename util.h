@@ -9,6 +9,9 @@
 #include <stdbool.h>
 #include <time.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 /**
  * Represents an ISO file loaded from disk.
@@ -16,10 +19,191 @@
 typedef struct _ISO {
     int fd; // file descriptor of the ISO file, this is the value returned by open()
     uint8_t* raw; // the is the actual data in memory, the pointer is as returned by mmap()
-    size_t size; // size of the file (and the memory), obtained with fstat on the file descriptor
+    uint64_t size; // size of the file (and the memory), obtained with fstat on the file descriptor
     PrimaryVolumeDescriptor* pvd; // the primary description of the ISO volume
+    PrimaryVolumeDescriptor* evd; // the enhanced volume descriptor (same layout as the pvd) or NULL
+    bool rock_ridge;   // if the records have SUSP and Rock Ridge data, see detect_rock_ridge()
+    uint8_t susp_skip; // bytes to skip at the start of the system use area of each record
+    // The layout of sectors in the file, plain ISO images are just ISO_SECTOR_SIZE bytes of data
+    // but raw CD images also include sync, header, and error correction data in each sector
+    size_t sector_size;   // bytes per sector in the file
+    size_t sector_offset; // bytes in each sector before the user data
+    uint32_t track_start; // sector of the file the image starts at (for a data track after others)
+    // Makes sure a range of the raw data is present before it is read, NULL if it always is
+    bool (*fetch)(const struct _ISO* iso, uint64_t offset, uint64_t length);
+    void* fetch_data; // extra data used by the fetch function (such as a BlockCache)
+    // When the image is too large to map all at once, raw is NULL and windows of it are mapped on
+    // demand instead. map gets a pointer to the raw data at an offset that is valid for at least
+    // *available bytes. If ref is NULL the window is pinned until iso_unpin(), otherwise the window
+    // is held until *ref is given to release. Giving release NULL unpins all of the windows.
+    const uint8_t* (*map)(const struct _ISO* iso, uint64_t offset, size_t* available, void** ref);
+    void (*release)(const struct _ISO* iso, void* ref);
+    void* map_data; // extra data used by the map and release functions (such as MapWindows)
 } ISO;
 
+/**
+ * Converts a logical byte offset in the ISO (as if it only had the user data of each sector) to
+ * the offset in the ISO memory.
+ */
+static inline uint64_t iso_offset(const ISO* iso, uint64_t offset)
+{
+    if (iso->sector_size == ISO_SECTOR_SIZE) { return (uint64_t)iso->track_start * ISO_SECTOR_SIZE + offset; }
+    return (iso->track_start + offset / ISO_SECTOR_SIZE) * iso->sector_size + iso->sector_offset + offset % ISO_SECTOR_SIZE;
+}
+
+/**
+ * Gets the number of bytes of user data in the ISO, which is less than its size for raw CD images
+ * and for images that start at a later track.
+ */
+static inline uint64_t iso_data_size(const ISO* iso)
+{
+    uint64_t start = (uint64_t)iso->track_start * iso->sector_size;
+    if (start >= iso->size) { return 0; }
+    return iso->sector_size == ISO_SECTOR_SIZE ? iso->size - start : ((iso->size - start) / iso->sector_size) * ISO_SECTOR_SIZE;
+}
+
+/**
+ * Gets a pointer to the data at a logical byte offset in the ISO. The data is only guaranteed to be
+ * contiguous until the end of the sector (ISO-9660 structures like records never cross sectors).
+ * When the image is mapped in windows the data must have been fetched with iso_fetch() and the
+ * pointer can only be used until iso_unpin() is called.
+ */
+static inline const uint8_t* iso_ptr(const ISO* iso, uint64_t offset)
+{
+    size_t available;
+    if (!iso->raw) { return iso->map(iso, iso_offset(iso, offset), &available, NULL); }
+    return iso->raw + iso_offset(iso, offset);
+}
+
+/**
+ * Unpins all of the windows of an image mapped in windows, after which pointers from iso_ptr()
+ * cannot be used anymore. Does nothing when the image is all mapped at once.
+ */
+static inline void iso_unpin(const ISO* iso)
+{
+    if (!iso->raw && iso->release) { iso->release(iso, NULL); }
+}
+
+/**
+ * Makes sure that `length` bytes of the ISO memory starting at the raw `offset` are available to
+ * be read. Images that are entirely available (like a local file) always succeed. Otherwise the
+ * data is obtained with the fetch function of the ISO. Returns false if the range is outside of
+ * the ISO or cannot be obtained, with errno set appropriately.
+ */
+static inline bool iso_available(const ISO* iso, uint64_t offset, uint64_t length)
+{
+    if (offset > iso->size || length > iso->size - offset) { errno = EINVAL; return false; }
+    return !iso->fetch || iso->fetch(iso, offset, length);
+}
+
+/**
+ * Same as iso_available() but also makes sure the memory is mapped so that iso_ptr() can be used
+ * for it. For images mapped in windows the windows stay pinned until iso_unpin() is called.
+ */
+static inline bool iso_fetch_raw(const ISO* iso, uint64_t offset, uint64_t length)
+{
+    if (!iso_available(iso, offset, length)) { return false; }
+    for (uint64_t end = offset + length; !iso->raw && offset < end;) {
+        size_t available;
+        if (!iso->map(iso, offset, &available, NULL)) { return false; }
+        offset += available;
+    }
+    return true;
+}
+
+/**
+ * Same as iso_fetch_raw() except that it takes a logical byte offset and length.
+ */
+static inline bool iso_fetch(const ISO* iso, uint64_t offset, uint64_t length)
+{
+    if (length == 0) { return iso_fetch_raw(iso, iso_offset(iso, offset), 0); }
+    uint64_t start = iso_offset(iso, offset);
+    uint64_t end = iso_offset(iso, offset + length - 1) + 1;
+    return iso_fetch_raw(iso, start, end - start);
+}
+
+/**
+ * Copies `length` bytes starting at the logical byte `offset` of the ISO into `buf`, fetching them
+ * first if needed. When the user data of the image is contiguous and all mapped this is a single
+ * copy straight out of the mapped memory, otherwise each sector (or window) is copied separately.
+ * This can be used from any thread since it doesn't pin any windows. Returns false if the data
+ * cannot be read, with errno set.
+ */
+static inline bool iso_read(const ISO* iso, void* buf, uint64_t offset, size_t length)
+{
+    if (length == 0) { return true; }
+    uint64_t start = iso_offset(iso, offset);
+    uint64_t end = iso_offset(iso, offset + length - 1) + 1;
+    if (!iso_available(iso, start, end - start)) { return false; }
+    if (iso->raw && iso->sector_size == ISO_SECTOR_SIZE) { memcpy(buf, iso->raw + start, length); return true; }
+    uint8_t* out = (uint8_t*)buf;
+    while (length > 0) {
+        size_t n = iso->sector_size == ISO_SECTOR_SIZE ? length : ISO_SECTOR_SIZE - offset % ISO_SECTOR_SIZE;
+        if (n > length) { n = length; }
+        const uint8_t* data;
+        void* ref = NULL;
+        if (iso->raw) { data = iso->raw + iso_offset(iso, offset); }
+        else {
+            // Hold the window while copying from it so that it isn't unmapped by another thread
+            size_t available;
+            if (!(data = iso->map(iso, iso_offset(iso, offset), &available, &ref))) { return false; }
+            if (n > available) { n = available; }
+        }
+        memcpy(out, data, n);
+        if (ref) { iso->release(iso, ref); }
+        out += n; offset += n; length -= n;
+    }
+    return true;
+}
+
+/**
+ * Starts reading `length` bytes starting at the logical byte `offset` of the ISO ahead of when
+ * they are needed. Images with a fetch function (like a local cache of a slow image) fetch the data
+ * now, otherwise the kernel is asked to start reading it into the page cache. Returns false if the
+ * data cannot be fetched, with errno set.
+ */
+static inline bool iso_prefetch(const ISO* iso, uint64_t offset, uint64_t length)
+{
+    if (length == 0) { return true; }
+    uint64_t start = iso_offset(iso, offset);
+    uint64_t end = iso_offset(iso, offset + length - 1) + 1;
+    if (start >= iso->size) { return true; }
+    if (end > iso->size) { end = iso->size; }
+    if (iso->fetch) { return iso->fetch(iso, start, end - start); }
+#ifdef POSIX_FADV_WILLNEED
+    if ((errno = posix_fadvise(iso->fd, start, end - start, POSIX_FADV_WILLNEED)) != 0) { return false; }
+#else
+    if (iso->raw) {
+        uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE), first = start / page * page;
+        if ((errno = posix_madvise(iso->raw + first, end - first, POSIX_MADV_WILLNEED)) != 0) { return false; }
+    }
+#endif
+    return true;
+}
+
+/**
+ * Gets the root directory record of the directory tree to use. This is the one of the enhanced
+ * volume descriptor if there is one since it has long names, otherwise it is the primary one.
+ */
+static inline const Record* iso_root(const ISO* iso)
+{
+    return &(iso->evd ? iso->evd : iso->pvd)->root_record;
+}
+
+/**
+ * Gets the logical byte offset of a logical block (such as the extent location of a record). This
+ * must be used for all block numbers since large images have blocks past 4 GiB, so the math is done
+ * in 64 bits. Returns false (with errno set) if the `length` bytes starting at the block are not
+ * all within the ISO, but the offset is still set.
+ */
+static inline bool iso_block_offset(const ISO* iso, uint32_t block, uint64_t length, uint64_t* offset)
+{
+    uint64_t size = iso_data_size(iso);
+    *offset = (uint64_t)block * iso->pvd->logical_block_size;
+    if (*offset > size || length > size - *offset) { errno = EINVAL; return false; }
+    return true;
+}
+
 /**
  * An array of names representing the parts of a path. This only supports up to 32 parts.
  */
@@ -96,6 +280,26 @@ path_names* get_path_names(const char* path)
     return NULL;
 }
 
+/**
+ * Parses a size like 1024, 64K, 10M, or 2G into a number of bytes. Returns false if it isn't valid.
+ */
+static inline bool parse_size(const char* str, size_t* size)
+{
+    char* end;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (end == str) { return false; }
+    switch (*end) {
+        case 'G': case 'g': value *= 1024;  // fall through
+        case 'M': case 'm': value *= 1024;  // fall through
+        case 'K': case 'k': value *= 1024; end++; break;
+        case '\0': break;
+        default: return false;
+    }
+    if (*end) { return false; }
+    *size = value;
+    return true;
+}
+
 /**
  * Converts a datetime value to a POSIX time_t value.
  */
@@ -203,39 +407,72 @@ typedef struct _RRExtraData {
     time_t access;       // The last access time
 } RRExtraData;
 
+/**
+ * Gets the system use area of a record (where the SUSP fields are) and its length. The bytes the
+ * SP entry says to skip are skipped, except on the root directory's '.' record which has the SP
+ * entry itself. Returns NULL if the record doesn't have a system use area.
+ */
+static const uint8_t* get_system_use_area(const ISO* iso, const Record* record, size_t* length)
+{
+    // Make sure the Record is within the ISO memory
+    if (iso->raw && (iso->raw+iso->size <= (uint8_t*)record || iso->raw+iso->size-record->length < (uint8_t*)record)) { return NULL; }
+    if (record->length == 0) { return NULL; }
+    const uint8_t* data = ((uint8_t*)&record->filename) + record->filename_length + (1 - record->filename_length % 2);
+    if (data >= (const uint8_t*)record + record->length) { return NULL; }
+    *length = ((uint8_t*)record) + record->length - data;
+    if (iso->susp_skip && !(*length >= 2 && ((const susp_field*)data)->signature == SUSP_SP)) {
+        if (*length <= iso->susp_skip) { return NULL; }
+        data += iso->susp_skip;
+        *length -= iso->susp_skip;
+    }
+    return data;
+}
+
+/**
+ * Follows a SUSP continuation area field, setting data and length to the continuation area.
+ * Returns false if the continuation area is not within the ISO memory or is not available.
+ */
+static bool follow_susp_continuation(const ISO* iso, const susp_field* susp, const uint8_t** data, size_t* length)
+{
+    // Make sure that the new memory block is within the ISO memory and available (it cannot go
+    // past the end of the sector since only the sectors' user data is contiguous)
+    uint64_t data_offset;
+    *length = susp->CE.length;
+    TRACE(rr__continue, (uint32_t)susp->CE.location, (uint32_t)susp->CE.offset, (uint32_t)susp->CE.length);
+    if (!iso_block_offset(iso, susp->CE.location, (uint64_t)susp->CE.offset + *length, &data_offset)) { return false; }
+    data_offset += susp->CE.offset;
+    if ((iso->sector_size != ISO_SECTOR_SIZE && data_offset % ISO_SECTOR_SIZE + *length > ISO_SECTOR_SIZE) ||
+        !iso_fetch(iso, data_offset, *length)) { return false; }
+    *data = iso_ptr(iso, data_offset);
+    return true;
+}
+
 /**
  * Reads the extra Rock Ridge data from the supplemental data section of a directory record. This
  * may not find any information or it may find lots of information. If fills out the given
  * RRExtraData structure with the values it finds and sets the RR_HAS_* flags indicating they are
- * found.
+ * found. Images without Rock Ridge are not looked at at all.
  */
 static void read_rock_ridge_data(const ISO* iso, const Record* record, RRExtraData* rr)
 {
     // Clear some of the fields in the RR data
     rr->flags = 0;
     rr->filename[0] = 0;
-
-    // Make sure the Record is within the ISO memory
-    if (iso->raw+iso->size <= (uint8_t*)record || iso->raw+iso->size-record->length < (uint8_t*)record) { return; }
+    if (!iso->rock_ridge) { return; }
 
     // Get the supplemental data region
-    if (record->length == 0) { return; }
-    const uint8_t* data = ((uint8_t*)&record->filename) + record->filename_length + (1 - record->filename_length % 2);
-    size_t length = ((uint8_t*)record) + record->length - data;
+    size_t length;
+    const uint8_t* data = get_system_use_area(iso, record, &length);
+    if (!data) { return; }
 
     // Go through the data looking at the SUSP fields
     size_t offset = 0;
     while (offset < length) {
         const susp_field* susp = get_susp_field(data+offset, length-offset);
         if (!susp) { return; } // Invalid SUSP data
-        if (susp->signature == SUSP_SP) { offset += susp->SP.len_skp; } // only seems to be on the root record?
-        else if (susp->signature == SUSP_CE) {
-            size_t data_offset = susp->CE.location*iso->pvd->logical_block_size + susp->CE.offset;
-            data = iso->raw + data_offset;
+        if (susp->signature == SUSP_CE) {
+            if (!follow_susp_continuation(iso, susp, &data, &length)) { return; }
             offset = 0;
-            length = susp->CE.length;
-            // Make sure that the new memory block is within the ISO memory
-            if (data_offset + length > iso->size) { return; }
         }
         else if (susp->signature == SUSP_PX) {
             // POSIX file attributes
@@ -291,7 +528,7 @@ static void read_rock_ridge_data(const ISO* iso, const Record* record, RRExtraDa
             // Skip all other timestamps...
         }
 
-        // Ignored: ER, ES, (both of those part of SUSP), PN, SL, CL (those three part of Rock Ridge)
+        // Ignored: SP, ER, ES, (all part of SUSP), PN, SL, CL (those three part of Rock Ridge)
 
         // Advanced and possibly terminate
         if (susp->signature != SUSP_CE) { offset += susp->length; }
@@ -300,19 +537,57 @@ static void read_rock_ridge_data(const ISO* iso, const Record* record, RRExtraDa
 }
 
 /**
- * Gets the filename from a record. This is a bit complicated due to the ISO file format. This
- * function first checks to see if there is a Rock Ridge alternate file name and uses that if
- * available. After that it looks at the filename field in the record itself, translating the
- * current and parent directory indicators and also removes any version information.
- * 
- * The given file name must be at least 256 characters long.
+ * Detects if the ISO uses Rock Ridge, setting the rock_ridge and susp_skip fields of the ISO. This
+ * is done once (for the directory tree that is used) so that images without it don't pay for
+ * looking for SUSP fields in every record.
+ * SUSP is in use if the root directory's '.' record starts with an SP entry and Rock Ridge is in
+ * use if there is also an ER entry for it (or an RR entry, which older images have instead).
  */
-void get_record_filename(const ISO* iso, const Record* record, char filename[256])
+void detect_rock_ridge(ISO* iso)
 {
-    RRExtraData rr;
-    read_rock_ridge_data(iso, record, &rr);
-    if (rr.flags & RR_HAS_FILENAME) {
-        strcpy(filename, rr.filename);
+    iso->rock_ridge = false;
+    iso->susp_skip = 0;
+    const Record* root = iso_root(iso);
+    uint64_t offset;
+    if (!iso_block_offset(iso, root->extent_location, sizeof(Record), &offset) || !iso_fetch(iso, offset, sizeof(Record))) { return; }
+    const Record* record = (const Record*)iso_ptr(iso, offset);
+    if (record->length < sizeof(Record) || !iso_fetch(iso, offset, record->length)) { return; }
+
+    // The SP entry has to be first
+    size_t length;
+    const uint8_t* data = get_system_use_area(iso, record, &length);
+    const susp_field* susp = data ? get_susp_field(data, length) : NULL;
+    if (!susp || susp->signature != SUSP_SP) { return; }
+    uint8_t skip = susp->SP.len_skp;
+
+    // Look for the Rock Ridge extension
+    size_t field = 0;
+    while (field < length) {
+        if (!(susp = get_susp_field(data+field, length-field)) || susp->length == 0 || susp->signature == SUSP_ST) { break; }
+        if (susp->signature == SUSP_CE) {
+            if (!follow_susp_continuation(iso, susp, &data, &length)) { break; }
+            field = 0;
+            continue;
+        }
+        if (susp->signature == SUSP_RR) { iso->rock_ridge = true; }
+        if (susp->signature == SUSP_ER) {
+            const char* id = (const char*)susp->ER.ext_id;
+            uint8_t len_id = susp->ER.len_id;
+            if ((len_id == 10 && (memcmp(id, "RRIP_1991A", 10) == 0 || memcmp(id, "IEEE_P1282", 10) == 0)) ||
+                (len_id == 9 && memcmp(id, "IEEE_1282", 9) == 0)) { iso->rock_ridge = true; }
+        }
+        field += susp->length;
+    }
+    if (iso->rock_ridge) { iso->susp_skip = skip; }
+}
+
+/**
+ * Same as get_record_filename() except that it uses Rock Ridge data that has already been read.
+ */
+void get_record_filename_rr(const Record* record, const RRExtraData* rr, char filename[256])
+{
+    if (rr->flags & RR_HAS_FILENAME) {
+        strcpy(filename, rr->filename);
     } else if (record->filename[0] == 0) {
         strcpy(filename, ".");
     } else if (record->filename[0] == 1) {
@@ -321,15 +596,31 @@ void get_record_filename(const ISO* iso, const Record* record, char filename[256
         strncpy(filename, record->filename, record->filename_length);
         // Make sure it is null-terminated
         filename[record->filename_length] = 0;
-        // If it is a filename with a version remove the version
+        // If it is a filename with a version remove the version (names in ISO 9660:1999 trees
+        // don't need a version and can have semicolons in them)
         char* semicolon = strrchr(filename, ';');
-        if (semicolon) { semicolon[0] = 0; }
+        if (semicolon && semicolon[1] && strspn(semicolon + 1, "0123456789") == strlen(semicolon + 1)) { semicolon[0] = 0; }
         // Remove a trailing period if it is there
         size_t length = strlen(filename);
         if (filename[length-1] == '.') { filename[length-1] = 0; }
     }
 }
 
+/**
+ * Gets the filename from a record. This is a bit complicated due to the ISO file format. This
+ * function first checks to see if there is a Rock Ridge alternate file name and uses that if
+ * available. After that it looks at the filename field in the record itself, translating the
+ * current and parent directory indicators and also removes any version information.
+ * 
+ * The given file name must be at least 256 characters long.
+ */
+void get_record_filename(const ISO* iso, const Record* record, char filename[256])
+{
+    RRExtraData rr;
+    read_rock_ridge_data(iso, record, &rr);
+    get_record_filename_rr(record, &rr, filename);
+}
+
 /**
  * Gets the approximate number of files by returning the number of entries in the path table. This
  * value is approximate in several circumstances, in particular this value will never be at more
@@ -339,13 +630,15 @@ void get_record_filename(const ISO* iso, const Record* record, char filename[256
 size_t get_number_of_files(const ISO* iso)
 {
     size_t count = 0;
-    size_t bs = iso->pvd->logical_block_size;
-    size_t offset = iso->pvd->path_table_loc*bs;
-    size_t end = offset + iso->pvd->path_table_size;
-    while (offset < end && offset < iso->size) {
+    uint64_t offset;
+    if (!iso_block_offset(iso, iso->pvd->path_table_loc, iso->pvd->path_table_size, &offset)) { return 0; }
+    uint64_t end = offset + iso->pvd->path_table_size;
+    if (!iso_fetch(iso, offset, iso->pvd->path_table_size)) { return 0; }
+    while (offset < end) {
         count++;
         // First byte of path table entry is length of name, but needs to be rounded up to an even number
-        offset += 8 + iso->raw[offset] + iso->raw[offset] % 2;
+        uint8_t length = *iso_ptr(iso, offset);
+        offset += 8 + length + length % 2;
     }
     return count;
 }
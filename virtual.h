@@ -0,0 +1,404 @@
+/**
+ * Files generated by isofs that show up in the /.isofs directory of the mount instead of coming
+ * from the image. Their nodes are added to the index after it is built so they are looked up and
+ * listed just like the other files, except that /.isofs itself is left out of the listing of the
+ * root so that walking the mount (with du, find, tar, and so on) only sees the image. The contents of each one are only generated the first time it
+ * is used (which can be from any thread) and are kept in memory after that, unless memory is short
+ * (see pressure.h) in which case they are dropped and generated again the next time.
+ *
+ *   /.isofs/stats     one line for each directory with its recursive totals, as
+ *                     "SIZE FILES DIRECTORIES PATH" (like `du -s --apparent-size -b` for all of them)
+ *                     after lines starting with # that have the memory used by the index and (made
+ *                     each time it is opened) the memory budget of the caches (see pressure.h)
+ *   /.isofs/manifest  one line for each file and directory in the image, as
+ *                     "INODE TYPE MODE SIZE MTIME OFFSET PATH" where TYPE is one of the letters used
+ *                     by `find -type`, MODE is in octal, and OFFSET is where the data starts in the
+ *                     image (or - for directories and files without any data)
+ *   /.isofs/plan      can be written by the user that mounted the image (the only other file that
+ *                     can is the swap file), takes the order that files will be read in so they can
+ *                     be read ahead of time (see prefetch.h), and reads as empty
+ *   /.isofs/users     how much each user has read and is reading, made each time it is opened (see
+ *                     fairshare.h)
+ *   /.isofs/swap      the image files being served, one on each line, which the user that mounted
+ *                     the image can write other image files to so that they are loaded and swapped
+ *                     in when it is closed (see image.h)
+ *
+ *   /.isofs/query/    an empty directory where any file name is a query that gives the paths of
+ *                     the matching files (see query.h)
+ *   /.isofs/tar/      mirrors the directories of the image with a tar archive of each one, which
+ *                     can be looked up but aren't listed (see tar.h)
+ *   /.isofs/bundle/   an empty directory where any file name is a query that gives the contents of
+ *                     all of the matching files at once (see bundle.h)
+ *
+ * Paths are always last on each line so they can have spaces in them.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#define VIRTUAL_DIR ".isofs" // name of the directory in the root with the generated files
+#define QUERY_DIR   "query"  // name of the directory in VIRTUAL_DIR that has the queries
+#define TAR_DIR     "tar"    // name of the directory in VIRTUAL_DIR that has the tar archives
+#define BUNDLE_DIR  "bundle" // name of the directory in VIRTUAL_DIR that has the bundles
+#define STATS_FILE  "stats"  // name of the file in VIRTUAL_DIR with the totals of each directory
+#define PLAN_FILE   "plan"   // name of the file in VIRTUAL_DIR that read plans are written to
+#define USERS_FILE  "users"  // name of the file in VIRTUAL_DIR with how much each user is reading
+#define SWAP_FILE   "swap"   // name of the file in VIRTUAL_DIR that new image files are written to
+#define GENERATED_CACHE_BYTES (256*1024*1024) // most memory kept for the contents of generated files
+
+/**
+ * A growable string that generated files are written into.
+ */
+typedef struct _TextBuffer {
+    char* data;
+    size_t length, capacity;
+} TextBuffer;
+
+/**
+ * Appends formatted text to a buffer. Returns false if out of memory.
+ */
+static bool text_printf(TextBuffer* text, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (length < 0) { return false; }
+    if (text->capacity - text->length <= (size_t)length) {
+        size_t capacity = text->capacity ? text->capacity : 4096;
+        while (capacity - text->length <= (size_t)length) { capacity *= 2; }
+        char* data = (char*)realloc(text->data, capacity);
+        if (!data) { return false; }
+        text->data = data;
+        text->capacity = capacity;
+    }
+    va_start(args, format);
+    vsnprintf(text->data + text->length, text->capacity - text->length, format, args);
+    va_end(args);
+    text->length += length;
+    return true;
+}
+
+/**
+ * Appends `length` characters to a buffer. Returns false if out of memory.
+ */
+static bool text_append(TextBuffer* text, const char* str, size_t length)
+{
+    if (length == 0) { return true; }
+    if (text->capacity - text->length <= length) {
+        size_t capacity = text->capacity ? text->capacity : 4096;
+        while (capacity - text->length <= length) { capacity *= 2; }
+        char* data = (char*)realloc(text->data, capacity);
+        if (!data) { return false; }
+        text->data = data;
+        text->capacity = capacity;
+    }
+    memcpy(text->data + text->length, str, length);
+    text->length += length;
+    text->data[text->length] = 0;
+    return true;
+}
+
+/**
+ * Removes text from the end of a buffer so that it is only `length` characters long.
+ */
+static inline void text_truncate(TextBuffer* text, size_t length)
+{
+    text->length = length;
+    if (text->data) { text->data[length] = 0; }
+}
+
+/**
+ * The contents of a generated file, made by its generate function the first time they are needed.
+ */
+typedef struct _GeneratedFile {
+    bool (*generate)(const Index* index, TextBuffer* text); // writes the contents of the file
+    pthread_mutex_t lock;  // held while generating, using, or dropping the contents
+    bool done;             // if the contents have been generated (and not dropped since)
+    TextBuffer text;       // the contents
+    bool known;            // if the length of the contents is known, which is kept when they are dropped
+    size_t length;         // the length of the contents once known
+    size_t limit;          // most bytes kept for the contents of all generated files of the index
+} GeneratedFile;
+
+/**
+ * Drops the contents of a generated file. The lock must be held.
+ */
+static void generated_drop(GeneratedFile* file)
+{
+    free(file->text.data);
+    file->text.data = NULL;
+    file->text.length = file->text.capacity = 0;
+    file->done = false;
+}
+
+/**
+ * Drops the contents of the generated files of a directory other than `keep` while they use more
+ * than the limit (largest first). If keep isn't NULL its lock must be held, and files that are in
+ * use are skipped so that two files are never waited for at once.
+ */
+static void generated_trim(Node* dir, GeneratedFile* keep, size_t limit)
+{
+    for (;;) {
+        size_t kept = keep ? keep->text.capacity : 0;
+        GeneratedFile* largest = NULL;
+        for (uint32_t i = 0; i < dir->nchildren; i++) {
+            GeneratedFile* file = dir->children[i]->generated;
+            if (!file || file == keep || pthread_mutex_trylock(&file->lock) != 0) { continue; }
+            kept += file->text.capacity;
+            if (file->done && (!largest || file->text.capacity > largest->text.capacity)) { largest = file; }
+            pthread_mutex_unlock(&file->lock);
+        }
+        if (kept <= limit || !largest) { return; }
+        if (keep ? pthread_mutex_trylock(&largest->lock) != 0 : pthread_mutex_lock(&largest->lock) != 0) { return; }
+        generated_drop(largest);
+        pthread_mutex_unlock(&largest->lock);
+    }
+}
+
+/**
+ * Locks a generated file with its contents, generating them if this is the first time (or they
+ * were dropped). The lock must be released with pthread_mutex_unlock(). Returns NULL if they
+ * cannot be generated, with errno set.
+ */
+static GeneratedFile* generated_hold(const Index* index, const Node* node)
+{
+    GeneratedFile* file = node->generated;
+    pthread_mutex_lock(&file->lock);
+    if (file->done) { return file; }
+    if (!file->generate(index, &file->text)) {
+        generated_drop(file);
+        pthread_mutex_unlock(&file->lock);
+        errno = ENOMEM;
+        return NULL;
+    }
+    file->done = true;
+    file->length = file->text.length;
+    __atomic_store_n(&file->known, true, __ATOMIC_RELEASE);
+    generated_trim(node->parent, file, file->limit); // make room for these contents
+    return file;
+}
+
+/**
+ * Gets the size of a node, which for generated files means generating them if it isn't known yet.
+ * Returns -1 if there is a problem, with errno set.
+ */
+int64_t generated_size(const Index* index, const Node* node)
+{
+    if (!node->generated) { return node->size; }
+    if (__atomic_load_n(&node->generated->known, __ATOMIC_ACQUIRE)) { return node->generated->length; }
+    GeneratedFile* file = generated_hold(index, node);
+    if (!file) { return -1; }
+    int64_t size = file->text.length;
+    pthread_mutex_unlock(&file->lock);
+    return size;
+}
+
+/**
+ * Reads the contents of a generated file. Returns the number of bytes read or -1 if there is a
+ * problem, with errno set.
+ */
+ssize_t generated_read(const Index* index, const Node* node, void* buf, size_t size, uint64_t offset)
+{
+    GeneratedFile* file = generated_hold(index, node);
+    if (!file) { return -1; }
+    if (offset >= file->text.length) { size = 0; }
+    else if (file->text.length - offset < size) { size = file->text.length - offset; }
+    if (size) { memcpy(buf, file->text.data + offset, size); }
+    pthread_mutex_unlock(&file->lock);
+    return size;
+}
+
+/**
+ * Appends the contents of a generated file to a buffer. Returns false if there is a problem, with
+ * errno set.
+ */
+bool generated_append(const Index* index, const Node* node, TextBuffer* text)
+{
+    GeneratedFile* file = generated_hold(index, node);
+    if (!file) { return false; }
+    bool ok = text_append(text, file->text.data, file->text.length);
+    pthread_mutex_unlock(&file->lock);
+    if (!ok) { errno = ENOMEM; }
+    return ok;
+}
+
+/**
+ * Changes how many bytes the contents of the generated files of an index can use, dropping the
+ * contents that are over the limit right away. This is the resize function of the generated
+ * files as a cache (see pressure.h), where the data is the index.
+ */
+void generated_resize(void* data, size_t limit)
+{
+    Node* dir = ((Index*)data)->generated;
+    for (uint32_t i = 0; i < dir->nchildren; i++) {
+        GeneratedFile* file = dir->children[i]->generated;
+        if (!file) { continue; }
+        pthread_mutex_lock(&file->lock);
+        file->limit = limit;
+        pthread_mutex_unlock(&file->lock);
+    }
+    generated_trim(dir, NULL, limit);
+}
+
+/**
+ * Calls a function for each directory and file in the index (except the generated ones) with its
+ * path, parents before their children. The path buffer is used for the paths of the children as
+ * well. Stops and returns false if the function does.
+ */
+static bool virtual_walk(const Index* index, const Node* node, TextBuffer* path, TextBuffer* text,
+                         bool (*func)(const Node* node, const char* path, TextBuffer* text))
+{
+    if (!func(node, path->length ? path->data : "/", text)) { return false; }
+    size_t length = path->length;
+    for (uint32_t i = 0; i < node->nchildren; i++) {
+        const Node* child = node->children[i];
+        if (child == index->generated) { continue; }
+        if (!text_printf(path, "/%s", child->name) || !virtual_walk(index, child, path, text, func)) { return false; }
+        text_truncate(path, length);
+    }
+    return true;
+}
+
+/**
+ * Calls a function for each directory and file in the index with its path, see virtual_walk().
+ */
+static bool virtual_walk_all(const Index* index, TextBuffer* text, bool (*func)(const Node* node, const char* path, TextBuffer* text))
+{
+    TextBuffer path = { NULL, 0, 0 };
+    bool ok = virtual_walk(index, index->root, &path, text, func);
+    free(path.data);
+    return ok;
+}
+
+/**
+ * Writes the line of the stats file for a directory.
+ */
+static bool virtual_stats_line(const Node* node, const char* path, TextBuffer* text)
+{
+    if (!S_ISDIR(node->mode)) { return true; }
+    return text_printf(text, "%" PRIu64 " %" PRIu64 " %" PRIu64 " %s\n", node->total_size, node->total_files, node->total_dirs, path);
+}
+
+static bool generate_stats(const Index* index, TextBuffer* text)
+{
+    if (!text_printf(text, "# index memory: %zu bytes\n", index_memory(index))) { return false; }
+    if (index->trigrams && !text_printf(text, "# trigram index memory: %zu bytes\n", index->trigrams->memory)) { return false; }
+    return virtual_walk_all(index, text, virtual_stats_line);
+}
+
+/**
+ * Gets the letter used for the type of a file by `find -type`.
+ */
+static char virtual_type(mode_t mode)
+{
+    switch (mode & S_IFMT) {
+        case S_IFDIR: return 'd';
+        case S_IFLNK: return 'l';
+        case S_IFCHR: return 'c';
+        case S_IFBLK: return 'b';
+        case S_IFIFO: return 'p';
+        case S_IFSOCK: return 's';
+        default: return 'f';
+    }
+}
+
+/**
+ * Writes the line of the manifest for a file or directory.
+ */
+static bool virtual_manifest_line(const Node* node, const char* path, TextBuffer* text)
+{
+    char offset[24] = "-";
+    if (node->nextents && node->extents[0].start != EXTENT_HOLE) { snprintf(offset, sizeof(offset), "%" PRIu64, node->extents[0].start); }
+    return text_printf(text, "%ju %c %o %" PRIu64 " %jd %s %s\n", (uintmax_t)node->ino, virtual_type(node->mode),
+                       (unsigned)(node->mode & 07777), node->size, (intmax_t)node->mtime, offset, path);
+}
+
+static bool generate_manifest(const Index* index, TextBuffer* text)
+{
+    return virtual_walk_all(index, text, virtual_manifest_line);
+}
+
+// The generated files, in order by name
+static const struct {
+    const char* name;
+    bool (*generate)(const Index* index, TextBuffer* text);
+} virtual_files[] = {
+    { "manifest", generate_manifest },
+    { STATS_FILE, generate_stats },
+};
+#define VIRTUAL_FILE_COUNT (sizeof(virtual_files) / sizeof(virtual_files[0]))
+
+/**
+ * Creates a node for a generated file or directory in the index. It gets the owner and times of
+ * the root directory.
+ */
+static Node* virtual_new_node(Index* index, Node* parent, const char* name, mode_t mode)
+{
+    Node* node = index_new_node(index, parent, name);
+    if (!node) { return NULL; }
+    node->mode = mode;
+    node->nlink = S_ISDIR(mode) ? 2 : 1;
+    node->uid = index->root->uid;
+    node->gid = index->root->gid;
+    node->mtime = index->root->mtime;
+    node->atime = index->root->atime;
+    node->ctime = index->root->ctime;
+    return node;
+}
+
+/**
+ * Adds the /.isofs directory with the generated files to an index. Their contents are generated
+ * later, when they are first used. If the image has its own /.isofs then nothing is added. Returns
+ * false if out of memory.
+ */
+bool index_add_virtual_files(Index* index)
+{
+    if (index_find_child(index->root, VIRTUAL_DIR, strlen(VIRTUAL_DIR))) {
+        fprintf(stderr, "image has a /%s already, generated files are not available\n", VIRTUAL_DIR);
+        return true;
+    }
+    Node* dir = virtual_new_node(index, index->root, VIRTUAL_DIR, S_IFDIR | 0555);
+    if (!dir) { return false; }
+    Node* files[VIRTUAL_FILE_COUNT];
+    for (size_t i = 0; i < VIRTUAL_FILE_COUNT; i++) {
+        GeneratedFile* file = (GeneratedFile*)index_alloc(index, sizeof(GeneratedFile));
+        if (!file || !(files[i] = virtual_new_node(index, dir, virtual_files[i].name, S_IFREG | 0444))) { return false; }
+        memset(file, 0, sizeof(GeneratedFile));
+        file->generate = virtual_files[i].generate;
+        file->limit = GENERATED_CACHE_BYTES;
+        pthread_mutex_init(&file->lock, NULL);
+        files[i]->generated = file;
+    }
+    Node* query = virtual_new_node(index, dir, QUERY_DIR, S_IFDIR | 0555);
+    Node* tar = virtual_new_node(index, dir, TAR_DIR, S_IFDIR | 0555);
+    Node* bundle = virtual_new_node(index, dir, BUNDLE_DIR, S_IFDIR | 0555);
+    Node* plan = virtual_new_node(index, dir, PLAN_FILE, S_IFREG | 0644);
+    Node* users = virtual_new_node(index, dir, USERS_FILE, S_IFREG | 0444);
+    Node* swap = virtual_new_node(index, dir, SWAP_FILE, S_IFREG | 0644);
+    if (swap) { swap->uid = getuid(); swap->gid = getgid(); } // only the user that mounted it can swap
+    if (plan) { plan->uid = getuid(); plan->gid = getgid(); } // or change the plan that everyone shares
+    if (!query || !tar || !bundle || !plan || !users || !swap || !index_set_children(index, dir, files, VIRTUAL_FILE_COUNT) ||
+        !index_add_child(index, dir, query) || !index_add_child(index, dir, tar) || !index_add_child(index, dir, bundle) ||
+        !index_add_child(index, dir, plan) || !index_add_child(index, dir, users) || !index_add_child(index, dir, swap) ||
+        !index_add_child(index, index->root, dir)) { return false; }
+    dir->nlink += 3; // the root doesn't count it since it isn't listed there
+    index->generated = dir;
+    return true;
+}
+
+/**
+ * Frees the contents of the generated files of an index, this must be done before the index is freed.
+ */
+void free_virtual_files(Index* index)
+{
+    if (!index->generated) { return; }
+    for (uint32_t i = 0; i < index->generated->nchildren; i++) {
+        GeneratedFile* file = index->generated->children[i]->generated;
+        if (!file) { continue; }
+        pthread_mutex_destroy(&file->lock);
+        free(file->text.data);
+    }
+}
@@ -0,0 +1,184 @@
+/**
+ * Windowed mapping of images for hosts with little address space (like 32-bit systems) where
+ * mapping a large image all at once fails. The image is split into fixed-size windows that are
+ * mapped the first time they are used. Once more than MAP_MAX_WINDOWS are mapped (or fewer when
+ * memory is short, see pressure.h), the least recently used windows that aren't in use are unmapped
+ * again, so both the address space and the number of mappings stay bounded. Each window also maps
+ * MAP_WINDOW_OVERLAP bytes past its end so that any sector or structure that starts in a window can
+ * be used entirely from that window.
+ *
+ * Readers hold a reference to a window while copying out of it so it cannot be unmapped by another
+ * thread in the meantime. Pointers given by iso_ptr() (which are only used while building the
+ * index) pin their windows instead, until iso_unpin() is called.
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define MAP_WINDOW_SIZE    (64*1024*1024) // default size of each window
+#define MAP_WINDOW_OVERLAP (64*1024)      // extra bytes mapped past the end of each window
+#define MAP_MAX_WINDOWS    8              // windows kept mapped when they aren't being used
+
+typedef struct _MapWindow {
+    uint8_t* data;            // the mapped memory, NULL if the window isn't mapped
+    size_t length;            // length of the mapping
+    unsigned refs;            // number of readers copying from the window
+    bool pinned;              // if pointers from iso_ptr() into the window may be in use
+    struct _MapWindow* prev;  // the next more recently used mapped window
+    struct _MapWindow* next;  // the next less recently used mapped window
+} MapWindow;
+
+typedef struct _MapWindows {
+    int fd;               // file descriptor of the file being mapped
+    int flags;            // MAP_PRIVATE or MAP_SHARED
+    uint64_t size;        // size of the file
+    size_t window_size;   // size of each window (a multiple of the page size)
+    size_t nwindows;      // number of windows the file is split into
+    size_t nmapped;       // number of windows that are currently mapped
+    size_t max_windows;   // windows kept mapped when they aren't being used
+    MapWindow* windows;   // all of the windows in order
+    MapWindow* recent;    // most recently used mapped window
+    MapWindow* oldest;    // least recently used mapped window
+    pthread_mutex_t lock; // held while using any of the above
+} MapWindows;
+
+/**
+ * Removes a window from the list of mapped windows.
+ */
+static void map_window_unlink(MapWindows* maps, MapWindow* window)
+{
+    if (window->prev) { window->prev->next = window->next; } else { maps->recent = window->next; }
+    if (window->next) { window->next->prev = window->prev; } else { maps->oldest = window->prev; }
+    window->prev = window->next = NULL;
+}
+
+/**
+ * Adds a window to the front of the list of mapped windows.
+ */
+static void map_window_push(MapWindows* maps, MapWindow* window)
+{
+    window->prev = NULL;
+    window->next = maps->recent;
+    if (maps->recent) { maps->recent->prev = window; } else { maps->oldest = window; }
+    maps->recent = window;
+}
+
+/**
+ * Unmaps the least recently used windows that aren't being used until only max_windows are mapped
+ * (or all of the rest are in use). Must be called with the lock held.
+ */
+static void map_windows_trim(MapWindows* maps)
+{
+    MapWindow* window = maps->oldest;
+    while (maps->nmapped > maps->max_windows && window) {
+        MapWindow* prev = window->prev;
+        if (!window->refs && !window->pinned) {
+            map_window_unlink(maps, window);
+            munmap(window->data, window->length);
+            window->data = NULL;
+            maps->nmapped--;
+        }
+        window = prev;
+    }
+}
+
+/**
+ * Gets a pointer to the raw data at the given offset of an image mapped in windows, mapping its
+ * window if needed. This is the map function of the ISO.
+ */
+const uint8_t* map_window_get(const ISO* iso, uint64_t offset, size_t* available, void** ref)
+{
+    MapWindows* maps = (MapWindows*)iso->map_data;
+    if (offset >= maps->size) { errno = EINVAL; return NULL; }
+    pthread_mutex_lock(&maps->lock);
+    size_t i = (size_t)(offset / maps->window_size); // less than nwindows, see map_windows_open()
+    MapWindow* window = &maps->windows[i];
+    uint64_t start = (uint64_t)i * maps->window_size;
+    if (window->data) {
+        map_window_unlink(maps, window);
+    } else {
+        uint64_t remaining = maps->size - start;
+        window->length = remaining < maps->window_size + MAP_WINDOW_OVERLAP ? (size_t)remaining : maps->window_size + MAP_WINDOW_OVERLAP;
+        void* data = mmap(NULL, window->length, PROT_READ, maps->flags, maps->fd, (off_t)start);
+        if (data == MAP_FAILED) { pthread_mutex_unlock(&maps->lock); return NULL; }
+        TRACE(window__map, start, window->length);
+        window->data = (uint8_t*)data;
+        maps->nmapped++;
+    }
+    map_window_push(maps, window);
+    if (ref) { window->refs++; *ref = window; } else { window->pinned = true; }
+    map_windows_trim(maps);
+    pthread_mutex_unlock(&maps->lock);
+    *available = window->length - (offset - start);
+    return window->data + (offset - start);
+}
+
+/**
+ * Releases a window that was being read from or, if given NULL, unpins all windows. This is the
+ * release function of the ISO.
+ */
+void map_window_release(const ISO* iso, void* ref)
+{
+    MapWindows* maps = (MapWindows*)iso->map_data;
+    pthread_mutex_lock(&maps->lock);
+    if (ref) { ((MapWindow*)ref)->refs--; }
+    else {
+        for (MapWindow* window = maps->recent; window; window = window->next) { window->pinned = false; }
+    }
+    map_windows_trim(maps);
+    pthread_mutex_unlock(&maps->lock);
+}
+
+/**
+ * Changes how many bytes of windows are kept mapped when they aren't being used (at least one
+ * window), unmapping windows right away if there are too many. This is the resize function of the
+ * cache of windows (see pressure.h).
+ */
+void map_windows_resize(void* data, size_t limit)
+{
+    MapWindows* maps = (MapWindows*)data;
+    pthread_mutex_lock(&maps->lock);
+    maps->max_windows = limit / maps->window_size ? limit / maps->window_size : 1;
+    map_windows_trim(maps);
+    pthread_mutex_unlock(&maps->lock);
+}
+
+/**
+ * Unmaps all windows and frees the memory used for mapping an image in windows.
+ */
+void map_windows_close(MapWindows* maps)
+{
+    for (size_t i = 0; i < maps->nwindows; i++) {
+        if (maps->windows[i].data) { munmap(maps->windows[i].data, maps->windows[i].length); }
+    }
+    pthread_mutex_destroy(&maps->lock);
+    free(maps->windows);
+    free(maps);
+}
+
+/**
+ * Sets up an ISO to be mapped in windows of the given size (rounded up to a multiple of the page
+ * size) from the file descriptor. Returns false if out of memory or there would be too many
+ * windows, with errno set.
+ */
+bool map_windows_open(ISO* iso, int fd, int flags, size_t window_size)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    MapWindows* maps = (MapWindows*)calloc(1, sizeof(MapWindows));
+    if (!maps) { return false; }
+    maps->fd = fd;
+    maps->flags = flags;
+    maps->size = iso->size;
+    maps->window_size = (window_size + page_size - 1) / page_size * page_size;
+    uint64_t nwindows = (maps->size + maps->window_size - 1) / maps->window_size;
+    if (nwindows > SIZE_MAX / sizeof(MapWindow)) { free(maps); errno = EFBIG; return false; }
+    maps->nwindows = (size_t)nwindows;
+    maps->max_windows = MAP_MAX_WINDOWS;
+    if (!(maps->windows = (MapWindow*)calloc(maps->nwindows ? maps->nwindows : 1, sizeof(MapWindow)))) { free(maps); return false; }
+    pthread_mutex_init(&maps->lock, NULL);
+    iso->map = map_window_get;
+    iso->release = map_window_release;
+    iso->map_data = maps;
+    return true;
+}